@@ -0,0 +1,303 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include "tinycl.h"
+#include "sparsematrix.h"
+#include "linearoperator.h"
+#include "cgsolver.h"
+#include "solvestats.h"
+#include "fluidsystem.h"
+
+/*
+* A headless benchmark of the CG solver for tracking its performance across builds and devices.
+* Each case is a fluid grid or a Matrix Market file, for which the time taken to build the
+* operator on the host (setup), to upload it and the solver's buffers and kernels (upload) and
+* to run the solves is measured, with some warmup solves before the timed repetitions. The
+* results are written as JSON and/or CSV, and a summary printed to stdout
+* Usage: bench [--device cpu|gpu] [--sizes 16,32,64] [--matrix file]... [--warmup n] [--reps n]
+*	[--iter n] [--tol t] [--json file] [--csv file]
+*/
+
+typedef std::chrono::high_resolution_clock Clock;
+
+struct Options {
+	tcl::DEVICE device;
+	std::vector<int> sizes;
+	std::vector<std::string> matrices;
+	int warmup, reps, iter;
+	float tol;
+	std::string json, csv;
+
+	Options() : device(tcl::DEVICE::CPU), sizes({ 16, 32, 64, 128 }), warmup(2), reps(10), iter(1000), tol(1e-5f)
+	{}
+};
+//The results of one benchmark case, times are in milliseconds
+struct Result {
+	std::string name;
+	int dim, nonZeros;
+	double setup, upload;
+	//Wall time of each timed solve and the iterations it took
+	std::vector<double> solves;
+	std::vector<int> iterations;
+	//Mean device time of the solves, if profiling is available
+	double deviceTime;
+	//If the solves ran in a single work group
+	bool localSolve, converged;
+	float finalResidual;
+
+	double mean() const {
+		double sum = 0;
+		for (double t : solves){
+			sum += t;
+		}
+		return solves.empty() ? 0 : sum / solves.size();
+	}
+	double stddev() const {
+		double m = mean(), sq = 0;
+		for (double t : solves){
+			sq += (t - m) * (t - m);
+		}
+		return solves.empty() ? 0 : std::sqrt(sq / solves.size());
+	}
+	double min() const {
+		return solves.empty() ? 0 : *std::min_element(solves.begin(), solves.end());
+	}
+	double max() const {
+		return solves.empty() ? 0 : *std::max_element(solves.begin(), solves.end());
+	}
+	double meanIterations() const {
+		double sum = 0;
+		for (int i : iterations){
+			sum += i;
+		}
+		return iterations.empty() ? 0 : sum / iterations.size();
+	}
+	double perIteration() const {
+		double its = meanIterations();
+		return its == 0 ? 0 : mean() / its;
+	}
+};
+
+double elapsed(Clock::time_point start){
+	return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+Options parseArgs(int argc, char **argv){
+	Options opts;
+	bool defaultMatrices = true;
+	for (int i = 1; i < argc; ++i){
+		std::string arg = argv[i];
+		if (i + 1 >= argc){
+			throw std::runtime_error("missing value for " + arg);
+		}
+		std::string val = argv[++i];
+		if (arg == "--device"){
+			if (val != "cpu" && val != "gpu"){
+				throw std::runtime_error("unknown device " + val + ", expected cpu or gpu");
+			}
+			opts.device = val == "cpu" ? tcl::DEVICE::CPU : tcl::DEVICE::GPU;
+		}
+		else if (arg == "--sizes"){
+			opts.sizes.clear();
+			std::stringstream ss(val);
+			std::string s;
+			while (std::getline(ss, s, ',')){
+				if (!s.empty()){
+					opts.sizes.push_back(std::stoi(s));
+				}
+			}
+		}
+		else if (arg == "--matrix"){
+			if (defaultMatrices){
+				opts.matrices.clear();
+				defaultMatrices = false;
+			}
+			opts.matrices.push_back(val);
+		}
+		else if (arg == "--warmup"){
+			opts.warmup = std::stoi(val);
+		}
+		else if (arg == "--reps"){
+			opts.reps = std::max(std::stoi(val), 1);
+		}
+		else if (arg == "--iter"){
+			opts.iter = std::stoi(val);
+		}
+		else if (arg == "--tol"){
+			opts.tol = std::stof(val);
+		}
+		else if (arg == "--json"){
+			opts.json = val;
+		}
+		else if (arg == "--csv"){
+			opts.csv = val;
+		}
+		else {
+			throw std::runtime_error("unknown option " + arg);
+		}
+	}
+	if (defaultMatrices){
+		opts.matrices.push_back("../res/bcsstk01.mtx");
+	}
+	return opts;
+}
+//Run the benchmark for a matrix, the matrix is built by makeMatrix so its setup can be timed
+template<class F>
+Result runCase(const std::string &name, F makeMatrix, bool fluid, const Options &opts, tcl::Context &context){
+	Result res;
+	res.name = name;
+	Clock::time_point start = Clock::now();
+	SparseMatrix<float> matrix = makeMatrix();
+	if (matrix.dim == 0){
+		throw std::runtime_error("no matrix to benchmark for " + name);
+	}
+	std::shared_ptr<SparseOperator> op = std::make_shared<SparseOperator>(matrix);
+	res.setup = elapsed(start);
+	res.dim = matrix.dim;
+	res.nonZeros = matrix.nonZeros();
+
+	std::vector<float> b = fluid ? createFluidRHS(res.dim) : std::vector<float>(res.dim, 1.f);
+	start = Clock::now();
+	CGSolver solver(op, b, context, opts.iter, opts.tol);
+	context.mQueue.finish();
+	res.upload = elapsed(start);
+	solver.setTelemetry(false, true);
+	res.localSolve = solver.usesLocalSolve();
+
+	for (int i = 0; i < opts.warmup; ++i){
+		solver.solve();
+	}
+	SolveStatsSummary summary;
+	for (int i = 0; i < opts.reps; ++i){
+		start = Clock::now();
+		solver.solve();
+		res.solves.push_back(elapsed(start));
+		res.iterations.push_back(solver.getStats().iterations);
+		summary.add(solver.getStats());
+	}
+	res.deviceTime = summary.meanSpMVTime() + summary.meanReductionTime() + summary.meanUpdateTime()
+		+ summary.meanPreconditionerTime();
+	res.converged = summary.unconverged() == 0;
+	res.finalResidual = summary.maxFinalResidual();
+	return res;
+}
+std::string jsonString(const std::string &s){
+	std::string out = "\"";
+	for (char c : s){
+		if (c == '"' || c == '\\'){
+			out += '\\';
+		}
+		out += c;
+	}
+	return out + "\"";
+}
+void writeJSON(const std::string &file, const std::vector<Result> &results, const Options &opts,
+	const std::string &device, const std::string &version)
+{
+	std::ofstream out(file.c_str());
+	if (!out.is_open()){
+		throw std::runtime_error("failed to open " + file);
+	}
+	out << "{\n\t\"device\": " << jsonString(device) << ",\n\t\"version\": " << jsonString(version)
+		<< ",\n\t\"warmup\": " << opts.warmup << ",\n\t\"reps\": " << opts.reps << ",\n\t\"max_iterations\": "
+		<< opts.iter << ",\n\t\"tolerance\": " << opts.tol << ",\n\t\"results\": [";
+	for (size_t i = 0; i < results.size(); ++i){
+		const Result &r = results[i];
+		out << (i == 0 ? "\n" : ",\n") << "\t\t{ \"name\": " << jsonString(r.name) << ", \"dim\": " << r.dim
+			<< ", \"nonzeros\": " << r.nonZeros << ", \"setup_ms\": " << r.setup << ", \"upload_ms\": " << r.upload
+			<< ", \"solve_ms\": { \"mean\": " << r.mean() << ", \"stddev\": " << r.stddev() << ", \"min\": " << r.min()
+			<< ", \"max\": " << r.max() << " }, \"iterations\": " << r.meanIterations()
+			<< ", \"iteration_ms\": " << r.perIteration() << ", \"device_ms\": " << r.deviceTime
+			<< ", \"local_solve\": " << (r.localSolve ? "true" : "false")
+			<< ", \"converged\": " << (r.converged ? "true" : "false") << ", \"final_residual\": " << r.finalResidual
+			<< ", \"runs_ms\": [";
+		for (size_t j = 0; j < r.solves.size(); ++j){
+			out << (j == 0 ? "" : ", ") << r.solves[j];
+		}
+		out << "] }";
+	}
+	out << "\n\t]\n}\n";
+}
+//Quote a CSV field, doubling any quotes in it
+std::string csvString(const std::string &s){
+	std::string out = "\"";
+	for (char c : s){
+		if (c == '"'){
+			out += '"';
+		}
+		out += c;
+	}
+	return out + "\"";
+}
+void writeCSV(const std::string &file, const std::vector<Result> &results, const std::string &device){
+	std::ofstream out(file.c_str());
+	if (!out.is_open()){
+		throw std::runtime_error("failed to open " + file);
+	}
+	out << "device,name,dim,nonzeros,setup_ms,upload_ms,solve_mean_ms,solve_stddev_ms,solve_min_ms,solve_max_ms,"
+		<< "iterations,iteration_ms,device_ms,local_solve,converged,final_residual\n";
+	for (const Result &r : results){
+		out << csvString(device) << "," << csvString(r.name) << "," << r.dim << "," << r.nonZeros << "," << r.setup << ","
+			<< r.upload << "," << r.mean() << "," << r.stddev() << "," << r.min() << "," << r.max() << ","
+			<< r.meanIterations() << "," << r.perIteration() << "," << r.deviceTime << ","
+			<< (r.localSolve ? 1 : 0) << "," << (r.converged ? 1 : 0) << "," << r.finalResidual << "\n";
+	}
+}
+
+int main(int argc, char **argv){
+	Options opts;
+	try {
+		opts = parseArgs(argc, argv);
+	}
+	catch (const std::exception &e){
+		std::cout << "Error: " << e.what() << "\nUsage: bench [--device cpu|gpu] [--sizes 16,32,64] "
+			<< "[--matrix file]... [--warmup n] [--reps n] [--iter n] [--tol t] [--json file] [--csv file]\n";
+		return 1;
+	}
+	try {
+		//Profiling is on so the solves also report their device time per phase
+		tcl::Context context(opts.device, false, true);
+		//The info strings can come back with their null terminator included
+		std::string device = context.mDevices.at(0).getInfo<CL_DEVICE_NAME>().c_str();
+		std::string version = std::string(context.mDevices.at(0).getInfo<CL_DEVICE_VERSION>().c_str())
+			+ ", driver " + context.mDevices.at(0).getInfo<CL_DRIVER_VERSION>().c_str();
+		std::cout << "Benchmarking CG on " << device << " (" << version << ")\n";
+
+		std::vector<Result> results;
+		for (int dim : opts.sizes){
+			results.push_back(runCase("fluid" + std::to_string(dim), [dim](){ return createInteractionMatrix(dim); },
+				true, opts, context));
+		}
+		for (const std::string &file : opts.matrices){
+			std::string name = file.substr(file.find_last_of("/\\") + 1);
+			results.push_back(runCase(name, [&file](){ return SparseMatrix<float>(file); }, false, opts, context));
+		}
+		for (const Result &r : results){
+			std::cout << r.name << ": " << r.dim << " rows, " << r.nonZeros << " non-zeros, setup " << r.setup
+				<< "ms, upload " << r.upload << "ms, solve " << r.mean() << "ms (stddev " << r.stddev()
+				<< ") over " << r.meanIterations() << " iterations, " << r.perIteration() << "ms/iteration"
+				<< (r.converged ? "" : ", did not converge") << "\n";
+		}
+		if (!opts.json.empty()){
+			writeJSON(opts.json, results, opts, device, version);
+		}
+		if (!opts.csv.empty()){
+			writeCSV(opts.csv, results, device);
+		}
+	}
+	catch (const cl::Error &e){
+		std::cout << "Error: OpenCL error " << e.err() << " in " << e.what() << "\n";
+		return 1;
+	}
+	catch (const std::exception &e){
+		std::cout << "Error: " << e.what() << "\n";
+		return 1;
+	}
+	return 0;
+}
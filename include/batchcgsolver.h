@@ -0,0 +1,105 @@
+#ifndef BATCHCGSOLVER_H
+#define BATCHCGSOLVER_H
+
+#include <vector>
+#include <memory>
+#include "tinycl.h"
+#include "sparsematrix.h"
+#include "linearoperator.h"
+
+/*
+* An OpenCL Conjugate Gradient solver for k systems sharing the same matrix, Ax_j = b_j.
+* The k right hand sides are solved together as one block of interleaved vectors, where
+* element i of vector j is at i * k + j, so each matrix entry is read once per iteration
+* for all of them. Each system converges independently and stops doing work once it's done
+*/
+class BatchCGSolver {
+public:
+	/*
+	* Give the solver the operator for the systems, the # of right hand sides to solve at once
+	* and the OpenCL context to use for the computation. The max iterations and convergence
+	* length apply to each system
+	*/
+	BatchCGSolver(std::shared_ptr<LinearOperator> op, int k, tcl::Context &context,
+		int iter = 1000, float convergeLen = 1e-5);
+	/*
+	* Give the solver a matrix for the systems instead of an operator
+	*/
+	BatchCGSolver(const SparseMatrix<float> &mat, int k, tcl::Context &context,
+		int iter = 1000, float convergeLen = 1e-5);
+	/*
+	* Run the solver until all systems converge or hit the max number of iterations
+	*/
+	void solve();
+	/*
+	* Set how often the residuals are read back to check if all systems have converged
+	*/
+	void setConvergenceCheck(int interval);
+	/*
+	* Load up a new block of b vectors, bBlock should be dim * k floats interleaved
+	*/
+	void updateB(const std::vector<float> &bBlock);
+	/*
+	* Pass an existing CL buffer of interleaved b vectors to be used as the b block
+	*/
+	void updateB(cl::Buffer &bBuf);
+	/*
+	* Get the block of interleaved results read off the device
+	*/
+	std::vector<float> getResult();
+	/*
+	* Get the memory buffer on the device containing the interleaved results
+	*/
+	cl::Buffer getResultBuffer();
+	/*
+	* Get the # of iterations each system took in the last solve
+	*/
+	const std::vector<int>& getIterations() const;
+	/*
+	* Get the # of right hand sides solved at once
+	*/
+	int getRHS() const;
+	/*
+	* Print the stats of each solve to stdout, off by default
+	*/
+	void setVerbose(bool v);
+	/*
+	* Interleave k vectors of equal length into a block
+	*/
+	static std::vector<float> interleave(const std::vector<std::vector<float>> &vecs);
+	/*
+	* Pull vector j out of a block of k interleaved vectors
+	*/
+	static std::vector<float> deinterleave(const std::vector<float> &block, int k, int j);
+
+private:
+	/*
+	* Load the program, kernels and create the buffers
+	*/
+	void init();
+	/*
+	* Enqueue the dot products of each pair of vectors in blocks a and b, with
+	* the results written to out[outOffset, outOffset + k)
+	*/
+	void dot(const cl::Buffer &a, const cl::Buffer &b, cl::Buffer &out, int outOffset);
+
+	tcl::Context &context;
+	std::shared_ptr<LinearOperator> op;
+	int k, maxIterations, dimensions;
+	float convergeLen;
+	int checkInterval;
+	bool verbose;
+	std::vector<int> iterations;
+	//Work group size and # of groups per right hand side for the dot products
+	int groupSize, nGroups;
+	size_t accSize;
+	//Blocks of the vectors, and per right hand side pAp, r_dot_r_k & r_dot_r_k+1,
+	//if the system is still active and the # of iterations it took
+	cl::Buffer x, r, p, b, matP, pMatp, rDotr, dotPartial, active, iterCount;
+	cl::Program cgProgram;
+	//Kernel names here match the names in cg_kernels.cl
+	cl::Kernel block_init, block_dot_partial, block_sum_partial, block_update_xr,
+		block_update_p, block_update_active;
+};
+
+#endif
@@ -1,9 +1,15 @@
 #ifndef CGSOLVER_H
-#define CGSOLVER_h
+#define CGSOLVER_H
 
 #include <array>
+#include <vector>
+#include <memory>
+#include <chrono>
 #include "tinycl.h"
 #include "sparsematrix.h"
+#include "linearoperator.h"
+#include "preconditioner.h"
+#include "solvestats.h"
 
 /*
 * An OpenCL Conjuage Gradient solver, will perform
@@ -15,20 +21,167 @@
 */
 class CGSolver {
 public:
+	/*
+	* The formulations of CG the solver can run, both give the same iterates in exact arithmetic
+	* CLASSIC: The textbook iteration with two separate dot product reductions per iteration
+	* PIPELINED: Ghysels & Vanroose's pipelined CG which merges both dot products into one
+	*	reduction and fuses the vector updates into one kernel, taking 3 kernel launches per
+	*	iteration instead of ~7 at the cost of 4 more vectors of memory
+	*/
+	enum MODE { CLASSIC, PIPELINED };
+	/*
+	* The initial guess to start each solve from
+	* ZERO: Start from x = 0
+	* PREVIOUS: Start from the solution of the last solve, good when solving a series of
+	*	similar systems like the pressure of consecutive frames
+	* EXTRAPOLATE: Start from 2x_k - x_k-1, linearly extrapolating from the last two solutions
+	*/
+	enum GUESS { ZERO, PREVIOUS, EXTRAPOLATE };
+	/*
+	* The reordering to apply to a matrix before solving, to bring the columns each row
+	* reads closer together for better locality in the mat * vec product
+	* NONE: Solve the matrix in the order given
+	* RCM: Reverse Cuthill-McKee, minimizing the bandwidth
+	* NESTED_DISSECTION: Recursively split the rows at level set separators
+	*/
+	enum REORDER { NONE, RCM, NESTED_DISSECTION };
 	/*
 	* Give the solver the linear system to solve for x: Ax = b and the OpenCL context to
 	* use for the computation. The matrix should be square and have equal dimensionality to the b vector
 	* although an empty b vector is also valid if you want to upload everything but not solve yet
 	* You can also specify the max iteration count (default 1000) and the length
-	* to accept for convergence (default 1e-5)
+	* to accept for convergence (default 1e-5). The matrix is uploaded in the layout
+	* SparseOperator picks for its row lengths. If a reordering is picked the solver works
+	* on the permuted system, mapping b and x through the permutation as they go in and out
+	* so the vectors passed and returned are always in the matrix's original order. A
+	* preconditioner for a reordered solve should be built from mat.permuted(getPermutation())
 	*/
 	CGSolver(const SparseMatrix<float> &mat, const std::vector<float> &b, 
+		tcl::Context &context, int iter = 1000, float convergeLen = 1e-5, REORDER reorder = REORDER::NONE);
+	/*
+	* Give the solver an operator for the system to solve instead of a matrix, such as
+	* the matrix-free LaplacianOperator. The same rules as above apply for the b vector
+	*/
+	CGSolver(std::shared_ptr<LinearOperator> op, const std::vector<float> &b,
 		tcl::Context &context, int iter = 1000, float convergeLen = 1e-5);
 	/*
 	* Run the solver until we converge or hit the max number of iterations
 	*/
 	void solve();
 	/*
+	* Select the CG formulation to use for the following solves, default is CLASSIC
+	*/
+	void setMode(MODE m);
+	/*
+	* Set a preconditioner to use for the following solves, pass nullptr to solve without one
+	* The pipelined iteration isn't preconditioned, so solves with a preconditioner set
+	* will always run the classic iteration
+	*/
+	void setPreconditioner(std::shared_ptr<Preconditioner> precon);
+	/*
+	* Select the initial guess to use for the following solves, default is ZERO. The first
+	* solve always starts from 0 and EXTRAPOLATE starts from the previous solution until
+	* it has two to extrapolate from
+	*/
+	void setInitialGuess(GUESS g);
+	/*
+	* Replace the solution the next solve warm starts from with the operator dim floats in xBuf,
+	* in the original order for a reordered solve. Used when the solution was changed outside
+	* the solver. Has no effect with the ZERO guess and EXTRAPOLATE still extrapolates from the
+	* solution before the last solve
+	*/
+	void setGuess(const cl::Buffer &xBuf);
+	/*
+	* Enable mixed precision iterative refinement with up to maxSteps refinement steps, 0 disables it
+	* Each step finds the true residual of the solution in double precision on the host and solves
+	* for a correction in float on the device, only reducing the residual by innerTol. This recovers
+	* accuracy the float iteration can't reach by itself, at the cost of a round trip per step
+	*/
+	void setRefinement(int maxSteps, float innerTol = 1e-3f);
+	/*
+	* Get the double precision solution of the last refined solve
+	*/
+	const std::vector<double>& getRefinedResult() const;
+	/*
+	* Check if the dot products accumulate in double precision, which is used if the
+	* device supports cl_khr_fp64. Otherwise they use compensated float sums
+	*/
+	bool usesDoubleReductions() const;
+	/*
+	* Check if a device supports double precision, cg_kernels.cl should be built with
+	* -DCG_USE_DOUBLE for such devices
+	*/
+	static bool supportsDouble(const cl::Device &device);
+	/*
+	* Set how often the residual is read back to check for convergence, every interval
+	* iterations (default 1). If speculative the next batch of iterations is enqueued before
+	* waiting on the read of the previous batch's residual so the device isn't left idle while
+	* the host checks it. Iterations run after converging do nothing on the device
+	*/
+	void setConvergenceCheck(int interval, bool speculative = false);
+	/*
+	* Give the following solves a wall clock budget of budgetMs milliseconds, stopping once the
+	* residual length is within relTol * ||b|| or the budget is spent, whichever comes first.
+	* The iterations are capped at the # the budget fits by the time per iteration of recent
+	* solves, and the solve also stops at a convergence check that finds the budget spent. Solves
+	* stopped short of the tolerance are marked as budget limited in their stats. A budget <= 0
+	* goes back to the convergence length and max iterations the solver was made with.
+	* Refined solves don't use the budget
+	*/
+	void setBudget(double budgetMs, float relTol = 1e-4f);
+	/*
+	* Get the estimated wall clock time per iteration in milliseconds, a moving average over
+	* recent solves, 0 until a solve has run
+	*/
+	double getIterationCost() const;
+	/*
+	* Allow small systems to be solved by a single work group running the whole CG loop in one
+	* kernel, on by default. It's used for unpreconditioned solves if the operator can be
+	* described to the kernel and the vectors the work group shares fit in the device's local
+	* memory, taking one launch per solve instead of several per iteration. The mode and
+	* convergence check interval don't apply to it, and when timing the whole kernel is
+	* counted as update time since its phases can't be told apart
+	*/
+	void setLocalSolve(bool enable);
+	/*
+	* Check if the following solves will run in a single work group
+	*/
+	bool usesLocalSolve() const;
+	/*
+	* Declare if the constant vector is the nullspace of the operator, which defaults to what the
+	* operator reports. The periodic Laplacian is singular this way, so a b with a nonzero mean
+	* has a part no x can match and the solve would stall trying to reduce it. With the nullspace
+	* set the mean is removed from b, from the preconditioned residual each iteration and from the
+	* solution, giving the mean-free least squares solution
+	*/
+	void setConstantNullspace(bool constant);
+	/*
+	* Check if the mean is being projected out of the solves
+	*/
+	bool hasConstantNullspace() const;
+	/*
+	* Print the stats of each solve to stdout, off by default
+	*/
+	void setVerbose(bool v);
+	/*
+	* Pick what's collected in the stats of the following solves, if the residual history
+	* is copied into them and if each phase of the solve is timed with profiling events.
+	* Timing is only done if the context was created with profiling on
+	*/
+	void setTelemetry(bool keepHistory, bool timePhases);
+	/*
+	* Get the stats of the last solve
+	*/
+	const SolveStats& getStats() const;
+	/*
+	* Get the residual length after each iteration of the last solve
+	*/
+	const std::vector<float>& getResidualHistory() const;
+	/*
+	* Get the # of iterations that were enqueued after the last solve had already converged
+	*/
+	int getWastedIterations() const;
+	/*
 	* Load up a new b vector
 	*/
 	void updateB(const std::vector<float> &bVec);
@@ -42,48 +195,207 @@ public:
 	std::vector<float> getResult();
 	/*
 	* Get the memory buffer on the device containing the result, this will be a buffer
-	* with matrix.dim floats
+	* with operator dim floats. For a reordered solve this enqueues mapping the result back
+	* to the original order in a separate buffer
 	*/
 	cl::Buffer getResultBuffer();
+	/*
+	* Get the permutation the system was reordered with, row i of the solved system is row
+	* perm[i] of the original matrix. Empty if the system wasn't reordered
+	*/
+	const std::vector<int>& getPermutation() const;
 
 private:
+	//The phases of the solve that kernels are timed under
+	enum PHASE { SPMV, REDUCTION, UPDATE, PRECONDITIONER };
+
+	/*
+	* Setup a solver for the matrix reordered by perm, an empty perm doesn't reorder it
+	*/
+	CGSolver(const SparseMatrix<float> &mat, std::vector<int> perm, const std::vector<float> &b,
+		tcl::Context &context, int iter, float convergeLen);
+	/*
+	* Find the ordering for a matrix, empty for REORDER::NONE
+	*/
+	static std::vector<int> findOrdering(const SparseMatrix<float> &mat, REORDER reorder);
+	/*
+	* Read x back to the host in the solved system's order
+	*/
+	std::vector<float> readX();
+
 	/*
 	* Load the program and the kernels
 	*/
 	void loadKernels();
 	/*
-	* Create and write the matrix buffers and other buffers needed for the computation
+	* Attribute the following kernels to some phase if timing
+	*/
+	void beginPhase(PHASE phase);
+	/*
+	* Stop timing and add the device time of the kernels run in each phase to the stats
+	*/
+	void collectPhaseTimes(SolveStats &solveStats);
+	/*
+	* Run the solver to an absolute residual length of tol
+	*/
+	void runSolve(float tol, bool budgeted = false);
+	/*
+	* Run the solve to an absolute residual length of tol with cg_local_solve
+	*/
+	void runLocalSolve(float tol, bool budgeted);
+	/*
+	* Find the squared residual length to stop a budgeted solve at, relative to ||b||
+	*/
+	float relativeTolerance();
+	/*
+	* Get the # of iterations a budgeted solve can run by the estimated time per iteration.
+	* Without an estimate yet a solve that checks the clock can run up to maxIterations,
+	* but one that can't, like the local solve, is capped at FIRST_BUDGET_ITERATIONS
+	*/
+	int budgetIterations(bool clocked) const;
+	/*
+	* Fill out the stats of a solve started at solveStart from the residuals and wasted
+	* iterations, update the time per iteration and print the stats if verbose. limited
+	* is if the solve was stopped early by its time budget
+	*/
+	void recordStats(float initialRLenSq, float tol2, bool limited);
+	/*
+	* Run the iterative refinement loop around runSolve
+	*/
+	void solveRefined();
+	/*
+	* Set the squared residual length the kernels treat as converged
+	*/
+	void setTolerance(float tol2);
+	/*
+	* Create and write the buffers needed for the computation
 	* since we'll be running the CG solver many times it's faster to allocate the various
 	* buffers needed for the compute once
 	*/
-	void createBuffers(const SparseMatrix<float> &mat, const std::vector<float> &bVec);
+	void createBuffers(const std::vector<float> &bVec);
 	/*
 	* Initialize unchanging parameters to kernels. To be called after createBuffers
 	*/
 	void initKernelArgs();
 	/*
+	* Enqueue the setup for the textbook CG iteration
+	*/
+	void setupClassic();
+	/*
+	* Enqueue an iteration of textbook CG
+	*/
+	void iterateClassic();
+	/*
+	* Enqueue the setup for the pipelined CG iteration
+	*/
+	void setupPipelined();
+	/*
+	* Enqueue an iteration of pipelined CG
+	*/
+	void iteratePipelined();
+	/*
+	* Enqueue the dot product of a and b with the result written to out[outIdx]
+	*/
+	void dot(const cl::Buffer &a, const cl::Buffer &b, cl::Buffer &out, int outIdx);
+	/*
+	* Enqueue the matrix * vector product out = A * in
+	*/
+	void matVec(const cl::Buffer &in, cl::Buffer &out);
+	/*
+	* Enqueue out = in - mean(in), projecting the constant nullspace out of in
+	*/
+	void removeMean(const cl::Buffer &in, cl::Buffer &out);
+	/*
+	* Extrapolate the initial guess in x from the last two solutions, or save x for next
+	* time if there's only one so far
+	*/
+	void extrapolateGuess();
+	/*
+	* Enqueue filling the first size bytes of some buffer with 0's
+	*/
+	void zeroBuffer(cl::Buffer &buf, size_t size);
+	/*
 	* Initialize the unchanging arguments for the various kernels and perform
 	* some initial calculations we need for the solve such as setting up initial vectors
+	* x is set to the initial guess and r and p to the initial residual
 	*/
 	void initSolve();
 
 private:
-	//Meaningful names for the buffers in the matrix buffer
-	enum MATRIX { ROW, COL, VAL };
-
 	tcl::Context &context;
-	int maxIterations, dimensions, matNVals;
+	std::shared_ptr<LinearOperator> op;
+	std::shared_ptr<Preconditioner> precon;
+	int maxIterations, dimensions;
 	float convergeLen;
-	//The sparse matrix buffers
-	std::array<cl::Buffer, 3> matrix;
+	MODE mode;
+	GUESS guess;
+	//If x holds a solution we can start from and if xPrev holds the one before it
+	bool haveSolution, havePrevious;
+	//Max # of refinement steps, the residual reduction for each correction solve
+	//and the double precision solution of the last refined solve
+	int maxRefinements;
+	float innerTolerance;
+	std::vector<double> refinedX, refinedResult;
+	//The squared residual length the kernels are currently set to stop at
+	float tolerance;
+	//How often to check for convergence, if checks are speculative and how many iterations
+	//were wasted by checking late in the last solve
+	int checkInterval;
+	bool speculative;
+	int wastedIterations;
+	std::vector<float> residuals;
+	//If stats are printed, if they get the residual history and if the phases are being timed
+	bool verbose, keepHistory, timePhases;
+	SolveStats stats;
+	//The time budget per solve in milliseconds, 0 if there's none, the tolerance relative
+	//to ||b|| to use with it, the moving average time per iteration and when the solve started
+	double budget;
+	static const int FIRST_BUDGET_ITERATIONS = 64;
+	float relTolerance;
+	double iterationCost;
+	std::chrono::high_resolution_clock::time_point solveStart;
+	//The events of the kernels run in each phase of the solve being timed
+	std::array<std::vector<cl::Event>, 4> phaseEvents;
+	//Work group size and # of groups to use for the pipelined iteration's fused reductions
+	//and the size of the reductions' accumulator type, double or float
+	int groupSize, nGroups;
+	size_t accSize;
+	//If the local solve is allowed, if the system can be run by it and its work group size
+	bool allowLocalSolve, localSolveFits;
+	int localGroupSize;
+	//If the constant vector is the nullspace and gets projected out
+	bool constantNullspace;
 	//Buffers for vectors and calculation data
 	//matP = Ap and pMatp = pAp
-	cl::Buffer x, r, p, b, matP, pMatp, rDotr, dotPartial;
+	//rDotr holds the float[4] { r_dot_u_k, r_dot_r_k, r_dot_u_k+1, r_dot_r_k+1 }
+	//where u = M^-1 r is the preconditioned residual. Without a preconditioner u is
+	//just another handle to r and only the r_dot_u entries are computed
+	cl::Buffer x, r, p, b, u, matP, pMatp, rDotr;
+	//b_dot_b for the relative tolerance of budgeted solves
+	cl::Buffer bDotb;
+	//b with its mean removed for solves with a constant nullspace and the sum it's found from
+	cl::Buffer projectedB, meanSum;
+	//The solution before x, only allocated if extrapolating the initial guess
+	cl::Buffer xPrev;
+	//The residual to solve for a correction when refining
+	cl::Buffer refineB;
+	//The # of iterations actually run on the device and the residual length after each one
+	cl::Buffer iterCount, residualLog;
+	//Extra vectors for the pipelined iteration where w = Ar, q = Aw, s = Ap and z = As,
+	//they're only allocated once the mode is selected. pipeScalars holds the float[4]
+	//{ r_dot_r, w_dot_r, alpha, beta } and pipePartial the partials for both dot products
+	cl::Buffer w, q, z, s, pipeScalars, pipePartial;
+	//The reordering of the solved system, its permutation on the device, b gathered into
+	//the reordered order when given as a buffer and x scattered back to the original order
+	std::vector<int> permutation;
+	cl::Buffer permBuf, permutedB, originalX;
 	//The program containing the various kernels
 	cl::Program cgProgram;
 	//The kernels to be used in running the solve
 	//Kernel names here match the names in cg_kernels.cl to make it clearer who's who
-	cl::Kernel sparse_mat_vec_mult, big_dot, sum_partial, update_xr, update_p;
+	//The dot products and sums are done with the context's reductions
+	cl::Kernel update_xr, update_p, pipelined_update, pipelined_scalars, compute_residual,
+		extrapolate_guess, permute_vector, unpermute_vector, cg_local_solve, remove_mean;
 };
 
 #endif
@@ -0,0 +1,121 @@
+#ifndef CPUCGSOLVER_H
+#define CPUCGSOLVER_H
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include "sparsematrix.h"
+
+/*
+* A native multithreaded Conjugate Gradient solver for machines without a usable
+* OpenCL device, it has the same interface as CGSolver for solving and getting results
+* but the vectors stay in host memory. Each worker thread owns a block of rows, balanced
+* by # of non-zeros, for the whole life of the solver and runs the full iteration on them,
+* meeting the others at a barrier after each reduction and before each mat * vec.
+* The worker touches its part of the matrix and vectors first so on NUMA systems the
+* memory ends up on the node running the thread that uses it
+*/
+class CPUCGSolver {
+public:
+	/*
+	* Give the solver the linear system to solve for x: Ax = b. b can be empty if it'll
+	* be set with updateB later. threads is the # of worker threads to use, with 0
+	* using one per hardware thread. The max iterations and convergence length are the same as CGSolver
+	*/
+	CPUCGSolver(const SparseMatrix<float> &mat, const std::vector<float> &b, int iter = 1000,
+		float convergeLen = 1e-5, int threads = 0);
+	/*
+	* Stop and join the worker threads
+	*/
+	~CPUCGSolver();
+	/*
+	* Run the solver until we converge or hit the max number of iterations
+	*/
+	void solve();
+	/*
+	* Load up a new b vector
+	*/
+	void updateB(const std::vector<float> &bVec);
+	/*
+	* Get the result of the last solve
+	*/
+	std::vector<float> getResult() const;
+	/*
+	* Get the residual length after each iteration of the last solve
+	*/
+	const std::vector<float>& getResidualHistory() const;
+	/*
+	* Get the # of worker threads being used
+	*/
+	int getThreads() const;
+	/*
+	* Print the stats of each solve to stdout, off by default
+	*/
+	void setVerbose(bool v);
+
+private:
+	/*
+	* A sense reversing barrier the workers spin on, yielding while they wait
+	*/
+	class SpinBarrier {
+	public:
+		SpinBarrier(int n);
+		void wait();
+
+	private:
+		int n;
+		std::atomic<int> count, generation;
+	};
+
+	/*
+	* Run some task on all workers and wait for them to finish, the task
+	* is called with the worker's id
+	*/
+	void run(const std::function<void(int)> &task);
+	/*
+	* The loop each worker thread sits in waiting for tasks
+	*/
+	void worker(int id);
+	/*
+	* Split the rows between the workers so each has about the same # of non-zeros
+	*/
+	void partitionRows(const std::vector<int> &csrRowPtr);
+	/*
+	* The CG iteration run by worker t on its rows
+	*/
+	void solveTask(int t);
+	/*
+	* Sum the partials of a reduction written by each worker
+	*/
+	double sumPartials(const std::vector<double> &partials) const;
+
+	int maxIterations, dimensions;
+	float convergeLen;
+	int nThreads;
+	bool verbose;
+	std::vector<float> residuals;
+	//The rows worker t owns are [rowStart[t], rowStart[t + 1])
+	std::vector<int> rowStart;
+	//The matrix in compressed row form and the vectors, allocated without being
+	//initialized so that the worker owning each part is the first to touch it
+	std::unique_ptr<int[]> rowPtr, col;
+	std::unique_ptr<float[]> val, x, r, p, matP, b;
+	//Per worker partial sums for the reductions, spaced a cache line apart
+	//so workers don't fight over the lines they write to
+	static const int PARTIAL_STRIDE = 8;
+	std::vector<double> pMatpPartial, rDotrPartial;
+	SpinBarrier barrier;
+	//State for handing tasks to the workers
+	std::vector<std::thread> workers;
+	std::mutex taskMutex;
+	std::condition_variable taskReady, taskDone;
+	std::function<void(int)> task;
+	int taskGeneration, finished;
+	bool quit;
+};
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef FFTSOLVER_H
+#define FFTSOLVER_H
+
+#include <vector>
+#include "tinycl.h"
+
+/*
+* A direct spectral solver for the 5 point Laplacian on a periodic dim x dim grid,
+* the SimpleFluid pressure system. The Fourier modes are the Laplacian's eigenvectors
+* so a 2D FFT of b, a divide by the eigenvalues and an inverse FFT solve the system
+* exactly in O(n log n) with no iterations, giving the same fixed cost every frame.
+* The system is singular, b should sum to 0, and the solution returned has zero mean.
+* The FFT is radix-2 so the grid dim must be a power of 2
+*/
+class FFTSolver {
+public:
+	/*
+	* Setup a solver for a gridDim x gridDim grid, gridDim must be a power of 2
+	*/
+	FFTSolver(int gridDim);
+	/*
+	* Load the kernels from fft_kernels.cl and allocate the work buffers,
+	* calling init again once initialized does nothing
+	*/
+	void init(tcl::Context &context);
+	/*
+	* Enqueue solving Ax = b on the device, x is overwritten
+	*/
+	void solve(tcl::Context &context, const cl::Buffer &b, cl::Buffer &x);
+	/*
+	* Solve Ax = b on the host in double precision with a native FFT, for
+	* machines without an OpenCL device or to check the device results against
+	*/
+	void solveHost(const std::vector<float> &b, std::vector<float> &x) const;
+	/*
+	* Get the width of the grid the solver works on
+	*/
+	int getGridDim() const;
+
+private:
+	/*
+	* Enqueue a 2D FFT of the work buffers, sign is -1 for the forward
+	* transform and 1 for the inverse
+	*/
+	void transform(tcl::Context &context, float sign);
+
+	int gridDim;
+	bool initialized;
+	//The complex data ping-pongs between the work buffers with each
+	//pass, current is the one holding the latest result
+	cl::Buffer work[2];
+	int current;
+	cl::Program fftProgram;
+	//Kernel names here match the names in fft_kernels.cl
+	cl::Kernel fft_load_real, fft_radix2, fft_poisson_divide, fft_store_real;
+};
+
+#endif
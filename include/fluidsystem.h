@@ -0,0 +1,29 @@
+#ifndef FLUIDSYSTEM_H
+#define FLUIDSYSTEM_H
+
+#include <vector>
+#include "sparsematrix.h"
+
+/*
+* Builders for the fluid pressure system used to test and benchmark the solvers,
+* shared so the tests and the bench solve the same systems
+*/
+/*
+* Get the cell number of the cell at x, y on a dim x dim grid, wrapping around the edges
+*/
+int cellNumber(int x, int y, int dim);
+/*
+* Get the x, y position of cell n on a dim x dim grid
+*/
+void cellPos(int n, int &x, int &y, int dim);
+/*
+* Build the 5 point fluid pressure system of a dim x dim grid with wrapping boundaries
+*/
+SparseMatrix<float> createInteractionMatrix(int dim);
+/*
+* Build an n long b for the fluid system. The system is singular so b sums to 0, like a
+* divergence field does, for it to have a solution
+*/
+std::vector<float> createFluidRHS(int n);
+
+#endif
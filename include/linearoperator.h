@@ -0,0 +1,205 @@
+#ifndef LINEAROPERATOR_H
+#define LINEAROPERATOR_H
+
+#include <array>
+#include <vector>
+#include <functional>
+#include "tinycl.h"
+#include "sparsematrix.h"
+
+/*
+* A linear operator A for the CG solver to solve Ax = b with. The solver
+* only needs to know how to apply A to a vector on the device, so systems
+* that can be described more compactly than by storing the matrix can
+* provide their own operator
+*/
+class LinearOperator {
+public:
+	virtual ~LinearOperator(){}
+	/*
+	* Get the dimensions of the operator, it's a dim x dim square operator
+	*/
+	virtual int dim() const = 0;
+	/*
+	* Load the kernels and upload any data needed to apply the operator, the program
+	* passed is cg_kernels.cl built on the context. Will be called by the solver before
+	* any calls to apply, calling init again once initialized does nothing
+	*/
+	virtual void init(tcl::Context &context, const cl::Program &program) = 0;
+	/*
+	* Enqueue the operator * vector product out = A * in
+	*/
+	virtual void apply(tcl::Context &context, const cl::Buffer &in, cl::Buffer &out) = 0;
+	/*
+	* Enqueue the operator * vector product for a block of k interleaved vectors, where element
+	* i of vector j is at i * k + j. Vectors j with active[j] == 0 are skipped, leaving out unchanged
+	*/
+	virtual void applyBlock(tcl::Context &context, const cl::Buffer &in, cl::Buffer &out, int k,
+		const cl::Buffer &active) = 0;
+	/*
+	* Compute out = A * in on the host in double precision, used to find the true
+	* residual for iterative refinement. out should be sized to dim
+	*/
+	virtual void applyHost(const std::vector<double> &in, std::vector<double> &out) const = 0;
+	/*
+	* Describe the operator to cg_local_solve, which applies it itself within its single work
+	* group solve. Sets gridDim to the width of the grid for a periodic 5 point Laplacian, or to 0
+	* with rowPtr, col and val holding the full matrix in CSR form. Returns false if the operator
+	* can't be described this way, which is the default
+	*/
+	virtual bool localSolveForm(tcl::Context&, int&, cl::Buffer&, cl::Buffer&, cl::Buffer&){
+		return false;
+	}
+	/*
+	* Check if the constant vector is the nullspace of the operator, as it is for a Laplacian with
+	* no boundary fixing the value, so the solver can project it out. The default is false
+	*/
+	virtual bool constantNullspace() const {
+		return false;
+	}
+};
+
+/*
+* An operator for a sparse matrix, use this for loaded systems like Matrix Market files.
+* The matrix is uploaded in one of a few layouts, picked by default from the row lengths:
+* CSR: compressed rows, works well for any matrix
+* ELL: ELLPACK, every row padded to the longest one and stored column-major so neighboring
+*	work items read neighboring memory. Best when all rows are about the same length,
+*	like the 5 nonzeros of every row of the fluid matrix
+* SELL: sliced ELLPACK (SELL-C-sigma), rows are sorted by length within windows of sigma
+*	rows and each slice of c rows is padded only to its own longest row. Best for
+*	irregular row lengths on wide SIMD hardware
+* SYMMETRIC: CSR of just the upper triangle and diagonal of a symmetric matrix, halving
+*	the device memory and bandwidth of the matrix. The transpose part of the product
+*	is added with atomics so it's best for large systems where memory is the limit
+* AUTO: SYMMETRIC if the matrix only stores its upper triangle, otherwise ELL if padding
+*	every row adds few elements, otherwise SELL if padding the slices adds few elements,
+*	otherwise CSR
+*/
+class SparseOperator : public LinearOperator {
+public:
+	enum FORMAT { CSR, ELL, SELL, SYMMETRIC, AUTO };
+	/*
+	* Create the operator for the matrix in some format. sliceHeight is the c used by the
+	* SELL layout, which should be a multiple of the device's SIMD width, and sigma is taken
+	* as 8 slices. A compressed row copy of the matrix, or of its upper half for SYMMETRIC,
+	* is kept on the host for applyHost. The SYMMETRIC format throws a std::runtime_error if
+	* the matrix isn't symmetric
+	*/
+	SparseOperator(const SparseMatrix<float> &mat, FORMAT format = FORMAT::AUTO, int sliceHeight = 32);
+	/*
+	* Assemble a dim x dim matrix in CSR form straight into mapped device buffers, with no
+	* SparseMatrix or host copy of the matrix made. rowLength(i) gives the # of elements in
+	* row i and fillRow(i, col, val) writes them, both are called from many threads at once.
+	* The rows are counted, scanned and filled in parallel on threads worker threads, with
+	* 0 using one per hardware thread. The operator always uses the CSR layout, and the first
+	* call to applyHost reads the matrix back from the device
+	*/
+	SparseOperator(tcl::Context &context, int dim, const std::function<int(int)> &rowLength,
+		const std::function<void(int, int*, float*)> &fillRow, int threads = 0);
+	int dim() const override;
+	void init(tcl::Context &context, const cl::Program &program) override;
+	void apply(tcl::Context &context, const cl::Buffer &in, cl::Buffer &out) override;
+	/*
+	* The block product only has CSR and SYMMETRIC kernels, so if another format is used
+	* the CSR form of the matrix is also uploaded on the first call
+	*/
+	void applyBlock(tcl::Context &context, const cl::Buffer &in, cl::Buffer &out, int k,
+		const cl::Buffer &active) override;
+	void applyHost(const std::vector<double> &in, std::vector<double> &out) const override;
+	/*
+	* Uploads the CSR form if another format is used, a SYMMETRIC matrix can't be described
+	* since only its upper half is on the device
+	*/
+	bool localSolveForm(tcl::Context &context, int &gridDim, cl::Buffer &rowPtr, cl::Buffer &col,
+		cl::Buffer &val) override;
+	/*
+	* True if every row of the matrix sums to 0, like the periodic fluid matrix. An assembled
+	* operator never sees its rows on the host, so it always returns false
+	*/
+	bool constantNullspace() const override;
+	/*
+	* Get the format the matrix is stored in, never AUTO
+	*/
+	FORMAT getFormat() const;
+	/*
+	* Get the # of values stored for the matrix in its format, including padding
+	*/
+	int storedValues() const;
+	/*
+	* Pick the format AUTO would choose for a matrix with some row lengths
+	*/
+	static FORMAT selectFormat(const std::vector<int> &lengths, int sliceHeight);
+
+private:
+	//Meaningful names for the buffers in the matrix buffer, the compressed row form is in
+	//ROW_PTR, COL and VAL with ROW_PTR holding dim + 1 row offsets, for SYMMETRIC these
+	//hold only the upper half. ELL and SELL use
+	//FMT_COL and FMT_VAL, and SELL also uses SLICE_PTR and PERM
+	enum MATRIX { ROW_PTR, COL, VAL, FMT_COL, FMT_VAL, SLICE_PTR, PERM };
+	/*
+	* Upload the compressed row form of the matrix and setup the CSR or SYMMETRIC kernels
+	*/
+	void uploadCSR(tcl::Context &context);
+
+	/*
+	* Read the CSR form back from the device buffers of an assembled operator
+	*/
+	void readCSR() const;
+
+	int dimensions;
+	FORMAT format;
+	int sliceHeight, ellWidth, stored;
+	//The host copy of the CSR form (upper half for SYMMETRIC) for applyHost, an assembled operator
+	//only reads it back from the device through its queue if it's needed
+	mutable std::vector<int> rowPtr, col;
+	mutable std::vector<float> val;
+	cl::CommandQueue assembledQueue;
+	//The matrix in the ELL or SELL layout, cleared once uploaded
+	std::vector<int> fmtCol, slicePtr, perm;
+	std::vector<float> fmtVal;
+	//If every row sums to 0, making the constant vector the nullspace
+	bool initialized, csrUploaded, zeroRowSums;
+	std::array<cl::Buffer, 7> buffers;
+	cl::Kernel csr_mat_vec_mult, csr_block_mat_vec_mult, ell_mat_vec_mult, sell_mat_vec_mult,
+		zero_vector, block_zero_active, csr_sym_mat_vec_mult, csr_sym_block_mat_vec_mult;
+};
+
+/*
+* The 5 point Laplacian of a periodic dim x dim grid, which is the pressure
+* matrix of SimpleFluid: 4 on the diagonal and -1 for each neighbor cell.
+* The operator is applied straight from the grid layout with no matrix
+* stored, so only the vector being multiplied is read from memory
+*/
+class LaplacianOperator : public LinearOperator {
+public:
+	/*
+	* Create the operator for a gridDim x gridDim grid, giving an operator
+	* with gridDim * gridDim dimensions
+	*/
+	LaplacianOperator(int gridDim);
+	int dim() const override;
+	void init(tcl::Context &context, const cl::Program &program) override;
+	void apply(tcl::Context &context, const cl::Buffer &in, cl::Buffer &out) override;
+	void applyBlock(tcl::Context &context, const cl::Buffer &in, cl::Buffer &out, int k,
+		const cl::Buffer &active) override;
+	void applyHost(const std::vector<double> &in, std::vector<double> &out) const override;
+	bool localSolveForm(tcl::Context &context, int &gridDim, cl::Buffer &rowPtr, cl::Buffer &col,
+		cl::Buffer &val) override;
+	/*
+	* The grid is periodic with no boundary to pin the pressure, so the Laplacian is singular
+	* with the constant vector as its nullspace
+	*/
+	bool constantNullspace() const override;
+	/*
+	* Get the width of the grid the operator works on
+	*/
+	int getGridDim() const;
+
+private:
+	int gridDim;
+	bool initialized;
+	cl::Kernel laplacian_mat_vec_mult, laplacian_block_mat_vec_mult;
+};
+
+#endif
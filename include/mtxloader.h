@@ -0,0 +1,100 @@
+#ifndef MTXLOADER_H
+#define MTXLOADER_H
+
+#include <string>
+#include <vector>
+#include <memory>
+
+/*
+* A fast loader for Matrix Market coordinate files. The file is memory mapped and split
+* at line boundaries between worker threads which parse their lines with std::from_chars,
+* the entries are then scattered straight into compressed row (CSR) form, writing the
+* mirror of each off-diagonal entry of a symmetric matrix in the same pass. The CSR form
+* can optionally be saved to a binary sidecar file next to the .mtx, which later loads map
+* directly with no parsing or copying
+*/
+namespace mtx {
+	/*
+	* A read only memory mapping of a whole file, unmapped when destroyed
+	*/
+	class MappedFile {
+	public:
+		/*
+		* Map the file, throws a std::runtime_error if it can't be opened or mapped
+		*/
+		MappedFile(const std::string &file);
+		~MappedFile();
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+		const char* data() const;
+		size_t size() const;
+
+	private:
+		const char *ptr;
+		size_t len;
+#ifdef _WIN32
+		void *fileHandle, *mapHandle;
+#endif
+	};
+	/*
+	* A square matrix in CSR form with the columns of each row in ascending order. The
+	* arrays are either owned by the matrix or point into a mapped cache file, which is
+	* kept mapped as long as the matrix (or a copy of it) is alive
+	*/
+	class CSRMatrix {
+	public:
+		CSRMatrix();
+		int dim() const;
+		int nonZeros() const;
+		//If the file was symmetric, the mirrored entries are stored so the rows are always complete
+		bool symmetric() const;
+		//If the matrix was loaded from the cache instead of parsed
+		bool fromCache() const;
+		const int* rowPtr() const;
+		const int* col() const;
+		const double* val() const;
+
+	private:
+		friend CSRMatrix parse(const std::string &file, int threads);
+		friend CSRMatrix loadCache(const std::string &file);
+
+		int n, nnz;
+		bool sym, cached;
+		//The arrays in the mapped cache, if loaded from one
+		const int *rows, *cols;
+		const double *vals;
+		std::vector<int> ownRows, ownCols;
+		std::vector<double> ownVals;
+		std::shared_ptr<MappedFile> mapping;
+	};
+	/*
+	* Load a matrix from a Matrix Market file, general or symmetric with real, integer or
+	* pattern values. If useCache is set a valid cache file is loaded if there is one, otherwise
+	* the file is parsed and the cache written for next time, with a warning if the cache can't
+	* be written. It's off by default so loading never writes next to the file unasked. threads
+	* is the # of threads to parse with, with 0 using one per hardware thread. Throws a
+	* std::runtime_error on failure
+	*/
+	CSRMatrix load(const std::string &file, bool useCache = false, int threads = 0);
+	/*
+	* Parse a Matrix Market file, ignoring any cache
+	*/
+	CSRMatrix parse(const std::string &file, int threads = 0);
+	/*
+	* Get the path of the cache file for a Matrix Market file
+	*/
+	std::string cachePath(const std::string &file);
+	/*
+	* Map the cache file for a Matrix Market file, the cache is only valid if the size and
+	* modification time of the .mtx match those it was written from. Throws a std::runtime_error
+	* if there's no valid cache
+	*/
+	CSRMatrix loadCache(const std::string &file);
+	/*
+	* Write the cache file for a Matrix Market file loaded into mat, returns false if it
+	* couldn't be written
+	*/
+	bool writeCache(const std::string &file, const CSRMatrix &mat);
+}
+
+#endif
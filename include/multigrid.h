@@ -0,0 +1,91 @@
+#ifndef MULTIGRID_H
+#define MULTIGRID_H
+
+#include <vector>
+#include "tinycl.h"
+#include "preconditioner.h"
+
+/*
+* A geometric multigrid solver for the 5 point Laplacian on a periodic dim x dim
+* grid, the SimpleFluid pressure system. Each level halves the grid along each axis
+* until it's 4x4 or halving it would give an odd grid, which the red-black smoother
+* can't color consistently across the periodic edges, so dims that are a power of 2 work best.
+* V-cycles use red-black Gauss-Seidel smoothing, bilinear prolongation and its transpose
+* for restriction, giving a convergence rate independent of the grid size.
+* A single V-cycle is symmetric, so it can also be used as a CG preconditioner
+*/
+class Multigrid : public Preconditioner {
+public:
+	/*
+	* Setup a solver for a gridDim x gridDim grid, gridDim must be even. smoothSteps is
+	* the # of red-black sweeps to run before and after the coarse correction and omega
+	* the relaxation weight of the smoother
+	*/
+	Multigrid(int gridDim, int smoothSteps = 2, float omega = 1.f);
+	/*
+	* Load the kernels from poisson_kernels.cl and allocate the levels, the CG program
+	* the Preconditioner interface passes is ignored since the residual length is found
+	* with the context's reductions. Calling init again once initialized does nothing
+	*/
+	void init(tcl::Context &context, const cl::Program &program) override;
+	/*
+	* Initialize for standalone use, same as the above without a CG program
+	*/
+	void init(tcl::Context &context);
+	/*
+	* Run a single V-cycle on Az = r starting from z = 0
+	*/
+	void apply(tcl::Context &context, const cl::Buffer &r, cl::Buffer &z) override;
+	/*
+	* Solve Ax = b by running V-cycles until the residual length is within convergeLen or
+	* maxCycles have been run, x is used as the initial guess. Returns the # of cycles run
+	*/
+	int solve(tcl::Context &context, const cl::Buffer &b, cl::Buffer &x, int maxCycles = 50,
+		float convergeLen = 1e-5);
+	/*
+	* Get the residual length after each V-cycle of the last solve
+	*/
+	const std::vector<float>& getResidualHistory() const;
+	/*
+	* Get the # of grid levels, including the finest one
+	*/
+	int getLevels() const;
+	/*
+	* Print the stats of each solve to stdout, off by default
+	*/
+	void setVerbose(bool v);
+
+private:
+	//A level of the grid hierarchy, solving Ax = b on an n x n grid. r holds the residual
+	//to be restricted to the next level. The finest level's b and x are the buffers passed
+	//by the caller
+	struct Level {
+		int n;
+		cl::Buffer b, x, r;
+	};
+
+	/*
+	* Enqueue a V-cycle on some level, if zeroGuess the level's x is zeroed first
+	*/
+	void vcycle(tcl::Context &context, int level, bool zeroGuess);
+	/*
+	* Enqueue a symmetric red-black sweep of a level, red then black if
+	* forward, otherwise black then red
+	*/
+	void smooth(tcl::Context &context, Level &level, bool forward);
+	/*
+	* Enqueue finding the residual of a level into its r buffer
+	*/
+	void residual(tcl::Context &context, Level &level);
+
+	int gridDim, smoothSteps;
+	float omega;
+	bool initialized, verbose;
+	std::vector<Level> levels;
+	std::vector<float> residuals;
+	cl::Program mgProgram;
+	//Kernel names here match the names in poisson_kernels.cl
+	cl::Kernel smooth_red_black, poisson_residual, restrict_residual, prolong_add, zero_level;
+};
+
+#endif
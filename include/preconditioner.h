@@ -0,0 +1,96 @@
+#ifndef PRECONDITIONER_H
+#define PRECONDITIONER_H
+
+#include <array>
+#include <vector>
+#include "tinycl.h"
+#include "sparsematrix.h"
+
+/*
+* A preconditioner M for the CG solver, the solver applies M^-1 to the residual
+* each iteration to solve the better conditioned system M^-1 Ax = M^-1 b. M must be
+* symmetric positive definite for CG to converge
+*/
+class Preconditioner {
+public:
+	virtual ~Preconditioner(){}
+	/*
+	* Load the kernels and upload any data needed to apply the preconditioner, the program
+	* passed is cg_kernels.cl built on the context. Will be called by the solver before
+	* any calls to apply, calling init again once initialized does nothing
+	*/
+	virtual void init(tcl::Context &context, const cl::Program &program) = 0;
+	/*
+	* Enqueue the preconditioner solve z = M^-1 r
+	*/
+	virtual void apply(tcl::Context &context, const cl::Buffer &r, cl::Buffer &z) = 0;
+};
+
+/*
+* The Jacobi or diagonal preconditioner, M = diag(A). Very cheap to apply but
+* only helps for systems with a badly scaled diagonal
+*/
+class JacobiPreconditioner : public Preconditioner {
+public:
+	/*
+	* Create the preconditioner from the diagonal of the matrix
+	*/
+	JacobiPreconditioner(const std::vector<float> &diag);
+	/*
+	* Create the preconditioner for the matrix, using its diagonal
+	*/
+	JacobiPreconditioner(const SparseMatrix<float> &mat);
+	void init(tcl::Context &context, const cl::Program &program) override;
+	void apply(tcl::Context &context, const cl::Buffer &r, cl::Buffer &z) override;
+
+private:
+	std::vector<float> invDiag;
+	bool initialized;
+	cl::Buffer invDiagBuf;
+	cl::Kernel jacobi_apply;
+};
+
+/*
+* The modified incomplete Cholesky preconditioner MIC(0), M = (D + L)D^-1(D + L^T)
+* where L is the strictly lower part of A and D is chosen so that the fill in dropped
+* by the incomplete factorization is compensated on the diagonal, scaled by tau. The
+* rows are multicolored so that each triangular solve runs one kernel per color, with
+* all rows of a color solved in parallel, the factorization uses the color ordering
+*/
+class MIC0Preconditioner : public Preconditioner {
+public:
+	/*
+	* Compute the factorization of the matrix, tau is the amount of the dropped fill
+	* in to compensate for, 0 gives the plain incomplete Cholesky IC(0)
+	*/
+	MIC0Preconditioner(const SparseMatrix<float> &mat, float tau = 0.97f);
+	void init(tcl::Context &context, const cl::Program &program) override;
+	void apply(tcl::Context &context, const cl::Buffer &r, cl::Buffer &z) override;
+	/*
+	* Get the number of colors used to order the rows
+	*/
+	int getColors() const;
+
+private:
+	/*
+	* Greedily color the rows so that no two coupled rows share a color
+	* and fill out color, rows and colorOffsets
+	*/
+	void colorRows();
+	/*
+	* Compute the inverse of the factorization's diagonal D
+	*/
+	void factor(float tau);
+
+	//Meaningful names for the buffers in the preconditioner buffer
+	enum BUFFER { ROWS, ROW_PTR, COL, VAL, COLOR, INV_DIAG, Y };
+
+	int dim;
+	bool initialized;
+	std::vector<int> rowPtr, col, color, rows, colorOffsets;
+	std::vector<float> val, invDiag;
+	std::array<cl::Buffer, 7> buffers;
+	cl::Kernel mic0_forward, mic0_backward;
+};
+
+#endif
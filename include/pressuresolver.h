@@ -0,0 +1,206 @@
+#ifndef PRESSURESOLVER_H
+#define PRESSURESOLVER_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include "tinycl.h"
+#include "solvestats.h"
+#include "cgsolver.h"
+#include "fftsolver.h"
+#include "relaxationsolver.h"
+#include "multigrid.h"
+
+/*
+* A solver for the SimpleFluid pressure system, the 5 point Laplacian of a periodic
+* dim x dim grid. Implementations are registered by name with a check of which grids
+* they can handle, so the sim can be given any of them without knowing which it has
+* The built in solvers are:
+* cg: unpreconditioned CG on the matrix-free Laplacian
+* cg_multigrid: CG preconditioned by a multigrid V-cycle, needs an even grid
+* multigrid: standalone multigrid V-cycles, needs an even grid
+* fft: the direct FFT solve, needs a power of 2 grid
+* relax_chebyshev and relax_sor: a fixed # of relaxation sweeps, need an even grid
+*/
+class PressureSolver {
+public:
+	typedef std::function<std::shared_ptr<PressureSolver>(int gridDim)> Factory;
+
+	virtual ~PressureSolver(){}
+	/*
+	* Get the name the solver is registered under
+	*/
+	virtual std::string name() const = 0;
+	/*
+	* Load the kernels and allocate the buffers needed, called once before any solves
+	*/
+	virtual void init(tcl::Context &context) = 0;
+	/*
+	* Enqueue solving Ax = b for the pressure x. x holds the last pressure found, which
+	* solvers may warm start from
+	*/
+	virtual void solve(tcl::Context &context, const cl::Buffer &b, cl::Buffer &x) = 0;
+	/*
+	* Get the stats of the last solve, solvers that don't iterate to a tolerance
+	* report what they can
+	*/
+	virtual SolveStats getStats() const = 0;
+
+	/*
+	* Register a solver under some name, available(gridDim) tells if it can solve a grid
+	* and make(gridDim) creates one. Registering an existing name replaces it
+	*/
+	static void registerSolver(const std::string &name, const std::function<bool(int)> &available,
+		const Factory &make);
+	/*
+	* Get the names of the registered solvers that can handle a grid, in registration order
+	*/
+	static std::vector<std::string> available(int gridDim);
+	/*
+	* Create a registered solver for a grid, returns nullptr if there's no such solver
+	* or it can't handle the grid
+	*/
+	static std::shared_ptr<PressureSolver> create(const std::string &name, int gridDim);
+};
+
+/*
+* CG on the matrix-free Laplacian, optionally preconditioned by multigrid. The solve
+* warm starts from x by default and the result is copied back to x
+*/
+class CGPressureSolver : public PressureSolver {
+public:
+	CGPressureSolver(int gridDim, bool multigrid);
+	std::string name() const override;
+	void init(tcl::Context &context) override;
+	void solve(tcl::Context &context, const cl::Buffer &b, cl::Buffer &x) override;
+	SolveStats getStats() const override;
+	/*
+	* Get the CG solver to change its settings, only valid after init
+	*/
+	CGSolver& getSolver();
+
+private:
+	int gridDim;
+	bool multigrid;
+	std::shared_ptr<CGSolver> solver;
+};
+
+/*
+* Standalone multigrid V-cycles until converged, starting from x
+*/
+class MultigridPressureSolver : public PressureSolver {
+public:
+	MultigridPressureSolver(int gridDim, int maxCycles = 50, float convergeLen = 1e-5);
+	std::string name() const override;
+	void init(tcl::Context &context) override;
+	void solve(tcl::Context &context, const cl::Buffer &b, cl::Buffer &x) override;
+	SolveStats getStats() const override;
+
+private:
+	Multigrid multigrid;
+	int maxCycles;
+	float convergeLen;
+	SolveStats stats;
+};
+
+/*
+* The direct FFT solve, which always counts as converged
+*/
+class FFTPressureSolver : public PressureSolver {
+public:
+	FFTPressureSolver(int gridDim);
+	std::string name() const override;
+	void init(tcl::Context &context) override;
+	void solve(tcl::Context &context, const cl::Buffer &b, cl::Buffer &x) override;
+	SolveStats getStats() const override;
+
+private:
+	FFTSolver fft;
+};
+
+/*
+* A fixed # of relaxation sweeps in place on x, which are only enqueued so the solve
+* never waits on the device. The residual is read back after the last sweep of every
+* statsInterval'th solve and the stats report the latest one found, an interval of
+* 0 (the default) never reads it back
+*/
+class RelaxationPressureSolver : public PressureSolver {
+public:
+	RelaxationPressureSolver(int gridDim, RelaxationSolver::METHOD method, int sweeps = 50,
+		float convergeLen = 1e-5, int statsInterval = 0);
+	std::string name() const override;
+	void init(tcl::Context &context) override;
+	void solve(tcl::Context &context, const cl::Buffer &b, cl::Buffer &x) override;
+	SolveStats getStats() const override;
+
+private:
+	RelaxationSolver relax;
+	RelaxationSolver::METHOD method;
+	float convergeLen;
+	int statsInterval, solves;
+	SolveStats stats;
+};
+
+/*
+* Picks the pressure solver for a grid on a device by running each available solver
+* for a few frames of a slowly changing system and keeping the fastest one whose
+* solves all reach a residual within relTol * ||b||, falling back to the most accurate
+* if none do. The choice and the measured costs are cached in a file per device name
+* and grid size, so later runs on the same device and grid skip the tuning
+*/
+class PressureTuner {
+public:
+	//The measurements of one solver, the mean time per frame in milliseconds including
+	//waiting for the device to finish, the worst relative residual and if it reached the tolerance
+	struct Result {
+		std::string name;
+		double meanTime;
+		double worstResidual;
+		bool converged;
+	};
+
+	/*
+	* Setup the tuner for a gridDim x gridDim grid, running frames timed frames of each
+	* solver after warmup untimed ones
+	*/
+	PressureTuner(int gridDim, float relTol = 1e-3f, int frames = 10, int warmup = 2);
+	/*
+	* Get the solver to use on the context, initialized and ready to solve. The cache is read
+	* from cacheFile if it has an entry for the device and grid, otherwise every available
+	* solver is run and the cache updated. If the cache can't be written, eg. in a read only
+	* directory, the choice is still returned and the next run tunes again. Pass an empty
+	* cacheFile to always tune
+	*/
+	std::shared_ptr<PressureSolver> select(tcl::Context &context,
+		const std::string &cacheFile = "../res/pressure_tuning.cache");
+	/*
+	* Get the measurements behind the last selection, either measured or from the cache
+	*/
+	const std::vector<Result>& getResults() const;
+	/*
+	* Check if the last selection came from the cache
+	*/
+	bool fromCache() const;
+
+private:
+	/*
+	* Run and time a solver, the solver is initialized on the context
+	*/
+	Result measure(tcl::Context &context, PressureSolver &solver);
+	/*
+	* Look up the choice for a device in the cache, returns an empty name if there isn't one
+	*/
+	std::string readCache(const std::string &cacheFile, const std::string &device);
+	/*
+	* Replace the entry for a device in the cache with the current results
+	*/
+	void writeCache(const std::string &cacheFile, const std::string &device, const std::string &chosen) const;
+
+	int gridDim, frames, warmup;
+	float relTol;
+	bool cached;
+	std::vector<Result> results;
+};
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef RELAXATIONSOLVER_H
+#define RELAXATIONSOLVER_H
+
+#include <vector>
+#include "tinycl.h"
+
+/*
+* A relaxation solver for the 5 point Laplacian on a periodic dim x dim grid, the
+* SimpleFluid pressure system. It runs a fixed budget of sweeps per solve with no dot
+* products, so unlike CG there are no reductions or reads back to the host between
+* sweeps. The solve works in place on x, starting from whatever is in it, so
+* passing last frame's pressure warm starts it. The methods are:
+* SOR: red-black successive over-relaxation, updating the red then the black cells
+* CHEBYSHEV: Chebyshev semi-iteration on the bounds of the Laplacian's non-zero
+*	eigenvalues, converging in about the square root of the sweeps SOR would need
+*	without its optimal omega
+*/
+class RelaxationSolver {
+public:
+	enum METHOD { SOR, CHEBYSHEV };
+	/*
+	* Setup a solver for a gridDim x gridDim grid, gridDim must be even so the red-black
+	* coloring wraps around the edges. sweeps is the # of sweeps to run in each solve
+	*/
+	RelaxationSolver(int gridDim, METHOD method = METHOD::CHEBYSHEV, int sweeps = 50);
+	/*
+	* Load the kernels from poisson_kernels.cl and allocate the buffers,
+	* calling init again once initialized does nothing
+	*/
+	void init(tcl::Context &context);
+	/*
+	* Run the sweep budget on Ax = b, updating x in place. If the residual check is on the
+	* solve stops early once the residual length is within convergeLen. Returns the # of
+	* sweeps run
+	*/
+	int solve(tcl::Context &context, const cl::Buffer &b, cl::Buffer &x);
+	/*
+	* Select the method to use for the following solves
+	*/
+	void setMethod(METHOD m);
+	/*
+	* Set the # of sweeps to run in each solve
+	*/
+	void setSweeps(int s);
+	/*
+	* Set the SOR relaxation weight, the default is the optimal 2 / (1 + sqrt(1 - rho^2))
+	* where rho = (1 + cos(2pi / dim)) / 2 is the Jacobi iteration's spectral radius
+	*/
+	void setOmega(float w);
+	/*
+	* Check the residual every interval sweeps, stopping once it's within convergeLen.
+	* Each check reads back to the host, an interval of 0 (the default) never checks
+	* so the sweeps are only enqueued, with no reductions or waiting on the device
+	*/
+	void setResidualCheck(int interval, float convergeLen = 1e-5);
+	/*
+	* Get the residual lengths found by the checks during the last solve, empty
+	* if the residual isn't being checked
+	*/
+	const std::vector<float>& getResidualHistory() const;
+	/*
+	* Enqueue finding the residual of x and read back its length, blocking until it's found
+	*/
+	float residualLength(tcl::Context &context, const cl::Buffer &b, const cl::Buffer &x);
+
+private:
+
+	int gridDim, sweeps, checkInterval;
+	METHOD method;
+	float omega, convergeLen;
+	//Bounds on the non-zero eigenvalues of the Laplacian for the Chebyshev iteration
+	float minEigen, maxEigen;
+	bool initialized;
+	std::vector<float> residuals;
+	//The Chebyshev iteration needs the last two iterates, these and x are rotated through
+	cl::Buffer cheb[2];
+	cl::Buffer r;
+	cl::Program poissonProgram;
+	//Kernel names here match the names in poisson_kernels.cl
+	cl::Kernel smooth_red_black, chebyshev_step, poisson_residual;
+};
+
+#endif
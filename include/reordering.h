@@ -0,0 +1,33 @@
+#ifndef REORDERING_H
+#define REORDERING_H
+
+#include <vector>
+
+/*
+* Fill reducing and bandwidth reducing orderings of the rows of a symmetric sparse
+* matrix, given the CSR structure of the full matrix. An ordering perm lists the old
+* row to put at each new position, so new row i is old row perm[i], and can be applied
+* to a SparseMatrix with SparseMatrix::permuted
+*/
+namespace reorder {
+	/*
+	* Reverse Cuthill-McKee: a breadth first search from a pseudo-peripheral row of each
+	* connected component, visiting neighbors by increasing degree, then reversed. Keeps the
+	* column indices of each row close to the diagonal, shrinking the bandwidth and profile
+	*/
+	std::vector<int> reverseCuthillMcKee(const std::vector<int> &rowPtr, const std::vector<int> &col);
+	/*
+	* A light nested dissection: each part is split at the middle level of a breadth first
+	* search from a pseudo-peripheral row, the two halves are ordered recursively and the
+	* separating level is put after them. Parts of at most leafSize rows are ordered by
+	* reverse Cuthill-McKee. Gives blocks of rows that only touch each other and their
+	* separator, which keeps the vector reads of a row group in a smaller working set
+	*/
+	std::vector<int> nestedDissection(const std::vector<int> &rowPtr, const std::vector<int> &col, int leafSize = 256);
+	/*
+	* Get the inverse of an ordering, the new position of each old row
+	*/
+	std::vector<int> inverse(const std::vector<int> &perm);
+}
+
+#endif
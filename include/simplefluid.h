@@ -2,11 +2,15 @@
 #define SIMPLEFLUID_H
 
 #include <array>
+#include <vector>
+#include <memory>
 #include <glm/glm.hpp>
 #include "tinycl.h"
 #include "window.h"
 #include "sparsematrix.h"
 #include "cgsolver.h"
+#include "solvestats.h"
+#include "pressuresolver.h"
 
 /*
 * Handles running a simple 2d MAC grid fluid simulation
@@ -55,6 +59,12 @@ private:
 	*/
 	void stepSim(float dt);
 	/*
+	* Check the CFL number of the last velocity range read back and enqueue finding the
+	* range of the out velocity field for the next check. The range is reduced on the
+	* device and read back without blocking, so the check lags a frame behind
+	*/
+	void checkCFL(int out, float dt);
+	/*
 	* For painting/pushing the fluid. Check if the mouse is clicked and
 	* then paint the cells below it and apply forces base on the mouse motion
 	* Note: CL-GL interop object must be acquired by CL prior to calling this
@@ -62,11 +72,6 @@ private:
 	*/
 	void clickFluid();
 	/*
-	* Generate the cell-cell interaction matrix for this simulation
-	* where diagonal entries are 4 and neighbor cells are -1
-	*/
-	SparseMatrix<float> createInteractionMatrix();
-	/*
 	* Compute the cell number of a cell at the x,y coordinates
 	*/
 	int cellNumber(int x, int y) const;
@@ -75,21 +80,44 @@ private:
 	* n is the absolute cell number (ie. [0, nCells])
 	*/
 	void cellPos(int n, int &x, int &y) const;
+	/*
+	* Print the mean and max # of CG pressure solve iterations per frame for
+	* each initial guess used during the session, the # of frames each solver ran
+	* and the highest CFL number seen
+	*/
+	void printSolveStats() const;
 
 private:
 	int dim;
 	Window &window;
-	SparseMatrix<float> interactionMat;
 	//OpenCL components of the sim
 	tcl::Context context;
-	CGSolver cgSolver;
+	//The initial guess the CG pressure solves start from and the stats of the
+	//frames solved from each guess
+	CGSolver::GUESS pressureGuess;
+	std::array<SolveStatsSummary, 3> solveStats;
+	//If the CG pressure solve is limited to a share of the frame time
+	bool pressureBudget;
+	//Every pressure solver available for the grid, the one in use, picked by the
+	//PressureTuner at startup, and the # of frames each has solved
+	std::vector<std::shared_ptr<PressureSolver>> pressureSolvers;
+	int pressureSolver;
+	std::vector<int> pressureFrames;
+	//The { max v_x, min v_x, max v_y, min v_y } of the last frame on the device and
+	//read back to the host, the read's event, the highest CFL number seen and if
+	//it's currently over 1, so we only warn when it crosses over
+	cl::Buffer velRange;
+	std::array<float, 4> velRangeHost;
+	cl::Event velRangeRead;
+	float maxCFL;
+	bool cflHigh;
 	cl::Program clProg;
 	//Other kernels we'll need (names match kernel names in simple_fluid.cl)
 	cl::Kernel velocity_divergence, subtract_pressure_x, subtract_pressure_y,
 		advect_field, advect_vx, advect_vy, advect_img_field, set_pixel,
 		apply_force;
 	//velBuf[0] is v_x, 1 is v_y
-	cl::Buffer velX[2], velY[2], velNegDivergence, brushColor, clickForce, gridDim;
+	cl::Buffer velX[2], velY[2], velNegDivergence, pressure, brushColor, clickForce, gridDim;
 #ifdef CL_VERSION_1_2
 	cl::ImageGL fluid[2];
 #else
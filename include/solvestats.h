@@ -0,0 +1,97 @@
+#ifndef SOLVESTATS_H
+#define SOLVESTATS_H
+
+#include <vector>
+#include <ostream>
+
+/*
+* Telemetry from a single solve. The phase timings are the device time spent in the kernels
+* of each phase in milliseconds, taken from OpenCL profiling events, and are only measured
+* if timing was asked for and the context was created with profiling on
+*/
+struct SolveStats {
+	int iterations, wastedIterations;
+	float initialResidual, finalResidual;
+	bool converged;
+	//The residual length the solve was aiming for, the wall clock time it took in milliseconds
+	//and if it was stopped short of the tolerance by its time budget
+	float tolerance;
+	double wallTime;
+	bool budgetLimited;
+	//The residual length after each iteration, only kept if asked for
+	std::vector<float> residualHistory;
+	//If the phases were timed and the time spent in the mat * vec products, the
+	//dot product reductions, the vector updates and applying the preconditioner
+	bool timed;
+	double spmvTime, reductionTime, updateTime, preconditionerTime;
+
+	SolveStats();
+	/*
+	* Get the total device time of the timed phases
+	*/
+	double deviceTime() const;
+};
+/*
+* Print a one line summary of a solve
+*/
+std::ostream& operator<<(std::ostream &os, const SolveStats &s);
+
+/*
+* Aggregates the stats of many solves, eg. the pressure solve of each frame of a run,
+* to track the iteration counts and timings over the whole run without keeping every solve
+*/
+class SolveStatsSummary {
+public:
+	SolveStatsSummary();
+	/*
+	* Add a solve's stats to the summary
+	*/
+	void add(const SolveStats &s);
+	/*
+	* Reset the summary to having seen no solves
+	*/
+	void clear();
+	/*
+	* Get the # of solves added and the # of them that didn't converge
+	*/
+	int solves() const;
+	int unconverged() const;
+	/*
+	* Get the # of solves cut short by their time budget
+	*/
+	int budgetLimited() const;
+	/*
+	* Get the mean wall clock time per solve in milliseconds
+	*/
+	double meanWallTime() const;
+	/*
+	* Get the mean, standard deviation and max iteration counts of the solves
+	*/
+	double meanIterations() const;
+	double stddevIterations() const;
+	int maxIterations() const;
+	/*
+	* Get the largest final residual length of the solves
+	*/
+	float maxFinalResidual() const;
+	/*
+	* Get the mean device time per solve of each phase in milliseconds, over the timed solves
+	*/
+	double meanSpMVTime() const;
+	double meanReductionTime() const;
+	double meanUpdateTime() const;
+	double meanPreconditionerTime() const;
+	/*
+	* Print the summary on a few lines
+	*/
+	void print(std::ostream &os) const;
+
+private:
+	int count, unconvergedCount, budgetLimitedCount, timedCount, mostIterations;
+	long long totalIterations;
+	double iterationsSq;
+	float worstResidual;
+	double wallTime, spmvTime, reductionTime, updateTime, preconditionerTime;
+};
+
+#endif
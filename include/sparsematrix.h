@@ -4,9 +4,14 @@
 #include <string>
 #include <vector>
 #include <ostream>
+#include <iostream>
 #include <sstream>
 #include <fstream>
 #include <algorithm>
+#include <stdexcept>
+#include <utility>
+#include <cstdlib>
+#include "mtxloader.h"
 
 /*
 * Defines an element in the sparse matrix, its row, column and value
@@ -45,25 +50,39 @@ bool colMajor(const MatrixElement<T> &lhs, const MatrixElement<T> &rhs){
 
 /*
 * A sparse matrix, supports loading coordinate symmetric matrices
-* from matrix market files or specifying directly the sparse matrix elements
+* from matrix market files or specifying directly the sparse matrix elements.
+* A symmetric matrix can store only its upper triangle and diagonal to halve its
+* memory, in which case the CSR, ELL, SELL and row length getters still give the
+* full matrix, mirroring the stored elements, and getUpperCSR gives the stored half
 */
 template<class T>
 class SparseMatrix {
 public:
 	/*
 	* Load the matrix from a matrix market file, rowMaj true if we want to 
-	* sort by row ascending, ie. row major, currently only support
-	* loading from coordinate real symmetric matrices
+	* sort by row ascending, ie. row major. By default the file is loaded with the
+	* fast loader in mtxloader.h, which supports general and symmetric coordinate matrices.
+	* fast false uses the original stream parser, which only supports coordinate real
+	* symmetric matrices. upperOnly true stores only the upper triangle and diagonal of a
+	* symmetric matrix. cache true has the fast loader use and keep a binary cache next to
+	* the file, so the file's directory must be writable. If the file can't be loaded the
+	* matrix is left empty with dim 0
 	*/
-	SparseMatrix(const std::string &file, bool rowMaj = true){
-		loadMatrix(file, rowMaj);
+	SparseMatrix(const std::string &file, bool rowMaj = true, bool fast = true, bool upperOnly = false,
+		bool cache = false)
+		: symmetric(false), upper(false), dim(0)
+	{
+		if (fast)
+			loadMatrixFast(file, rowMaj, upperOnly, cache);
+		else
+			loadMatrix(file, rowMaj, upperOnly);
 	}
 	/*
 	* Load the matrix from data contained within the row, col, and val arrays
 	* to setup a matrix of dim dimensions in the major order desired
 	*/
 	SparseMatrix(const int *row, const int *col, const T *vals, int nElems, int dim, bool rowMaj = true) 
-		: dim(dim) 
+		: symmetric(false), upper(false), dim(dim)
 	{
 		elements.reserve(nElems);
 		for (int i = 0; i < nElems; ++i)
@@ -79,17 +98,92 @@ public:
 	* Load the matrix from a list of elements, specifying the dimensions and if it's symmetric or not
 	*/
 	SparseMatrix(const std::vector<MatrixElement<T>> &elem, int dim, bool symmetric, bool rowMaj = true)
-		: elements(elem), dim(dim), symmetric(symmetric)
+		: elements(elem), symmetric(symmetric), upper(false), dim(dim)
 	{
-		if (rowMaj)
-			std::sort(elements.begin(), elements.end(), rowMajor<T>);
-		else
-			std::sort(elements.begin(), elements.end(), colMajor<T>);
+		sortElements(rowMaj);
+	}
+	/*
+	* Load the matrix from a list of elements we can take, avoiding a copy of the list
+	*/
+	SparseMatrix(std::vector<MatrixElement<T>> &&elem, int dim, bool symmetric, bool rowMaj = true)
+		: elements(std::move(elem)), symmetric(symmetric), upper(false), dim(dim)
+	{
+		sortElements(rowMaj);
+	}
+	/*
+	* Drop the elements below the diagonal of a symmetric matrix, keeping only the
+	* upper triangle and diagonal. Does nothing if the matrix isn't symmetric
+	*/
+	void storeUpper(){
+		if (!symmetric || upper)
+			return;
+		elements.erase(std::remove_if(elements.begin(), elements.end(),
+			[](const MatrixElement<T> &e){ return e.row > e.col; }), elements.end());
+		std::vector<MatrixElement<T>>(elements).swap(elements);
+		upper = true;
+	}
+	/*
+	* Get the # of non-zeros in the full matrix, counting the mirrored
+	* elements if only the upper triangle is stored
+	*/
+	int nonZeros() const {
+		if (!upper)
+			return elements.size();
+		int diag = 0;
+		for (const MatrixElement<T> &e : elements)
+			diag += e.row == e.col ? 1 : 0;
+		return 2 * elements.size() - diag;
+	}
+	/*
+	* Get the matrix with its rows and columns reordered by perm, so row i of the result is row
+	* perm[i] of this matrix, eg. an ordering from reordering.h. A half stored matrix stays in
+	* its upper triangle
+	*/
+	SparseMatrix<T> permuted(const std::vector<int> &perm, bool rowMaj = true) const {
+		std::vector<int> inv(perm.size());
+		for (size_t i = 0; i < perm.size(); ++i)
+			inv[perm[i]] = i;
+		std::vector<MatrixElement<T>> elems;
+		elems.reserve(elements.size());
+		for (const MatrixElement<T> &e : elements){
+			MatrixElement<T> p(inv[e.row], inv[e.col], e.val);
+			elems.push_back(upper && p.row > p.col ? p.diagonal() : p);
+		}
+		SparseMatrix<T> mat(std::move(elems), dim, symmetric, rowMaj);
+		mat.upper = upper;
+		return mat;
+	}
+	/*
+	* Get the bandwidth of the matrix, the largest distance of an element from the diagonal
+	*/
+	int bandwidth() const {
+		int band = 0;
+		for (const MatrixElement<T> &e : elements)
+			band = std::max(band, std::abs(e.row - e.col));
+		return band;
+	}
+	/*
+	* Get the profile of the matrix, the sum over the rows of the distance from the first
+	* element in the row to the diagonal, counting the mirrored elements of a half stored matrix
+	*/
+	long long profile() const {
+		std::vector<int> first(dim);
+		for (int i = 0; i < dim; ++i)
+			first[i] = i;
+		for (const MatrixElement<T> &e : elements){
+			first[e.row] = std::min(first[e.row], e.col);
+			if (upper)
+				first[e.col] = std::min(first[e.col], e.row);
+		}
+		long long sum = 0;
+		for (int i = 0; i < dim; ++i)
+			sum += i - first[i];
+		return sum;
 	}
 	/*
 	* Get the underlying row, column and value arrays for use in passing to OpenCL
 	* the row, col and val arrays must have been allocated previously and should have enough
-	* room to contain elements.size() values
+	* room to contain elements.size() values. Only the stored elements are given
 	*/
 	void getRaw(int *row, int *col, T *val) const {
 		for (size_t i = 0; i < elements.size(); ++i){
@@ -98,10 +192,177 @@ public:
 			val[i] = elements.at(i).val;
 		}
 	}
+	/*
+	* Get the matrix in compressed row (CSR) form for use in passing to OpenCL. rowPtr must
+	* have room for dim + 1 values and col and val room for nonZeros() values
+	* The elements of row i will be in [rowPtr[i], rowPtr[i + 1]) of col and val
+	*/
+	void getCSR(int *rowPtr, int *col, T *val) const {
+		//Count the elements in each row then scan the counts to find where each row starts
+		std::fill(rowPtr, rowPtr + dim + 1, 0);
+		for (const MatrixElement<T> &e : elements){
+			++rowPtr[e.row + 1];
+			if (upper && e.row != e.col)
+				++rowPtr[e.col + 1];
+		}
+		for (int i = 0; i < dim; ++i)
+			rowPtr[i + 1] += rowPtr[i];
+		//Scatter the elements into their rows, this works regardless of the major order we're sorted in
+		//and with either order the mirrored elements keep each row sorted by column
+		std::vector<int> next(rowPtr, rowPtr + dim);
+		for (const MatrixElement<T> &e : elements){
+			col[next[e.row]] = e.col;
+			val[next[e.row]++] = e.val;
+			if (upper && e.row != e.col){
+				col[next[e.col]] = e.row;
+				val[next[e.col]++] = e.val;
+			}
+		}
+	}
+	/*
+	* Get the CSR form of just the upper triangle and diagonal of a symmetric matrix, whether
+	* the lower triangle is stored or not
+	*/
+	void getUpperCSR(std::vector<int> &rowPtr, std::vector<int> &col, std::vector<T> &val) const {
+		rowPtr.assign(dim + 1, 0);
+		for (const MatrixElement<T> &e : elements){
+			if (e.row <= e.col)
+				++rowPtr[e.row + 1];
+		}
+		for (int i = 0; i < dim; ++i)
+			rowPtr[i + 1] += rowPtr[i];
+		col.resize(rowPtr[dim]);
+		val.resize(rowPtr[dim]);
+		std::vector<int> next(rowPtr.begin(), rowPtr.end() - 1);
+		for (const MatrixElement<T> &e : elements){
+			if (e.row <= e.col){
+				col[next[e.row]] = e.col;
+				val[next[e.row]++] = e.val;
+			}
+		}
+	}
+	/*
+	* Get the # of elements in each row of the matrix
+	*/
+	std::vector<int> rowLengths() const {
+		std::vector<int> lengths(dim, 0);
+		for (const MatrixElement<T> &e : elements){
+			++lengths[e.row];
+			if (upper && e.row != e.col)
+				++lengths[e.col];
+		}
+		return lengths;
+	}
+	/*
+	* Get the matrix in ELLPACK form, where every row is padded out to width elements and
+	* stored column-major so element j of row i is at j * dim + i of col and val, letting
+	* neighboring rows read neighboring memory. width must be at least the longest row's length
+	* and col and val need room for dim * width values. Padding has col 0 and val 0
+	*/
+	void getELL(int width, int *col, T *val) const {
+		std::vector<int> rowPtr(dim + 1), csrCol(nonZeros());
+		std::vector<T> csrVal(csrCol.size());
+		getCSR(&rowPtr[0], &csrCol[0], &csrVal[0]);
+		std::fill(col, col + dim * width, 0);
+		std::fill(val, val + dim * width, T(0));
+		for (int i = 0; i < dim; ++i){
+			for (int j = rowPtr[i]; j < rowPtr[i + 1]; ++j){
+				col[(j - rowPtr[i]) * dim + i] = csrCol[j];
+				val[(j - rowPtr[i]) * dim + i] = csrVal[j];
+			}
+		}
+	}
+	/*
+	* Get the order rows are stored in the SELL-C-sigma form: within each window of sigma
+	* rows the rows are sorted by length, longest first, so rows of similar length share slices.
+	* Entry k is the row stored at position k
+	*/
+	std::vector<int> sellPermutation(int sigma) const {
+		std::vector<int> lengths = rowLengths();
+		std::vector<int> perm(dim);
+		for (int i = 0; i < dim; ++i)
+			perm[i] = i;
+		for (int i = 0; i < dim; i += sigma){
+			std::stable_sort(perm.begin() + i, perm.begin() + std::min(i + sigma, dim),
+				[&lengths](int a, int b){ return lengths[a] > lengths[b]; });
+		}
+		return perm;
+	}
+	/*
+	* Get the matrix in sliced ELLPACK (SELL-C-sigma) form. The rows are reordered by
+	* sellPermutation(sigma) and split into slices of c rows, each slice is padded to its
+	* longest row and stored column-major like ELL. The elements of slice s are in
+	* [slicePtr[s], slicePtr[s + 1]) of col and val, with element j of the slice's row k at
+	* slicePtr[s] + j * c + k. perm gets the original row of each position. The last slice
+	* is padded out to c rows, and all padding has col 0 and val 0
+	*/
+	void getSELL(int c, int sigma, std::vector<int> &slicePtr, std::vector<int> &perm,
+		std::vector<int> &col, std::vector<T> &val) const
+	{
+		std::vector<int> rowPtr(dim + 1), csrCol(nonZeros());
+		std::vector<T> csrVal(csrCol.size());
+		getCSR(&rowPtr[0], &csrCol[0], &csrVal[0]);
+		perm = sellPermutation(sigma);
+		int nSlices = (dim + c - 1) / c;
+		slicePtr.assign(nSlices + 1, 0);
+		for (int s = 0; s < nSlices; ++s){
+			int width = 0;
+			for (int k = s * c; k < std::min((s + 1) * c, dim); ++k)
+				width = std::max(width, rowPtr[perm[k] + 1] - rowPtr[perm[k]]);
+			slicePtr[s + 1] = slicePtr[s] + width * c;
+		}
+		col.assign(slicePtr[nSlices], 0);
+		val.assign(slicePtr[nSlices], T(0));
+		for (int k = 0; k < dim; ++k){
+			int row = perm[k];
+			int start = slicePtr[k / c] + k % c;
+			for (int j = rowPtr[row]; j < rowPtr[row + 1]; ++j){
+				col[start + (j - rowPtr[row]) * c] = csrCol[j];
+				val[start + (j - rowPtr[row]) * c] = csrVal[j];
+			}
+		}
+	}
 
 private:
+	//Sort the elements into the major order desired, skipping the sort if they already are
+	void sortElements(bool rowMaj){
+		if (rowMaj && !std::is_sorted(elements.begin(), elements.end(), rowMajor<T>))
+			std::sort(elements.begin(), elements.end(), rowMajor<T>);
+		else if (!rowMaj && !std::is_sorted(elements.begin(), elements.end(), colMajor<T>))
+			std::sort(elements.begin(), elements.end(), colMajor<T>);
+	}
+	//Load a matrix from a matrix market file, or its cache if cache is set, with the fast loader
+	void loadMatrixFast(const std::string &file, bool rowMaj = true, bool upperOnly = false, bool cache = false){
+		try {
+			mtx::CSRMatrix csr = mtx::load(file, cache);
+			dim = csr.dim();
+			symmetric = csr.symmetric();
+			upper = symmetric && upperOnly;
+			//The CSR arrays are already in row major order
+			const int *rowPtr = csr.rowPtr();
+			const int *col = csr.col();
+			size_t n = 0;
+			for (int i = 0; i < dim; ++i){
+				for (int j = rowPtr[i]; j < rowPtr[i + 1]; ++j)
+					n += !upper || col[j] >= i ? 1 : 0;
+			}
+			elements.resize(n);
+			n = 0;
+			for (int i = 0; i < dim; ++i){
+				for (int j = rowPtr[i]; j < rowPtr[i + 1]; ++j){
+					if (!upper || col[j] >= i)
+						elements[n++] = MatrixElement<T>(i, col[j], static_cast<T>(csr.val()[j]));
+				}
+			}
+			if (!rowMaj)
+				std::sort(elements.begin(), elements.end(), colMajor<T>);
+		}
+		catch (const std::runtime_error &e){
+			std::cout << "Error: " << e.what() << std::endl;
+		}
+	}
 	//Parse and load a matrix from a matrix market file
-	void loadMatrix(const std::string &file, bool rowMaj = true){
+	void loadMatrix(const std::string &file, bool rowMaj = true, bool upperOnly = false){
 		if (file.substr(file.size() - 3, 3) != "mtx"){
 			std::cout << "Error: Not a Matrix Market file: " << file << std::endl;
 			return;
@@ -130,6 +391,7 @@ private:
 						return;
 					}
 					symmetric = true;
+					upper = upperOnly;
 				}
 			}
 			//Non-comments will either be M N L info or matrix elements
@@ -140,7 +402,7 @@ private:
 					int m, n, l;
 					ss >> m >> n >> l;
 					//Also account for # off diagonal elements
-					if (symmetric)
+					if (symmetric && !upper)
 						l += l - n;
 					dim = m;
 					elements.reserve(l);
@@ -153,11 +415,17 @@ private:
 					//Matrix Market is 1-indexed, so subtract 1
 					elem.row--;
 					elem.col--;
-					elements.push_back(elem);
 					//If the row is symmetric we'll only be given the diagonal and lower-triangular implying that
 					//if we're given an off-diagonal: i j v then a corresponding element: j i v should also be inserted
-					if (symmetric && elem.row != elem.col)
-						elements.push_back(elem.diagonal());
+					//If we're only storing the upper triangle we just keep whichever of the two is in it
+					if (upper){
+						elements.push_back(elem.row <= elem.col ? elem : elem.diagonal());
+					}
+					else {
+						elements.push_back(elem);
+						if (symmetric && elem.row != elem.col)
+							elements.push_back(elem.diagonal());
+					}
 				}
 				readComment = false;
 			}
@@ -172,7 +440,8 @@ private:
 
 public:
 	std::vector<MatrixElement<T>> elements;
-	bool symmetric;
+	//upper is true if only the upper triangle and diagonal of the symmetric matrix are stored
+	bool symmetric, upper;
 	int dim;
 };
 //Print the sparse matrix
@@ -1,6 +1,9 @@
 #ifndef TINYCL_H
 #define TINYCL_H
 
+#include <map>
+#include <string>
+#include <vector>
 #define __CL_ENABLE_EXCEPTIONS
 #include <CL/cl.hpp>
 
@@ -9,6 +12,35 @@ namespace tcl {
 	enum DEVICE { CPU = CL_DEVICE_TYPE_CPU, GPU = CL_DEVICE_TYPE_GPU };
 	enum MEM { READ_ONLY = CL_MEM_READ_ONLY, WRITE_ONLY = CL_MEM_WRITE_ONLY,
 		READ_WRITE = CL_MEM_READ_WRITE };
+	/*
+	* The operations Context::reduce and Context::exclusiveScan can do
+	* SUM: the sum of the elements
+	* MAX, MIN: the largest or smallest element
+	* DOT: the dot product of two vectors, only for reductions
+	*/
+	enum REDUCE { SUM, MAX, MIN, DOT };
+
+	/*
+	* The OpenCL C name of the element types the reductions and scans can work on
+	*/
+	template<typename T>
+	struct CLType;
+	template<>
+	struct CLType<float> {
+		static const char* name(){ return "float"; }
+	};
+	template<>
+	struct CLType<double> {
+		static const char* name(){ return "double"; }
+	};
+	template<>
+	struct CLType<int> {
+		static const char* name(){ return "int"; }
+	};
+	template<>
+	struct CLType<unsigned int> {
+		static const char* name(){ return "uint"; }
+	};
 
 	/*
 	* A lightweight class for simplifying some operations with OpenCL contexts
@@ -24,14 +56,16 @@ namespace tcl {
 		* use the first available device of the desired type will be chosen
 		* perhaps later I'll add some desired properties that can be looked for
 		* @param dev Device type to try and get
-		* @param interop If we want OpenGL interop
+		* @param interop If we want OpenGL interop, not available if built with TCL_NO_GL
 		* @param profile If we want profiling enabled in the OpenCL context
 		*/
 		Context(DEVICE dev, bool interop, bool profile);
 		/*
 		* Load a program from the file for use
+		* @param file The program source file
+		* @param options Options to build the program with, eg. -D defines, default none
 		*/
-		cl::Program loadProgram(const std::string &file);
+		cl::Program loadProgram(const std::string &file, const std::string &options = "");
 		/*
 		* Create a buffer of some desired size and pass some data to it
 		* @param mem Type of memory we want to create
@@ -44,6 +78,7 @@ namespace tcl {
 		*/
 		cl::Buffer buffer(int mem, size_t size, const void *data, size_t offset = 0, bool blocking = false,
 			const std::vector<cl::Event> *depends = nullptr, cl::Event *notify = nullptr);
+#ifndef TCL_NO_GL
 		/*
 		* Create a buffer to make use of an existing OpenGL buffer for data
 		* Note: Interop context is required!
@@ -61,6 +96,7 @@ namespace tcl {
 		cl::ImageGL imageGL(int mem, GLuint tex);
 #else
 		cl::Image2DGL imageGL(int mem, GLuint tex);
+#endif
 #endif
 		/*
 		* Write some data to a buffer
@@ -100,8 +136,109 @@ namespace tcl {
 		void runNDKernel(cl::Kernel &kernel, cl::NDRange global, cl::NDRange local,
 			cl::NDRange offset, bool blocking = false, const std::vector<cl::Event> *depends = nullptr,
 			cl::Event *notify = nullptr);
+		/*
+		* Record the event of each kernel run through runNDKernel into a list, until called
+		* again with nullptr. Kernels given their own notify event aren't recorded. The context
+		* must have been created with profiling for the events to have timings
+		* @param events The list to append the kernel events to, nullptr to stop recording
+		*/
+		void recordKernelEvents(std::vector<cl::Event> *events);
+		/*
+		* Check if the command queue was created with profiling enabled
+		*/
+		bool profilingEnabled() const;
+		/*
+		* Pick a power of 2 work group size for kernels that need one, like tree reductions in
+		* local memory. Gives the smallest power of 2 that's at least limit, or the largest the
+		* device and all the kernels can run if that's smaller
+		* @param kernels The kernels that will be run with the work group size
+		* @param limit The size to stop at, default 256
+		*/
+		int powerOfTwoGroupSize(const std::vector<cl::Kernel> &kernels, int limit = 256) const;
+		/*
+		* Enqueue a reduction of the n elements of a, writing the result to out[outIdx]. The kernels
+		* for each type and operation are built from res/reduce.cl on first use and kept, as are the
+		* scratch buffers. float sums accumulate in double if the device supports it, otherwise with
+		* compensated sums. Reductions are run through runNDKernel so they're recorded like any other
+		* kernel, throws a std::runtime_error for a DOT without b or double on a device without fp64
+		* @param op The reduction to do
+		* @param a The vector to reduce
+		* @param n The # of elements to reduce
+		* @param out The buffer to write the result to
+		* @param outIdx The element of out to write the result to, default 0
+		* @param b The second vector of a DOT, default none
+		* @param notify Event to notify when the result is written, default none
+		*/
+		template<typename T>
+		void reduce(REDUCE op, const cl::Buffer &a, size_t n, cl::Buffer &out, size_t outIdx = 0,
+			const cl::Buffer *b = nullptr, cl::Event *notify = nullptr)
+		{
+			reduceBuffer(CLType<T>::name(), op, a, b, n, out, outIdx, notify);
+		}
+		/*
+		* Enqueue a reduction of the n elements of a and read the result back to the host
+		* @param op The reduction to do
+		* @param a The vector to reduce
+		* @param n The # of elements to reduce
+		* @param result Host memory to read the result to, must stay valid until notify completes
+		* @param notify Event to notify when the result has been read, if nullptr the call blocks
+		* @param b The second vector of a DOT, default none
+		*/
+		template<typename T>
+		void reduce(REDUCE op, const cl::Buffer &a, size_t n, T *result, cl::Event *notify,
+			const cl::Buffer *b = nullptr)
+		{
+			reduceBuffer(CLType<T>::name(), op, a, b, n, mReduceResult, 0, nullptr);
+			readData(mReduceResult, sizeof(T), result, 0, notify == nullptr, nullptr, notify);
+		}
+		/*
+		* Enqueue an exclusive scan of the n elements of in into out, so out[i] is the sum (or max
+		* or min) of in[0, i) and out[0] is the operation's identity. in and out can be the same
+		* buffer. Throws a std::runtime_error for DOT
+		* @param op The operation to scan with
+		* @param in The vector to scan
+		* @param out The buffer to write the scan to
+		* @param n The # of elements to scan
+		* @param notify Event to notify when the scan is written, default none
+		*/
+		template<typename T>
+		void exclusiveScan(REDUCE op, const cl::Buffer &in, cl::Buffer &out, size_t n,
+			cl::Event *notify = nullptr)
+		{
+			scanBuffer(CLType<T>::name(), sizeof(T), op, in, out, n, notify);
+		}
 
 	private:
+		//The reduction and scan kernels built from res/reduce.cl for a type and operation
+		//along with the work group size they run with and their accumulator's size
+		struct ReduceKernels {
+			cl::Program program;
+			cl::Kernel reduce_partial, reduce_final, scan_blocks, add_block_offsets;
+			int groupSize;
+			size_t accSize;
+		};
+		/*
+		* Get the kernels for a type and operation, building them if needed
+		*/
+		ReduceKernels& reduceKernels(const std::string &type, REDUCE op);
+		/*
+		* Make sure some scratch buffer has at least size bytes, growing it if not
+		*/
+		void reserveScratch(cl::Buffer &buf, size_t &bufSize, size_t size);
+		/*
+		* The untyped reduction and scan behind reduce and exclusiveScan
+		*/
+		void reduceBuffer(const std::string &type, REDUCE op, const cl::Buffer &a,
+			const cl::Buffer *b, size_t n, cl::Buffer &out, size_t outIdx, cl::Event *notify);
+		void scanBuffer(const std::string &type, size_t typeSize, REDUCE op, const cl::Buffer &in,
+			cl::Buffer &out, size_t n, cl::Event *notify);
+		/*
+		* Scan one level of a scan, the block totals are put in the scratch buffer of the level
+		* and scanned by the next level
+		*/
+		void scanLevel(ReduceKernels &kernels, size_t typeSize, const cl::Buffer &in, cl::Buffer &out,
+			size_t n, size_t level, cl::Event *notify);
+
 		/*
 		* Select the device to be used and setup the context and command queue
 		* @param dev Device type to get
@@ -116,6 +253,16 @@ namespace tcl {
 		*/
 		void selectInteropDevice(DEVICE dev, bool profile);
 
+		//The list kernel events are being recorded to, if any
+		std::vector<cl::Event> *mKernelEvents;
+		//The reduction and scan kernels by type and operation, the partials of the reductions,
+		//the result of reductions read to the host and the block totals of each level of a scan
+		std::map<std::string, ReduceKernels> mReduceKernels;
+		cl::Buffer mReducePartial, mReduceResult;
+		size_t mReducePartialSize;
+		std::vector<cl::Buffer> mScanSums;
+		std::vector<size_t> mScanSumsSize;
+
 	public:
 		std::vector<cl::Platform> mPlatforms;
 		std::vector<cl::Device> mDevices;
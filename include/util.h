@@ -4,14 +4,18 @@
 #include <array>
 #include <string>
 #include <ostream>
+#ifndef TCL_NO_GL
 #include <glm/glm.hpp>
+#endif
 #define __CL_ENABLE_EXCEPTIONS
 #include <CL/cl.hpp>
 
 /*
-* A namespace to contain various utility functions
+* A namespace to contain various utility functions, building with TCL_NO_GL
+* leaves out the OpenGL and SDL ones for headless programs
 */
 namespace util {
+#ifndef TCL_NO_GL
 	/*
 	* Vertices and element indices for a textured quad
 	*/
@@ -31,10 +35,12 @@ namespace util {
 		0, 1, 2,
 		1, 3, 2
 	};
+#endif
 	/*
 	* Read the entire contents of a file into a string and return it
 	*/
 	std::string readFile(const std::string &file);
+#ifndef TCL_NO_GL
 	/*
 	* Load a GLSL shader from some file, will return -1 if loading failed
 	*/
@@ -57,6 +63,7 @@ namespace util {
 	* the message will be formated: msg error: gl error \n
 	*/
 	bool logGLError(std::ostream &os, const std::string &msg);
+#endif
 	/*
 	* Log an OpenCL error and translate the error code into the error string
 	*/
@@ -1,26 +1,66 @@
 /*
 * Kernels to manage running the Conjuage Gradient method
 * also includes some math kernels that are needed during the
-* method such as sparse matrix * vector kernel and a n-dim
-* dot product kernel
+* method such as sparse matrix * vector kernels. The dot products are
+* done with tcl::Context::reduce, see reduce.cl
 *
 * An Overview of the Conjugate Gradient algorithm here.
 * The algorithm is split up at synchronization points to avoid
-* being limited by max local work group sizes
+* being limited by max local work group sizes. Dot products are done
+* as a two stage reduction, each work group sums its part of the vector
+* in local memory then a single work group sums up the partials
 * while (not_done)
-*	find r_dot_r_k using big_dot and sum_partial
-*	find Ap using sparse_mat_vec_mult
-*	find pAp using big_dot and sum_partial
+*	find r_dot_r_k with a DOT reduction
+*	find Ap using csr, csr_sym, ell or sell_mat_vec_mult or laplacian_mat_vec_mult
+*	find pAp with a DOT reduction
 *	find x_k+1 & r_k+1 using update_xr
-*	find r_dot_r_k+1 using big_dot and sum_partial
+*	find z_k+1 = M^-1 r_k+1 with the preconditioner, if there is one
+*	find r_dot_z_k+1 and r_dot_r_k+1 with DOT reductions
 *	find p_k+1 using update_p
+*
+* Small systems can instead run the whole classic loop in one work group with cg_local_solve,
+* which shares p and Ap through local memory and syncs with barriers instead of kernel
+* boundaries, so a solve is a single kernel launch
+*
+* There's also a pipelined formulation (Ghysels & Vanroose) which only has
+* one reduction per iteration, and is independent of the mat * vec so
+* the iteration is only 3 kernels. With q = Aw, w = Ar:
+* setup
+*	find w_0 = Ar_0 and q_0 = Aw_0
+*	find r_dot_r_0 and w_dot_r_0 using pipelined_update with alpha = beta = 0
+*	find alpha_0 using pipelined_scalars
+* while (not_done)
+*	find z, s, p, x_k+1, r_k+1, w_k+1 and partials of r_dot_r_k+1 and
+*		w_dot_r_k+1 using pipelined_update
+*	find r_dot_r_k+1, w_dot_r_k+1, alpha_k+1 and beta_k+1 using pipelined_scalars
+*	find q_k+1 = Aw_k+1
+*
+* In both formulations the update kernels do nothing once the residual is within
+* the tolerance, so the host can keep enqueueing iterations ahead of reading back the
+* residual without them changing the solution. The kernels that finish an iteration
+* count it and log its residual length so the history is kept on the device
+*
+* Vectors are always float, but the reductions fused into the pipelined and single work group
+* kernels accumulate in acc_t which is double if the program is built with -DCG_USE_DOUBLE (the
+* device needs cl_khr_fp64) and float otherwise, matching tcl::Context::reduce. The pipelined
+* partials are stored as acc_t so the host must size their buffers and the reductions' local
+* scratch by sizeof(acc_t). With float accumulation each work item keeps a compensated (Kahan)
+* sum to limit the round off
 */
+#ifdef CG_USE_DOUBLE
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double acc_t;
+#else
+typedef float acc_t;
+#endif
 /*
 * Multiply a row in a sparse matrix and a vector. row, col and val should
 * be the sparse matrix in row-major order and contain n_vals.
 * The matrix should be n x n and the vectors vect and res should be n long
 * where n is the global size. Each kernel will work on row id, where
 * id is the kernel's global id
+* Note: finding the row's range is a linear scan of row so this is O(n * n_vals),
+* csr_mat_vec_mult should be used instead. This is kept to benchmark against
 */
 __kernel void sparse_mat_vec_mult(int n_vals, __global int *row, __global int *col, 
 	__global float *val, __global float *vect, __global float *res)
@@ -51,50 +91,718 @@ __kernel void sparse_mat_vec_mult(int n_vals, __global int *row, __global int *c
 	res[id] = sum;
 }
 /*
-* Dot two large vectors together with length n, kernel should be run
-* with global size of n. Note that the partial is returned and must be
-* summed up seperately. This is done to reduce dependencies between kernels
-* ie. no need to wait for everyone to finish their multiplication
+* Multiply a sparse matrix in compressed row (CSR) form and a vector. row_ptr should
+* contain n + 1 offsets where the elements of row i are in [row_ptr[i], row_ptr[i + 1])
+* of col and val. The matrix should be n x n and the vectors vect and res should be n long
+* where n is the global size. Each kernel will work on the row matching its global id
+*/
+__kernel void csr_mat_vec_mult(__global int *row_ptr, __global int *col, __global float *val,
+	__global float *vect, __global float *res)
+{
+	int id = get_global_id(0);
+	int end = row_ptr[id + 1];
+	float sum = 0.f;
+	for (int i = row_ptr[id]; i < end; ++i){
+		sum += val[i] * vect[col[i]];
+	}
+	res[id] = sum;
+}
+/*
+* Multiply a sparse matrix in ELLPACK form and a vector. Each row is padded to width
+* elements stored column-major, so element j of row i is at j * n + i of col and val
+* and neighboring work items read neighboring memory. Padding should have val 0.
+* The matrix should be n x n where n is the global size, each kernel works on the row
+* matching its global id
+*/
+__kernel void ell_mat_vec_mult(int width, __global int *col, __global float *val,
+	__global float *vect, __global float *res)
+{
+	int id = get_global_id(0);
+	int n = get_global_size(0);
+	float sum = 0.f;
+	for (int j = 0; j < width; ++j){
+		sum += val[j * n + id] * vect[col[j * n + id]];
+	}
+	res[id] = sum;
+}
+/*
+* Multiply a sparse matrix in sliced ELLPACK (SELL-C-sigma) form and a vector. The rows
+* are stored reordered in slices of c rows, with slice s in [slice_ptr[s], slice_ptr[s + 1])
+* of col and val stored column-major, so element j of the slice's row k is at
+* slice_ptr[s] + j * c + k. perm holds the original row of each stored row. The matrix
+* should be n x n and the global size n rounded up to a multiple of c, each kernel
+* works on the stored row matching its global id
+*/
+__kernel void sell_mat_vec_mult(int n, int c, __global int *slice_ptr, __global int *perm,
+	__global int *col, __global float *val, __global float *vect, __global float *res)
+{
+	int id = get_global_id(0);
+	if (id >= n){
+		return;
+	}
+	int slice = id / c;
+	int end = slice_ptr[slice + 1];
+	float sum = 0.f;
+	for (int i = slice_ptr[slice] + id % c; i < end; i += c){
+		sum += val[i] * vect[col[i]];
+	}
+	res[perm[id]] = sum;
+}
+/*
+* Atomically add v to the float at addr. OpenCL 1.1 only has integer atomics so the
+* sum is swapped in by compare and exchange on the bits, retrying if another work
+* item changed the value in between
+*/
+void atomic_add_float(volatile __global float *addr, float v){
+	union { unsigned int u; float f; } prev, next;
+	do {
+		prev.f = *addr;
+		next.f = prev.f + v;
+	} while (atomic_cmpxchg((volatile __global unsigned int*)addr, prev.u, next.u) != prev.u);
+}
+/*
+* Gather a vector into a reordered system's order, out[i] = in[perm[i]], for
+* solving a system whose rows were permuted by perm. The global size should be n
+*/
+__kernel void permute_vector(__global int *perm, __global float *in, __global float *out){
+	int id = get_global_id(0);
+	out[id] = in[perm[id]];
+}
+/*
+* Scatter a vector from a reordered system's order back to the original order,
+* out[perm[i]] = in[i]. The global size should be n
+*/
+__kernel void unpermute_vector(__global int *perm, __global float *in, __global float *out){
+	int id = get_global_id(0);
+	out[perm[id]] = in[id];
+}
+/*
+* Zero a vector, the global size should be its length
+*/
+__kernel void zero_vector(__global float *v){
+	v[get_global_id(0)] = 0.f;
+}
+/*
+* Multiply a symmetric matrix stored as the CSR form of only its upper triangle and
+* diagonal and a vector, reading half the matrix csr_mat_vec_mult would. Each row finds
+* its own product and adds the transpose contribution a_ij * vect[i] of each element
+* above the diagonal to res[j], so all the adds to res are atomic and res must be zeroed
+* with zero_vector first. The global size should be n
+*/
+__kernel void csr_sym_mat_vec_mult(__global int *row_ptr, __global int *col, __global float *val,
+	__global float *vect, __global float *res)
+{
+	int id = get_global_id(0);
+	int end = row_ptr[id + 1];
+	float x = vect[id];
+	float sum = 0.f;
+	for (int i = row_ptr[id]; i < end; ++i){
+		int c = col[i];
+		sum += val[i] * vect[c];
+		if (c != id){
+			atomic_add_float(&res[c], val[i] * x);
+		}
+	}
+	atomic_add_float(&res[id], sum);
+}
+/*
+* Multiply the 5 point Laplacian of a periodic n x n grid and a vector without storing
+* the matrix, ie. the fluid pressure matrix with 4 on the diagonal and -1 for each of the
+* cell's neighbors. The kernel should be run as a 2d work group with dimensions n x n
+* and vect and res should be n * n long with the cells stored in row-major order
 */
-__kernel void big_dot(__global float *a, __global float *b, __global float *partial){
+__kernel void laplacian_mat_vec_mult(__global float *vect, __global float *res){
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int n = get_global_size(0);
+	//Neighbors wrap around the edges of the grid
+	int left = (x + n - 1) % n;
+	int right = (x + 1) % n;
+	int down = (y + n - 1) % n;
+	int up = (y + 1) % n;
+	res[x + y * n] = 4.f * vect[x + y * n] - vect[left + y * n] - vect[right + y * n]
+		- vect[x + down * n] - vect[x + up * n];
+}
+/*
+* Sum up val across the work group using scratch, which should have room for a float
+* per work item. The work group size must be a power of 2. Summing pairwise in a tree
+* keeps the rounding error growth at O(log n) instead of O(n) for a serial sum
+* The sum is returned to every work item in the group
+*/
+acc_t local_sum(__local acc_t *scratch, acc_t val){
+	int lid = get_local_id(0);
+	scratch[lid] = val;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int offset = get_local_size(0) / 2; offset > 0; offset /= 2){
+		if (lid < offset){
+			scratch[lid] += scratch[lid + offset];
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	acc_t sum = scratch[0];
+	//Make sure everyone has the sum before scratch can be re-used
+	barrier(CLK_LOCAL_MEM_FENCE);
+	return sum;
+}
+/*
+* Add val to a compensated (Kahan) running sum where c holds the running compensation
+*/
+void kahan_add(acc_t *sum, acc_t *c, acc_t val){
+	acc_t y = val - *c;
+	acc_t t = *sum + y;
+	*c = (t - *sum) - y;
+	*sum = t;
+}
+/*
+* Find out = in - sum[0] / n, with the sum of in found beforehand, projecting out the constant
+* nullspace of an operator like the periodic Laplacian. Kernel should be run with global size
+* equal to the # of elements in the vectors, in and out can be the same buffer
+*/
+__kernel void remove_mean(__global float *sum, __global float *in, __global float *out, int n){
 	int id = get_global_id(0);
-	partial[id] = a[id] * b[id];
+	out[id] = in[id] - sum[0] / n;
 }
 /*
-* Sum up the partial from the big_dot output. Only one kernel should be run,
-* with n being the number of elements in the vector. The sum will be written
-* to partial[0]
-* I really should look up reduction kernel methods
+* Apply row i of the operator to the vector v for cg_local_solve. If grid_dim is nonzero
+* the operator is the periodic 5 point Laplacian of a grid_dim x grid_dim grid, like
+* laplacian_mat_vec_mult, otherwise it's the CSR matrix in row_ptr, col and val
 */
-__kernel void sum_partial(__global float *partial, int n){
+float local_row_product(int i, int grid_dim, __global int *row_ptr, __global int *col,
+	__global float *val, __local float *v)
+{
+	if (grid_dim != 0){
+		int x = i % grid_dim;
+		int y = i / grid_dim;
+		int left = (x + grid_dim - 1) % grid_dim;
+		int right = (x + 1) % grid_dim;
+		int down = (y + grid_dim - 1) % grid_dim;
+		int up = (y + 1) % grid_dim;
+		return 4.f * v[i] - v[left + y * grid_dim] - v[right + y * grid_dim]
+			- v[x + down * grid_dim] - v[x + up * grid_dim];
+	}
+	int end = row_ptr[i + 1];
 	float sum = 0.f;
-	for (int i = 0; i < n; ++i){
-		sum += partial[i];
+	for (int j = row_ptr[i]; j < end; ++j){
+		sum += val[j] * v[col[j]];
+	}
+	return sum;
+}
+/*
+* Run a whole unpreconditioned CG solve of the n x n system in a single work group, which
+* should have a power of 2 size. The operator is read as described for local_row_product.
+* Each work item owns the rows it strides through by the local size, so x and r are only
+* ever touched by their owner and stay in global memory, while p is read by every row
+* so it's kept in local memory along with Ap. p and ap need room for n floats and scratch
+* for an acc_t per work item. If warm_start is set the solve starts from the x passed,
+* otherwise from 0. The loop runs until r_dot_r is within tol2 or max_iter iterations,
+* logging the residual length after each iteration to history. If rel_tol2 is positive the
+* solve instead runs until r_dot_r is within rel_tol2 * b_dot_b. If project_mean is set the operator
+* has the constant vector as its nullspace, so the mean of b is left out wherever b is read and
+* the mean of x is removed from the solution. The initial and final r_dot_r and the tolerance
+* used are written to r_dot_r[0, 3) and the # of iterations to iterations[0]
+*/
+__kernel void cg_local_solve(__global int *row_ptr, __global int *col, __global float *val, int grid_dim,
+	int n, __global float *b, __global float *x, __global float *r, __local float *p, __local float *ap,
+	__local acc_t *scratch, float tol2, int max_iter, int warm_start, __global float *r_dot_r,
+	__global int *iterations, __global float *history, float rel_tol2, int project_mean)
+{
+	int lid = get_local_id(0);
+	int stride = get_local_size(0);
+	float b_mean = 0.f;
+	if (project_mean){
+		acc_t b_sum = 0, c = 0;
+		for (int i = lid; i < n; i += stride){
+			kahan_add(&b_sum, &c, b[i]);
+		}
+		b_mean = local_sum(scratch, b_sum) / n;
+	}
+	if (rel_tol2 > 0.f){
+		acc_t b_dot_b = 0, c = 0;
+		for (int i = lid; i < n; i += stride){
+			float b_i = b[i] - b_mean;
+			kahan_add(&b_dot_b, &c, (acc_t)b_i * b_i);
+		}
+		tol2 = rel_tol2 * local_sum(scratch, b_dot_b);
+	}
+	//Find r_0 = b - Ax_0, sharing x_0 through p to apply the operator to it
+	if (warm_start){
+		for (int i = lid; i < n; i += stride){
+			p[i] = x[i];
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+		for (int i = lid; i < n; i += stride){
+			r[i] = b[i] - b_mean - local_row_product(i, grid_dim, row_ptr, col, val, p);
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	acc_t rr = 0, c = 0;
+	for (int i = lid; i < n; i += stride){
+		if (!warm_start){
+			x[i] = 0.f;
+			r[i] = b[i] - b_mean;
+		}
+		p[i] = r[i];
+		kahan_add(&rr, &c, (acc_t)r[i] * r[i]);
+	}
+	//The sum's barriers also make p visible to the whole group before the first product
+	rr = local_sum(scratch, rr);
+	if (lid == 0){
+		r_dot_r[0] = rr;
+	}
+	//rr is the same for every work item so the whole group leaves the loop together
+	int k = 0;
+	for (; k < max_iter && rr > tol2; ++k){
+		acc_t p_ap = 0;
+		c = 0;
+		for (int i = lid; i < n; i += stride){
+			float ap_i = local_row_product(i, grid_dim, row_ptr, col, val, p);
+			ap[i] = ap_i;
+			kahan_add(&p_ap, &c, (acc_t)p[i] * ap_i);
+		}
+		p_ap = local_sum(scratch, p_ap);
+		float alpha = rr / p_ap;
+		acc_t rr_next = 0;
+		c = 0;
+		for (int i = lid; i < n; i += stride){
+			x[i] += alpha * p[i];
+			float r_i = r[i] - alpha * ap[i];
+			r[i] = r_i;
+			kahan_add(&rr_next, &c, (acc_t)r_i * r_i);
+		}
+		rr_next = local_sum(scratch, rr_next);
+		float beta = rr_next / rr;
+		rr = rr_next;
+		for (int i = lid; i < n; i += stride){
+			p[i] = r[i] + beta * p[i];
+		}
+		if (lid == 0){
+			history[k] = sqrt((float)rr);
+		}
+		//Everyone's part of p must be written before the next product reads it
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	//x drifts along the nullspace as float error builds up, which doesn't change the residual
+	if (project_mean){
+		acc_t x_sum = 0;
+		c = 0;
+		for (int i = lid; i < n; i += stride){
+			kahan_add(&x_sum, &c, x[i]);
+		}
+		float x_mean = local_sum(scratch, x_sum) / n;
+		for (int i = lid; i < n; i += stride){
+			x[i] -= x_mean;
+		}
+	}
+	if (lid == 0){
+		r_dot_r[1] = rr;
+		r_dot_r[2] = tol2;
+		iterations[0] = k;
 	}
-	partial[0] = sum;
 }
 /*
 * Find x_k+1 and r_k+1. Kernel should be run with global size
 * equal to the # of elements in the vectors (should be same dim)
-* r_dot_r is a float[2] contining r_dot_r_k @ 0
-* p_dot_mat_p is the result of pAp
+* r_dot_r is a float[4] containing { r_dot_z_k, r_dot_r_k, r_dot_z_k+1, r_dot_r_k+1 }
+* where z = M^-1 r is the preconditioned residual, p_dot_mat_p is the result of pAp
+* res_idx is the index of r_dot_r_k in r_dot_r, which is 0 when there's no preconditioner
+* since then z = r and r_dot_z is r_dot_r. If r_dot_r_k is within tol2 (the squared
+* convergence length) the solve has already converged and this does nothing
 */
 __kernel void update_xr(__global float *r_dot_r, __global float *p_dot_mat_p,
-	__global float *p, __global float *mat_p, __global float *x, __global float *r)
+	__global float *p, __global float *mat_p, __global float *x, __global float *r, float tol2,
+	int res_idx)
 {
+	if (r_dot_r[res_idx] <= tol2){
+		return;
+	}
 	int id = get_global_id(0);
 	float alpha = r_dot_r[0] / *p_dot_mat_p;
 	x[id] += alpha * p[id];
 	r[id] -= alpha * mat_p[id];
 }
 /*
-* Find p_k+1. Kernel should be run with global size equal to the # of
-* elements in the vectors (should be same dim)
-* r_dot_r is a float[2] containing { r_dot_r_k, r_dot_r_k+1 }
+* Find p_k+1 from z_k+1 = M^-1 r_k+1, which is just r_k+1 if there's no preconditioner
+* Kernel should be run with global size equal to the # of elements in the vectors (should be same dim)
+* r_dot_r and res_idx are the same as for update_xr
+* Like update_xr this does nothing if the solve had already converged, otherwise it
+* also counts the iteration in iterations[0] and logs the residual length to history
+*/
+__kernel void update_p(__global float *r_dot_r, __global float *z, __global float *p, float tol2,
+	int res_idx, __global int *iterations, __global float *history)
+{
+	if (r_dot_r[res_idx] <= tol2){
+		return;
+	}
+	int id = get_global_id(0);
+	if (id == 0){
+		history[iterations[0]] = sqrt(r_dot_r[2 + res_idx]);
+		++iterations[0];
+	}
+	float beta = r_dot_r[2] / r_dot_r[0];
+	p[id] = z[id] + beta * p[id];
+}
+/*
+* Find the initial residual r = b - Ax of a solve starting from a nonzero guess, where
+* mat_x is Ax. Kernel should be run with global size equal to the # of elements in the vectors
 */
-__kernel void update_p(__global float *r_dot_r, __global float *r, __global float *p){
+__kernel void compute_residual(__global float *b, __global float *mat_x, __global float *r){
 	int id = get_global_id(0);
-	float beta = r_dot_r[1] / r_dot_r[0];
+	r[id] = b[id] - mat_x[id];
+}
+/*
+* Linearly extrapolate the initial guess from the last two solutions, x holds the latest
+* and x_prev the one before it. x becomes 2x - x_prev and x_prev becomes the latest solution
+* Kernel should be run with global size equal to the # of elements in the vectors
+*/
+__kernel void extrapolate_guess(__global float *x, __global float *x_prev){
+	int id = get_global_id(0);
+	float latest = x[id];
+	x[id] = 2.f * latest - x_prev[id];
+	x_prev[id] = latest;
+}
+/*
+* Apply the Jacobi preconditioner z = D^-1 r, inv_diag should be the inverse of the
+* matrix diagonal. Kernel should be run with global size equal to the # of elements in the vectors
+*/
+__kernel void jacobi_apply(__global float *inv_diag, __global float *r, __global float *z){
+	int id = get_global_id(0);
+	z[id] = inv_diag[id] * r[id];
+}
+/*
+* Run the forward substitution (D + L)y = r for the rows of one color of a MIC(0) preconditioner
+* M = (D + L)D^-1(D + L^T), where L is the part of the CSR matrix coupling each row to rows of a
+* lower color. Since no two rows of the same color are coupled all rows of a color can be solved
+* in parallel once the lower colors are done. rows holds the row numbers sorted by color and the
+* kernel should be run with global size equal to the # of rows of the color, starting at offset in rows
+*/
+__kernel void mic0_forward(int offset, __global int *rows, __global int *row_ptr, __global int *col,
+	__global float *val, __global int *color, __global float *inv_diag, __global float *r,
+	__global float *y)
+{
+	int row = rows[offset + get_global_id(0)];
+	int row_color = color[row];
+	float sum = r[row];
+	for (int i = row_ptr[row]; i < row_ptr[row + 1]; ++i){
+		if (color[col[i]] < row_color){
+			sum -= val[i] * y[col[i]];
+		}
+	}
+	y[row] = sum * inv_diag[row];
+}
+/*
+* Run the backward substitution (D + L^T)z = Dy for the rows of one color of a MIC(0)
+* preconditioner, the colors should be run from highest to lowest. Arguments are the
+* same as mic0_forward
+*/
+__kernel void mic0_backward(int offset, __global int *rows, __global int *row_ptr, __global int *col,
+	__global float *val, __global int *color, __global float *inv_diag, __global float *y,
+	__global float *z)
+{
+	int row = rows[offset + get_global_id(0)];
+	int row_color = color[row];
+	float sum = 0.f;
+	for (int i = row_ptr[row]; i < row_ptr[row + 1]; ++i){
+		if (color[col[i]] > row_color){
+			sum += val[i] * z[col[i]];
+		}
+	}
+	z[row] = y[row] - sum * inv_diag[row];
+}
+/*
+* Run the vector updates of an iteration of pipelined CG, and the partial sums for the two
+* dot products needed for the next iteration. Should be run with a power of 2 work group size,
+* the work items stride through the vectors by the global size
+* scalars is a float[4] containing { r_dot_r_k, w_dot_r_k, alpha_k, beta_k } from pipelined_scalars
+* The vectors are updated as:
+* z = q + beta * z, s = w + beta * s, p = r + beta * p
+* x_k+1 = x_k + alpha * p, r_k+1 = r_k - alpha * s, w_k+1 = w_k - alpha * z
+* The r_dot_r_k+1 partials are written to partial[0, n_groups) and the w_dot_r_k+1
+* partials to partial[n_groups, 2 * n_groups)
+* If r_dot_r_k is within tol2 the solve has already converged and this does nothing,
+* pass a negative tol2 when finding the initial dot products
+*/
+__kernel void pipelined_update(__global float *scalars, __global float *q, __global float *w,
+	__global float *z, __global float *s, __global float *p, __global float *x, __global float *r,
+	int n, __local acc_t *scratch, __global acc_t *partial, float tol2)
+{
+	//This is the same for the whole NDRange so no one will be left waiting at a barrier
+	if (scalars[0] <= tol2){
+		return;
+	}
+	float alpha = scalars[2];
+	float beta = scalars[3];
+	int stride = get_global_size(0);
+	acc_t r_dot_r = 0, r_dot_r_c = 0;
+	acc_t w_dot_r = 0, w_dot_r_c = 0;
+	for (int i = get_global_id(0); i < n; i += stride){
+		float z_i = q[i] + beta * z[i];
+		float s_i = w[i] + beta * s[i];
+		float p_i = r[i] + beta * p[i];
+		float r_i = r[i] - alpha * s_i;
+		float w_i = w[i] - alpha * z_i;
+		x[i] += alpha * p_i;
+		z[i] = z_i;
+		s[i] = s_i;
+		p[i] = p_i;
+		r[i] = r_i;
+		w[i] = w_i;
+		kahan_add(&r_dot_r, &r_dot_r_c, (acc_t)r_i * r_i);
+		kahan_add(&w_dot_r, &w_dot_r_c, (acc_t)w_i * r_i);
+	}
+	r_dot_r = local_sum(scratch, r_dot_r);
+	w_dot_r = local_sum(scratch, w_dot_r);
+	if (get_local_id(0) == 0){
+		partial[get_group_id(0)] = r_dot_r;
+		partial[get_num_groups(0) + get_group_id(0)] = w_dot_r;
+	}
+}
+/*
+* Sum up the partials from pipelined_update and find the step sizes for the next iteration.
+* Only one work group should be run, scratch should have room for an acc_t per work item
+* scalars is a float[4] containing { r_dot_r_k, w_dot_r_k, alpha_k, beta_k } which will be
+* updated to the values for k+1. first should be 1 when finding the initial values
+* Like pipelined_update this does nothing if the solve had already converged, otherwise
+* it also counts the iteration in iterations[0] and logs the residual length to history
+*/
+__kernel void pipelined_scalars(__global acc_t *partial, int n_groups, __local acc_t *scratch,
+	__global float *scalars, int first, float tol2, __global int *iterations, __global float *history)
+{
+	if (!first && scalars[0] <= tol2){
+		return;
+	}
+	acc_t r_dot_r = 0, w_dot_r = 0;
+	for (int i = get_local_id(0); i < n_groups; i += get_local_size(0)){
+		r_dot_r += partial[i];
+		w_dot_r += partial[n_groups + i];
+	}
+	r_dot_r = local_sum(scratch, r_dot_r);
+	w_dot_r = local_sum(scratch, w_dot_r);
+	if (get_local_id(0) == 0){
+		acc_t alpha, beta;
+		if (first){
+			beta = 0;
+			alpha = r_dot_r / w_dot_r;
+		}
+		else {
+			beta = r_dot_r / scalars[0];
+			alpha = r_dot_r / (w_dot_r - beta * r_dot_r / scalars[2]);
+			history[iterations[0]] = sqrt(r_dot_r);
+			++iterations[0];
+		}
+		scalars[0] = r_dot_r;
+		scalars[1] = w_dot_r;
+		scalars[2] = alpha;
+		scalars[3] = beta;
+	}
+}
+/*
+* Kernels for batched CG solves of k right hand sides at once with the same matrix
+* Vectors of the batch are stored interleaved as one block, with element i of right hand
+* side j at i * k + j, so each matrix entry is read once for all k vectors.
+* Each right hand side is solved independently, active[j] is 0 once j has converged
+* and the kernels skip its work. The iteration is the same as the classic one above:
+* setup
+*	x = 0, r = p = b and all active using block_init
+*	find r_dot_r_0 using block_dot_partial and block_sum_partial
+*	mark converged right hand sides with block_update_active
+* while (not_done)
+*	find Ap using csr_block_mat_vec_mult or laplacian_block_mat_vec_mult
+*	find pAp using block_dot_partial and block_sum_partial
+*	find x_k+1 & r_k+1 using block_update_xr
+*	find r_dot_r_k+1 using block_dot_partial and block_sum_partial
+*	find p_k+1 using block_update_p
+*	mark converged right hand sides with block_update_active
+*/
+/*
+* Multiply a CSR matrix and a block of k interleaved vectors, the global size should be
+* (k, n). Work items on the same row read the same matrix entries so they're only
+* read from memory once. Right hand sides that aren't active are skipped
+*/
+__kernel void csr_block_mat_vec_mult(__global int *row_ptr, __global int *col, __global float *val,
+	__global int *active, __global float *vect, __global float *res)
+{
+	int j = get_global_id(0);
+	int row = get_global_id(1);
+	int k = get_global_size(0);
+	if (!active[j]){
+		return;
+	}
+	int end = row_ptr[row + 1];
+	float sum = 0.f;
+	for (int i = row_ptr[row]; i < end; ++i){
+		sum += val[i] * vect[col[i] * k + j];
+	}
+	res[row * k + j] = sum;
+}
+/*
+* Zero the active vectors of a block of k interleaved vectors, the global size should be (k, n)
+*/
+__kernel void block_zero_active(__global int *active, __global float *res){
+	int j = get_global_id(0);
+	if (active[j]){
+		res[get_global_id(1) * get_global_size(0) + j] = 0.f;
+	}
+}
+/*
+* Multiply a symmetric matrix stored as the CSR form of its upper triangle and diagonal,
+* like csr_sym_mat_vec_mult, and a block of k interleaved vectors. The global size should
+* be (k, n) and the active vectors of res must be zeroed with block_zero_active first.
+* Right hand sides that aren't active are skipped
+*/
+__kernel void csr_sym_block_mat_vec_mult(__global int *row_ptr, __global int *col, __global float *val,
+	__global int *active, __global float *vect, __global float *res)
+{
+	int j = get_global_id(0);
+	int row = get_global_id(1);
+	int k = get_global_size(0);
+	if (!active[j]){
+		return;
+	}
+	int end = row_ptr[row + 1];
+	float x = vect[row * k + j];
+	float sum = 0.f;
+	for (int i = row_ptr[row]; i < end; ++i){
+		int c = col[i];
+		sum += val[i] * vect[c * k + j];
+		if (c != row){
+			atomic_add_float(&res[c * k + j], val[i] * x);
+		}
+	}
+	atomic_add_float(&res[row * k + j], sum);
+}
+/*
+* Multiply the periodic n x n Laplacian and a block of k interleaved vectors, the
+* global size should be (k, n, n). Right hand sides that aren't active are skipped
+*/
+__kernel void laplacian_block_mat_vec_mult(__global int *active, __global float *vect,
+	__global float *res)
+{
+	int j = get_global_id(0);
+	int x = get_global_id(1);
+	int y = get_global_id(2);
+	int k = get_global_size(0);
+	int n = get_global_size(1);
+	if (!active[j]){
+		return;
+	}
+	int left = (x + n - 1) % n;
+	int right = (x + 1) % n;
+	int down = (y + n - 1) % n;
+	int up = (y + 1) % n;
+	res[(x + y * n) * k + j] = 4.f * vect[(x + y * n) * k + j] - vect[(left + y * n) * k + j]
+		- vect[(right + y * n) * k + j] - vect[(x + down * n) * k + j] - vect[(x + up * n) * k + j];
+}
+/*
+* Start the batched solve from x = 0, setting r = p = b, marking all right hand sides
+* active and clearing their iteration counts. The global size should be (k, n)
+*/
+__kernel void block_init(__global float *b, __global float *x, __global float *r, __global float *p,
+	__global int *active, __global int *iterations)
+{
+	int j = get_global_id(0);
+	int id = get_global_id(1) * get_global_size(0) + j;
+	x[id] = 0.f;
+	r[id] = b[id];
+	p[id] = b[id];
+	if (get_global_id(1) == 0){
+		active[j] = 1;
+		iterations[j] = 0;
+	}
+}
+/*
+* Find the partial dot products of each of the k interleaved vectors in two blocks, the
+* global size should be (n_groups * local size, k) with a local size of (local size, 1) so each
+* work group works on a single right hand side. The partials of right hand side j are written
+* to partial[j * n_groups, (j + 1) * n_groups). scratch should have room for an acc_t per work item
+*/
+__kernel void block_dot_partial(__global float *a, __global float *b, int n, __global int *active,
+	__local acc_t *scratch, __global acc_t *partial)
+{
+	int j = get_global_id(1);
+	int k = get_global_size(1);
+	//The whole work group is on the same right hand side so no one is left at the barrier
+	if (!active[j]){
+		return;
+	}
+	int stride = get_global_size(0);
+	acc_t sum = 0;
+	acc_t c = 0;
+	for (int i = get_global_id(0); i < n; i += stride){
+		kahan_add(&sum, &c, (acc_t)a[i * k + j] * b[i * k + j]);
+	}
+	sum = local_sum(scratch, sum);
+	if (get_local_id(0) == 0){
+		partial[j * get_num_groups(0) + get_group_id(0)] = sum;
+	}
+}
+/*
+* Sum up the partials from block_dot_partial and write the dot product of right hand side
+* j to out[out_offset + j]. The global size should be (local size, k) with a local size of
+* (local size, 1), scratch should have room for an acc_t per work item
+*/
+__kernel void block_sum_partial(__global acc_t *partial, int n_groups, __global int *active,
+	__local acc_t *scratch, __global float *out, int out_offset)
+{
+	int j = get_global_id(1);
+	if (!active[j]){
+		return;
+	}
+	acc_t sum = 0;
+	acc_t c = 0;
+	for (int i = get_local_id(0); i < n_groups; i += get_local_size(0)){
+		kahan_add(&sum, &c, partial[j * n_groups + i]);
+	}
+	sum = local_sum(scratch, sum);
+	if (get_local_id(0) == 0){
+		out[out_offset + j] = sum;
+	}
+}
+/*
+* Find x_k+1 and r_k+1 for each active right hand side, the global size should be (k, n)
+* r_dot_r is a float[2k] with r_dot_r_k for each right hand side in [0, k) and
+* r_dot_r_k+1 in [k, 2k), p_dot_mat_p is a float[k]
+*/
+__kernel void block_update_xr(__global float *r_dot_r, __global float *p_dot_mat_p, __global int *active,
+	__global float *p, __global float *mat_p, __global float *x, __global float *r)
+{
+	int j = get_global_id(0);
+	if (!active[j]){
+		return;
+	}
+	int id = get_global_id(1) * get_global_size(0) + j;
+	float alpha = r_dot_r[j] / p_dot_mat_p[j];
+	x[id] += alpha * p[id];
+	r[id] -= alpha * mat_p[id];
+}
+/*
+* Find p_k+1 for each active right hand side and count their iterations, the global
+* size should be (k, n). r_dot_r is the same as for block_update_xr
+*/
+__kernel void block_update_p(__global float *r_dot_r, __global int *active, __global float *r,
+	__global float *p, __global int *iterations)
+{
+	int j = get_global_id(0);
+	int k = get_global_size(0);
+	if (!active[j]){
+		return;
+	}
+	int id = get_global_id(1) * k + j;
+	if (get_global_id(1) == 0){
+		++iterations[j];
+	}
+	float beta = r_dot_r[k + j] / r_dot_r[j];
 	p[id] = r[id] + beta * p[id];
 }
-
+/*
+* Move r_dot_r_k+1 to r_dot_r_k for the active right hand sides and mark the ones within
+* tol2 (the squared convergence length) as done. Should be run with a global size of k
+*/
+__kernel void block_update_active(__global float *r_dot_r, __global int *active, float tol2){
+	int j = get_global_id(0);
+	int k = get_global_size(0);
+	if (!active[j]){
+		return;
+	}
+	r_dot_r[j] = r_dot_r[k + j];
+	active[j] = r_dot_r[j] > tol2;
+}
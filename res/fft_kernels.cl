@@ -0,0 +1,75 @@
+/*
+* Kernels for the spectral solver of the pressure system, the 5 point Laplacian
+* on a periodic n x n grid (4 on the diagonal and -1 for each neighbor), n a power of 2.
+* The Fourier modes are the eigenvectors of the periodic Laplacian, so transforming b,
+* dividing each mode by its eigenvalue and transforming back solves the system exactly
+* solve
+*	copy the real b into the complex work buffer using fft_load_real
+*	forward FFT the rows then the columns using log2(n) fft_radix2 passes each
+*	divide each mode by its eigenvalue using fft_poisson_divide
+*	inverse FFT the rows then the columns using fft_radix2
+*	copy the real part out to x using fft_store_real
+*
+* Complex values are stored as float2 (real, imaginary) in row-major order
+*/
+/*
+* Copy the real vector in into the complex vector out with 0 imaginary part
+* The kernel should be run with a 1D global size of n * n
+*/
+__kernel void fft_load_real(__global float *in, __global float2 *out){
+	int id = get_global_id(0);
+	out[id] = (float2)(in[id], 0.f);
+}
+/*
+* Run one radix-2 pass of a Stockham FFT along the rows (axis 0) or columns (axis 1)
+* of the n x n grid, reading src and writing dst. Passes are run with p = 1, 2, 4, ..., n / 2
+* and leave the transform in natural order, so no bit reversal is needed. sign is -1 for
+* the forward transform and 1 for the inverse, which is left unscaled.
+* The kernel should be run with a 2D global size of n / 2 x n, where id 1 picks the line
+*/
+__kernel void fft_radix2(__global float2 *src, __global float2 *dst, int p, float sign, int axis){
+	int i = get_global_id(0);
+	int line = get_global_id(1);
+	int half_n = get_global_size(0);
+	int n = 2 * half_n;
+	//Elements of the line are contiguous along rows and n apart along columns
+	int stride = axis == 0 ? 1 : n;
+	int base = axis == 0 ? line * n : line;
+
+	int k = i & (p - 1);
+	float2 u0 = src[base + i * stride];
+	float2 u1 = src[base + (i + half_n) * stride];
+	float c;
+	float s = sincos(sign * M_PI_F * k / p, &c);
+	//u1 * twiddle
+	u1 = (float2)(u1.x * c - u1.y * s, u1.x * s + u1.y * c);
+	int j = (i << 1) - k;
+	dst[base + j * stride] = u0 + u1;
+	dst[base + (j + p) * stride] = u0 - u1;
+}
+/*
+* Divide each Fourier mode by its eigenvalue of the Laplacian, 4 - 2cos(2pi kx / n)
+* - 2cos(2pi ky / n), and multiply by scale, which should be 1 / (n * n) to normalize
+* the inverse transform. The zero mode has eigenvalue 0, the Laplacian is singular and
+* only determines the solution up to a constant, so it's set to 0 giving a solution
+* with zero mean. The kernel should be run with a 2D global size of n x n
+*/
+__kernel void fft_poisson_divide(__global float2 *data, float scale){
+	int kx = get_global_id(0);
+	int ky = get_global_id(1);
+	int n = get_global_size(0);
+	if (kx == 0 && ky == 0){
+		data[0] = (float2)(0.f, 0.f);
+		return;
+	}
+	float eigen = 4.f - 2.f * cospi(2.f * kx / n) - 2.f * cospi(2.f * ky / n);
+	data[kx + ky * n] *= scale / eigen;
+}
+/*
+* Copy the real part of the complex vector in to the real vector out
+* The kernel should be run with a 1D global size of n * n
+*/
+__kernel void fft_store_real(__global float2 *in, __global float *out){
+	int id = get_global_id(0);
+	out[id] = in[id].x;
+}
@@ -0,0 +1,127 @@
+/*
+* Kernels for the geometric multigrid solver of the pressure system, the 5 point
+* Laplacian on a periodic n x n grid (4 on the diagonal and -1 for each neighbor)
+* All kernels should be run with a 2D global size equal to the grid dimensions of
+* the level they write to, which is where they get n from
+*
+* An overview of a V-cycle on level l, where the coarse level l + 1 has half the
+* cells along each axis and the last level is solved by just smoothing it a lot
+* vcycle(l)
+*	x_l = 0 using zero_level (except on the finest level where x is the initial guess)
+*	smooth x_l using smooth_red_black on the red then black cells
+*	find r_l = b_l - Ax_l using poisson_residual
+*	find b_l+1 using restrict_residual
+*	vcycle(l + 1)
+*	x_l += Px_l+1 using prolong_add
+*	smooth x_l using smooth_red_black on the black then red cells
+*
+* The prolongation P is bilinear interpolation and restriction is its transpose scaled
+* so the weights sum to 1, with the pre and post smoothing mirroring each other the
+* V-cycle is symmetric so it can be used as a CG preconditioner
+*
+* smooth_red_black and chebyshev_step are also used on their own as the relaxation solvers,
+* running a fixed # of sweeps on the pressure with no dot products needed
+*/
+/*
+* Run a weighted Gauss-Seidel update on the cells of one color, color 0 are the red cells
+* with (x + y) even and color 1 the black cells with (x + y) odd. Since red cells only
+* neighbor black cells and vice versa all cells of a color can be updated in place
+*/
+__kernel void smooth_red_black(__global float *b, __global float *x, int color, float omega){
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	int n = get_global_size(0);
+	if (((i + j) & 1) != color){
+		return;
+	}
+	int left = (i + n - 1) % n;
+	int right = (i + 1) % n;
+	int down = (j + n - 1) % n;
+	int up = (j + 1) % n;
+	float gs = 0.25f * (b[i + j * n] + x[left + j * n] + x[right + j * n]
+		+ x[i + down * n] + x[i + up * n]);
+	x[i + j * n] += omega * (gs - x[i + j * n]);
+}
+/*
+* Take a step of the Chebyshev semi-iteration, x_next = x_prev + omega * (x - x_prev + gamma * (b - Ax)),
+* where the omega and gamma for each step come from the bounds on A's eigenvalues. x_prev is
+* ignored on the first step, which has omega = 1, so x can be passed as x_prev too
+*/
+__kernel void chebyshev_step(__global float *b, __global float *x, __global float *x_prev,
+	__global float *x_next, float omega, float gamma)
+{
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	int n = get_global_size(0);
+	int left = (i + n - 1) % n;
+	int right = (i + 1) % n;
+	int down = (j + n - 1) % n;
+	int up = (j + 1) % n;
+	float r = b[i + j * n] - 4.f * x[i + j * n] + x[left + j * n] + x[right + j * n]
+		+ x[i + down * n] + x[i + up * n];
+	x_next[i + j * n] = x_prev[i + j * n] + omega * (x[i + j * n] - x_prev[i + j * n] + gamma * r);
+}
+/*
+* Compute the residual r = b - Ax
+*/
+__kernel void poisson_residual(__global float *b, __global float *x, __global float *r){
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	int n = get_global_size(0);
+	int left = (i + n - 1) % n;
+	int right = (i + 1) % n;
+	int down = (j + n - 1) % n;
+	int up = (j + 1) % n;
+	r[i + j * n] = b[i + j * n] - 4.f * x[i + j * n] + x[left + j * n] + x[right + j * n]
+		+ x[i + down * n] + x[i + up * n];
+}
+/*
+* Restrict the fine residual onto the coarse grid to get the coarse right hand side, the
+* global size should be the coarse grid's. Each coarse cell covers 2x2 fine cells and takes
+* a weighted sum of the 4x4 fine cells around it, with weights 1/8, 3/8, 3/8, 1/8 along each
+* axis. The result is scaled by 4 since the coarse grid's cells are twice as wide, so
+* the same Laplacian can be used on each level
+*/
+__kernel void restrict_residual(__global float *fine_r, __global float *coarse_b){
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	int n = get_global_size(0);
+	int fine_n = 2 * n;
+	const float weights[4] = { 0.125f, 0.375f, 0.375f, 0.125f };
+	float sum = 0.f;
+	for (int v = 0; v < 4; ++v){
+		int fy = (2 * j + v - 1 + fine_n) % fine_n;
+		float row = 0.f;
+		for (int u = 0; u < 4; ++u){
+			int fx = (2 * i + u - 1 + fine_n) % fine_n;
+			row += weights[u] * fine_r[fx + fy * fine_n];
+		}
+		sum += weights[v] * row;
+	}
+	coarse_b[i + j * n] = 4.f * sum;
+}
+/*
+* Bilinearly interpolate the coarse correction and add it to the fine grid, the global
+* size should be the fine grid's. Each fine cell takes 3/4 of the coarse cell containing
+* it and 1/4 of the next closest coarse cell along each axis
+*/
+__kernel void prolong_add(__global float *coarse_x, __global float *fine_x){
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	int n = get_global_size(0);
+	int coarse_n = n / 2;
+	int ci = i / 2;
+	int cj = j / 2;
+	//Odd cells are closer to the next coarse cell and even ones to the previous
+	int ni = (i & 1) ? (ci + 1) % coarse_n : (ci + coarse_n - 1) % coarse_n;
+	int nj = (j & 1) ? (cj + 1) % coarse_n : (cj + coarse_n - 1) % coarse_n;
+	fine_x[i + j * n] += 0.5625f * coarse_x[ci + cj * coarse_n]
+		+ 0.1875f * (coarse_x[ni + cj * coarse_n] + coarse_x[ci + nj * coarse_n])
+		+ 0.0625f * coarse_x[ni + nj * coarse_n];
+}
+/*
+* Zero out a level's solution for the zero initial guess of the coarse grid correction
+*/
+__kernel void zero_level(__global float *x){
+	x[get_global_id(0) + get_global_id(1) * get_global_size(0)] = 0.f;
+}
@@ -0,0 +1,136 @@
+/*
+* Generic reductions and exclusive scans for tcl::Context. The program is built once for each
+* element type and operation it's used with, picked by these defines:
+* T: the element type
+* ACC: the type reductions accumulate in, double for float sums if the device has cl_khr_fp64
+* OP_SUM, OP_MAX, OP_MIN or OP_DOT: the operation, DOT sums the products of two vectors
+* IDENTITY: the identity of the operation, eg. 0 for sums or -INFINITY for the max of floats
+* COMPENSATE: accumulate sums with compensated (Kahan) sums, for float sums done in float
+* USE_DOUBLE: enable cl_khr_fp64, needed if T or ACC is double
+*
+* Reductions are done in two stages like CG's dot products used to be, each work group reduces
+* its part of the vector in local memory with reduce_partial then a single work group reduces
+* the partials with reduce_final. Scans are done by scan_blocks scanning each work group's block
+* and writing out the block totals, which are scanned in turn then combined back into the blocks
+* with add_block_offsets. Work group sizes must be powers of 2
+*/
+#ifdef USE_DOUBLE
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+#if defined(OP_MAX)
+#define COMBINE(x, y) max(x, y)
+#elif defined(OP_MIN)
+#define COMBINE(x, y) min(x, y)
+#else
+#define COMBINE(x, y) ((x) + (y))
+#endif
+
+#ifdef OP_DOT
+#define LOAD(a, b, i) ((ACC)(a)[i] * (b)[i])
+#else
+#define LOAD(a, b, i) ((ACC)(a)[i])
+#endif
+
+/*
+* Combine val into the running result acc, c holds the running compensation if it's a
+* compensated sum and is unused otherwise
+*/
+void accumulate(ACC *acc, ACC *c, ACC val){
+#ifdef COMPENSATE
+	ACC y = val - *c;
+	ACC t = *acc + y;
+	*c = (t - *acc) - y;
+	*acc = t;
+#else
+	*acc = COMBINE(*acc, val);
+#endif
+}
+/*
+* Reduce the values of a work group in local memory, every work item gets the result.
+* scratch should have room for an ACC per work item
+*/
+ACC group_reduce(__local ACC *scratch, ACC val){
+	int lid = get_local_id(0);
+	scratch[lid] = val;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int offset = get_local_size(0) / 2; offset > 0; offset /= 2){
+		if (lid < offset){
+			scratch[lid] = COMBINE(scratch[lid], scratch[lid + offset]);
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	ACC res = scratch[0];
+	//Make sure everyone has the result before scratch can be re-used
+	barrier(CLK_LOCAL_MEM_FENCE);
+	return res;
+}
+/*
+* Reduce the n long vector a, or the products of a and b for DOT, and write each work group's
+* result to partial[group id]. Work items stride through the vector by the global size so fewer
+* work items than elements can be run, scratch should have room for an ACC per work item
+*/
+__kernel void reduce_partial(__global T *a, __global T *b, int n, __local ACC *scratch, __global ACC *partial){
+	int stride = get_global_size(0);
+	ACC acc = IDENTITY;
+	ACC c = 0;
+	for (int i = get_global_id(0); i < n; i += stride){
+		accumulate(&acc, &c, LOAD(a, b, i));
+	}
+	acc = group_reduce(scratch, acc);
+	if (get_local_id(0) == 0){
+		partial[get_group_id(0)] = acc;
+	}
+}
+/*
+* Reduce the n partials from reduce_partial and write the result to out[out_idx]. Only one
+* work group should be run, scratch should have room for an ACC per work item
+*/
+__kernel void reduce_final(__global ACC *partial, int n, __local ACC *scratch, __global T *out, int out_idx){
+	ACC acc = IDENTITY;
+	ACC c = 0;
+	for (int i = get_local_id(0); i < n; i += get_local_size(0)){
+		accumulate(&acc, &c, partial[i]);
+	}
+	acc = group_reduce(scratch, acc);
+	if (get_local_id(0) == 0){
+		out[out_idx] = (T)acc;
+	}
+}
+/*
+* Exclusive scan each work group's block of the n long vector in, writing the scan to out
+* and the total of each block to block_sums[group id]. Should be run with a work item per
+* element, rounded up to a multiple of the local size, scratch should have room for a T per
+* work item. in and out can be the same buffer
+*/
+__kernel void scan_blocks(__global T *in, __global T *out, int n, __local T *scratch, __global T *block_sums){
+	int lid = get_local_id(0);
+	int id = get_global_id(0);
+	int size = get_local_size(0);
+	scratch[lid] = id < n ? in[id] : IDENTITY;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	//Hillis-Steele inclusive scan, each step combines with the element offset before it
+	for (int offset = 1; offset < size; offset *= 2){
+		T prev = lid >= offset ? scratch[lid - offset] : IDENTITY;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		scratch[lid] = COMBINE(scratch[lid], prev);
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	//Shift the inclusive scan over by one to make it exclusive
+	if (id < n){
+		out[id] = lid == 0 ? IDENTITY : scratch[lid - 1];
+	}
+	if (lid == size - 1){
+		block_sums[get_group_id(0)] = scratch[lid];
+	}
+}
+/*
+* Combine the scanned block totals into each element of the n long block scans, block_sums[g]
+* should hold the exclusive scan of the block totals. Run with the same sizes as scan_blocks
+*/
+__kernel void add_block_offsets(__global T *out, int n, __global T *block_sums){
+	int id = get_global_id(0);
+	if (id < n){
+		out[id] = COMBINE(out[id], block_sums[get_group_id(0)]);
+	}
+}
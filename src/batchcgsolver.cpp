@@ -0,0 +1,174 @@
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "tinycl.h"
+#include "sparsematrix.h"
+#include "cgsolver.h"
+#include "batchcgsolver.h"
+
+BatchCGSolver::BatchCGSolver(std::shared_ptr<LinearOperator> op, int k, tcl::Context &context,
+	int iter, float convergeLen)
+		: context(context), op(op), k(k), maxIterations(iter), dimensions(op->dim()),
+		convergeLen(convergeLen), checkInterval(8), verbose(false), iterations(k, 0)
+{
+	init();
+}
+BatchCGSolver::BatchCGSolver(const SparseMatrix<float> &mat, int k, tcl::Context &context,
+	int iter, float convergeLen)
+		//The block mat * vec only has a CSR kernel so don't bother with the other layouts
+		: BatchCGSolver(std::make_shared<SparseOperator>(mat, SparseOperator::FORMAT::CSR), k, context,
+			iter, convergeLen)
+{}
+void BatchCGSolver::solve(){
+	cl::NDRange block(k, dimensions);
+	context.runNDKernel(block_init, block, cl::NullRange, cl::NullRange);
+	//Find r_dot_r_0 in the k+1 slots, then block_update_active moves it over
+	dot(r, r, rDotr, k);
+	context.runNDKernel(block_update_active, cl::NDRange(k), cl::NullRange, cl::NullRange);
+
+	std::vector<float> rLenSq(k);
+	float tol2 = convergeLen * convergeLen;
+	int enqueued = 0;
+	bool converged = false;
+	while (enqueued < maxIterations && !converged){
+		int n = std::min(checkInterval, maxIterations - enqueued);
+		for (int i = 0; i < n; ++i){
+			//find matP = Ap
+			op->applyBlock(context, p, matP, k, active);
+			//find pMatp = p dot Ap
+			dot(p, matP, pMatp, 0);
+			//find x_k+1 and r_k+1
+			context.runNDKernel(block_update_xr, block, cl::NullRange, cl::NullRange);
+			//find r_dot_r_k+1
+			dot(r, r, rDotr, k);
+			//find p_k+1 and check which systems are done
+			context.runNDKernel(block_update_p, block, cl::NullRange, cl::NullRange);
+			context.runNDKernel(block_update_active, cl::NDRange(k), cl::NullRange, cl::NullRange);
+		}
+		enqueued += n;
+		context.readData(rDotr, k * sizeof(float), &rLenSq[0], 0, true);
+		converged = std::all_of(rLenSq.begin(), rLenSq.end(), [tol2](float f){ return f <= tol2; });
+	}
+	context.readData(iterCount, k * sizeof(int), &iterations[0], 0, true);
+	if (verbose){
+		std::cout << "batched solution of " << k << " systems took: "
+			<< *std::max_element(iterations.begin(), iterations.end()) << " iterations, final residual length: "
+			<< std::sqrt(*std::max_element(rLenSq.begin(), rLenSq.end())) << std::endl;
+	}
+}
+void BatchCGSolver::setConvergenceCheck(int interval){
+	checkInterval = std::max(interval, 1);
+}
+void BatchCGSolver::updateB(const std::vector<float> &bBlock){
+	b = context.buffer(tcl::MEM::READ_ONLY, dimensions * k * sizeof(float), &bBlock[0]);
+	block_init.setArg(0, b);
+}
+void BatchCGSolver::updateB(cl::Buffer &bBuf){
+	b = bBuf;
+	block_init.setArg(0, b);
+}
+std::vector<float> BatchCGSolver::getResult(){
+	std::vector<float> res(dimensions * k);
+	context.readData(x, res.size() * sizeof(float), &res[0], 0, true);
+	return res;
+}
+cl::Buffer BatchCGSolver::getResultBuffer(){
+	return x;
+}
+const std::vector<int>& BatchCGSolver::getIterations() const {
+	return iterations;
+}
+int BatchCGSolver::getRHS() const {
+	return k;
+}
+void BatchCGSolver::setVerbose(bool v){
+	verbose = v;
+}
+std::vector<float> BatchCGSolver::interleave(const std::vector<std::vector<float>> &vecs){
+	int n = vecs.empty() ? 0 : vecs[0].size();
+	int nVecs = vecs.size();
+	std::vector<float> block(n * nVecs);
+	for (int j = 0; j < nVecs; ++j){
+		for (int i = 0; i < n; ++i){
+			block[i * nVecs + j] = vecs[j][i];
+		}
+	}
+	return block;
+}
+std::vector<float> BatchCGSolver::deinterleave(const std::vector<float> &block, int k, int j){
+	std::vector<float> vec(block.size() / k);
+	for (size_t i = 0; i < vec.size(); ++i){
+		vec[i] = block[i * k + j];
+	}
+	return vec;
+}
+void BatchCGSolver::init(){
+	const cl::Device &device = context.mDevices.at(0);
+	bool useDouble = CGSolver::supportsDouble(device);
+	accSize = useDouble ? sizeof(double) : sizeof(float);
+	cgProgram = context.loadProgram("../res/cg_kernels.cl", useDouble ? "-DCG_USE_DOUBLE" : "");
+	op->init(context, cgProgram);
+	block_init = cl::Kernel(cgProgram, "block_init");
+	block_dot_partial = cl::Kernel(cgProgram, "block_dot_partial");
+	block_sum_partial = cl::Kernel(cgProgram, "block_sum_partial");
+	block_update_xr = cl::Kernel(cgProgram, "block_update_xr");
+	block_update_p = cl::Kernel(cgProgram, "block_update_p");
+	block_update_active = cl::Kernel(cgProgram, "block_update_active");
+
+	groupSize = context.powerOfTwoGroupSize({ block_dot_partial, block_sum_partial });
+	nGroups = std::min(groupSize, (dimensions + groupSize - 1) / groupSize);
+
+	size_t blockSize = dimensions * k * sizeof(float);
+	x = context.buffer(CL_MEM_READ_WRITE, blockSize, nullptr);
+	r = context.buffer(CL_MEM_READ_WRITE, blockSize, nullptr);
+	p = context.buffer(CL_MEM_READ_WRITE, blockSize, nullptr);
+	matP = context.buffer(CL_MEM_READ_WRITE, blockSize, nullptr);
+	pMatp = context.buffer(CL_MEM_READ_WRITE, k * sizeof(float), nullptr);
+	rDotr = context.buffer(CL_MEM_READ_WRITE, 2 * k * sizeof(float), nullptr);
+	dotPartial = context.buffer(CL_MEM_READ_WRITE, k * nGroups * accSize, nullptr);
+	active = context.buffer(CL_MEM_READ_WRITE, k * sizeof(int), nullptr);
+	iterCount = context.buffer(CL_MEM_READ_WRITE, k * sizeof(int), nullptr);
+
+	block_init.setArg(1, x);
+	block_init.setArg(2, r);
+	block_init.setArg(3, p);
+	block_init.setArg(4, active);
+	block_init.setArg(5, iterCount);
+
+	block_dot_partial.setArg(2, dimensions);
+	block_dot_partial.setArg(3, active);
+	block_dot_partial.setArg(4, cl::__local(groupSize * accSize));
+	block_dot_partial.setArg(5, dotPartial);
+	block_sum_partial.setArg(0, dotPartial);
+	block_sum_partial.setArg(1, nGroups);
+	block_sum_partial.setArg(2, active);
+	block_sum_partial.setArg(3, cl::__local(groupSize * accSize));
+
+	block_update_xr.setArg(0, rDotr);
+	block_update_xr.setArg(1, pMatp);
+	block_update_xr.setArg(2, active);
+	block_update_xr.setArg(3, p);
+	block_update_xr.setArg(4, matP);
+	block_update_xr.setArg(5, x);
+	block_update_xr.setArg(6, r);
+
+	block_update_p.setArg(0, rDotr);
+	block_update_p.setArg(1, active);
+	block_update_p.setArg(2, r);
+	block_update_p.setArg(3, p);
+	block_update_p.setArg(4, iterCount);
+
+	block_update_active.setArg(0, rDotr);
+	block_update_active.setArg(1, active);
+	block_update_active.setArg(2, convergeLen * convergeLen);
+}
+void BatchCGSolver::dot(const cl::Buffer &a, const cl::Buffer &b, cl::Buffer &out, int outOffset){
+	block_dot_partial.setArg(0, a);
+	block_dot_partial.setArg(1, b);
+	context.runNDKernel(block_dot_partial, cl::NDRange(nGroups * groupSize, k), cl::NDRange(groupSize, 1),
+		cl::NullRange);
+	block_sum_partial.setArg(4, out);
+	block_sum_partial.setArg(5, outOffset);
+	context.runNDKernel(block_sum_partial, cl::NDRange(groupSize, k), cl::NDRange(groupSize, 1), cl::NullRange);
+}
@@ -1,7 +1,13 @@
 #include <iostream>
 #include <array>
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <chrono>
 #include "tinycl.h"
 #include "sparsematrix.h"
+#include "reordering.h"
 #include "cgsolver.h"
 
 //Helper for debugging, print an array's values
@@ -13,69 +19,380 @@ void printArray(float *arr, int n){
 }
 
 CGSolver::CGSolver(const SparseMatrix<float> &mat, const std::vector<float> &b, 
+	tcl::Context &context, int iter, float convergeLen, REORDER reorder)
+		: CGSolver(mat, findOrdering(mat, reorder), b, context, iter, convergeLen)
+{}
+CGSolver::CGSolver(const SparseMatrix<float> &mat, std::vector<int> perm, const std::vector<float> &b,
 	tcl::Context &context, int iter, float convergeLen)
-		: context(context), maxIterations(iter), dimensions(mat.dim), convergeLen(convergeLen),
-		matNVals(mat.elements.size())
+		: CGSolver(perm.empty() ? std::make_shared<SparseOperator>(mat)
+			: std::make_shared<SparseOperator>(mat.permuted(perm)), std::vector<float>(), context, iter, convergeLen)
+{
+	permutation = std::move(perm);
+	if (!permutation.empty()){
+		permBuf = context.buffer(CL_MEM_READ_ONLY, dimensions * sizeof(int), &permutation[0]);
+		permute_vector.setArg(0, permBuf);
+		unpermute_vector.setArg(0, permBuf);
+	}
+	if (!b.empty()){
+		updateB(b);
+	}
+}
+CGSolver::CGSolver(std::shared_ptr<LinearOperator> op, const std::vector<float> &b,
+	tcl::Context &context, int iter, float convergeLen)
+		: context(context), op(op), maxIterations(iter), dimensions(op->dim()), convergeLen(convergeLen),
+		mode(MODE::CLASSIC), guess(GUESS::ZERO), haveSolution(false), havePrevious(false),
+		maxRefinements(0), innerTolerance(1e-3f), checkInterval(1), speculative(false), wastedIterations(0),
+		verbose(false), keepHistory(false), timePhases(false), budget(0), relTolerance(1e-4f), iterationCost(0),
+		allowLocalSolve(true), localSolveFits(false), constantNullspace(op->constantNullspace())
 {
 	loadKernels();
-	createBuffers(mat, b);
+	createBuffers(b);
 	initKernelArgs();
 }
 void CGSolver::solve(){
+	if (maxRefinements > 0){
+		solveRefined();
+	}
+	else {
+		runSolve(convergeLen, budget > 0);
+	}
+}
+bool CGSolver::supportsDouble(const cl::Device &device){
+	return device.getInfo<CL_DEVICE_EXTENSIONS>().find("cl_khr_fp64") != std::string::npos;
+}
+void CGSolver::runSolve(float tol, bool budgeted){
+	solveStart = std::chrono::high_resolution_clock::now();
+	for (std::vector<cl::Event> &events : phaseEvents){
+		events.clear();
+	}
+	if (usesLocalSolve()){
+		runLocalSolve(tol, budgeted);
+		return;
+	}
+	//Solve for the part of b outside the nullspace, the rest can't be matched by any x
+	cl::Buffer origB = b;
+	if (constantNullspace){
+		if (projectedB() == nullptr){
+			projectedB = context.buffer(CL_MEM_READ_WRITE, dimensions * sizeof(float), nullptr);
+		}
+		removeMean(b, projectedB);
+		b = projectedB;
+	}
 	initSolve();
+	float tol2 = budgeted ? relativeTolerance() : tol * tol;
+	int iterLimit = budgeted ? budgetIterations(true) : maxIterations;
+	setTolerance(tol2);
+	//The pipelined iteration doesn't apply the preconditioner
+	bool pipelined = mode == MODE::PIPELINED && !precon;
+	if (pipelined){
+		setupPipelined();
+	}
+	else {
+		setupClassic();
+	}
+	//The squared residual length of the latest iteration is at the start of the pipelined
+	//scalar buffer, for classic it's r_dot_r_k which is r_dot_u_k if there's no preconditioner
+	const cl::Buffer &rDotrBuf = pipelined ? pipeScalars : rDotr;
+	size_t rDotrOffset = !pipelined && precon ? sizeof(float) : 0;
+	float initialRLenSq = 0.f;
+	cl::Event initialRead;
+	context.readData(rDotrBuf, sizeof(float), &initialRLenSq, rDotrOffset, false, nullptr, &initialRead);
+	//Residual reads alternate between two slots so a speculative read can be waiting
+	//on the device while the next batch of iterations is enqueued
+	std::array<float, 2> rLenSq;
+	std::array<cl::Event, 2> readEvents;
+	int pending = -1;
+	int enqueued = 0;
+	bool converged = false, outOfTime = false;
+	for (int batch = 0; enqueued < iterLimit && !converged && !outOfTime; ++batch){
+		int n = std::min(checkInterval, iterLimit - enqueued);
+		for (int i = 0; i < n; ++i){
+			if (pipelined){
+				iteratePipelined();
+			}
+			else {
+				iterateClassic();
+			}
+		}
+		enqueued += n;
 
-	//Compute initial r_dot_r_0
-	big_dot.setArg(0, r);
-	big_dot.setArg(1, r);
-	context.runNDKernel(big_dot, cl::NDRange(dimensions), cl::NullRange, cl::NullRange);
-	context.runNDKernel(sum_partial, cl::NDRange(1), cl::NullRange, cl::NullRange);
-	context.mQueue.enqueueCopyBuffer(dotPartial, rDotr, 0, 0, sizeof(float));
-
-	float rLen = 1000.f;
-	int i = 0;
-	for (i = 0; i < maxIterations && rLen > convergeLen; ++i){
-		//find matP = Ap
-		context.runNDKernel(sparse_mat_vec_mult, cl::NDRange(dimensions), cl::NullRange, cl::NullRange);
-
-		//find pMatp = p dot Ap
-		big_dot.setArg(0, p);
-		big_dot.setArg(1, matP);
-		context.runNDKernel(big_dot, cl::NDRange(dimensions), cl::NullRange, cl::NullRange);
-		context.runNDKernel(sum_partial, cl::NDRange(1), cl::NullRange, cl::NullRange);
-		context.mQueue.enqueueCopyBuffer(dotPartial, pMatp, 0, 0, sizeof(float));
-
-		//find x_k+1 and r_k+1
-		context.runNDKernel(update_xr, cl::NDRange(dimensions), cl::NullRange, cl::NullRange);
-
-		//find r_dot_r_k+1
-		big_dot.setArg(0, r);
-		big_dot.setArg(1, r);
-		context.runNDKernel(big_dot, cl::NDRange(dimensions), cl::NullRange, cl::NullRange);
-		context.runNDKernel(sum_partial, cl::NDRange(1), cl::NullRange, cl::NullRange);
-		context.mQueue.enqueueCopyBuffer(dotPartial, rDotr, 0, sizeof(float), sizeof(float));
-
-		//find matP = Ap
-		context.runNDKernel(sparse_mat_vec_mult, cl::NDRange(dimensions), cl::NullRange, cl::NullRange);
+		int slot = batch % 2;
+		context.readData(rDotrBuf, sizeof(float), &rLenSq[slot], rDotrOffset, false, nullptr, &readEvents[slot]);
+		if (speculative){
+			if (pending != -1){
+				readEvents[pending].wait();
+				converged = rLenSq[pending] <= tol2;
+			}
+			pending = slot;
+		}
+		else {
+			readEvents[slot].wait();
+			converged = rLenSq[slot] <= tol2;
+		}
+		//Stop at the budget even if the estimate said more iterations would fit. The clock
+		//has to measure finished device work, so wait for this batch's read even if speculating
+		if (budgeted){
+			readEvents[slot].wait();
+		}
+		outOfTime = budgeted && std::chrono::duration<double, std::milli>(
+			std::chrono::high_resolution_clock::now() - solveStart).count() >= budget;
+	}
+	if (pending != -1){
+		readEvents[pending].wait();
+	}
+	//x can drift along the nullspace without changing the residual, keep the solution mean-free
+	if (constantNullspace){
+		removeMean(x, x);
+		b = origB;
+	}
+	//Find out how many iterations actually did something and read back their residuals
+	int iterations = 0;
+	context.readData(iterCount, sizeof(int), &iterations, 0, true);
+	wastedIterations = enqueued - iterations;
+	residuals.resize(iterations);
+	if (iterations > 0){
+		context.readData(residualLog, iterations * sizeof(float), &residuals[0], 0, true);
+	}
+	initialRead.wait();
+	recordStats(initialRLenSq, tol2, outOfTime || iterLimit < maxIterations);
+}
+void CGSolver::runLocalSolve(float tol, bool budgeted){
+	//The kernel finds r_0 itself when warm starting, only extrapolating the guess is done beforehand
+	bool warm = guess != GUESS::ZERO && haveSolution;
+	if (warm && guess == GUESS::EXTRAPOLATE){
+		extrapolateGuess();
+	}
+	haveSolution = true;
+	//A budgeted solve's tolerance is found from ||b|| by the kernel
+	int iterLimit = budgeted ? budgetIterations(false) : maxIterations;
+	setTolerance(tol * tol);
+	cg_local_solve.setArg(5, b);
+	cg_local_solve.setArg(12, iterLimit);
+	cg_local_solve.setArg(13, warm ? 1 : 0);
+	cg_local_solve.setArg(17, budgeted ? relTolerance * relTolerance : 0.f);
+	cg_local_solve.setArg(18, constantNullspace ? 1 : 0);
+	beginPhase(PHASE::UPDATE);
+	context.runNDKernel(cg_local_solve, cl::NDRange(localGroupSize), cl::NDRange(localGroupSize), cl::NullRange);
 
-		//find p_k+1
-		context.runNDKernel(update_p, cl::NDRange(dimensions), cl::NullRange, cl::NullRange);
+	std::array<float, 3> rLenSq;
+	int iterations = 0;
+	context.readData(rDotr, 3 * sizeof(float), &rLenSq[0], 0, false);
+	context.readData(iterCount, sizeof(int), &iterations, 0, true);
+	wastedIterations = 0;
+	residuals.resize(iterations);
+	if (iterations > 0){
+		context.readData(residualLog, iterations * sizeof(float), &residuals[0], 0, true);
+	}
+	recordStats(rLenSq[0], rLenSq[2], iterLimit < maxIterations);
+}
+float CGSolver::relativeTolerance(){
+	if (bDotb() == nullptr){
+		bDotb = context.buffer(CL_MEM_READ_WRITE, sizeof(float), nullptr);
+	}
+	dot(b, b, bDotb, 0);
+	float bLenSq = 0.f;
+	context.readData(bDotb, sizeof(float), &bLenSq, 0, true);
+	return relTolerance * relTolerance * bLenSq;
+}
+int CGSolver::budgetIterations(bool clocked) const {
+	//Without an estimate yet the first solve can only be stopped by the clock, if there's
+	//no clock to stop it run a few iterations to get an estimate from
+	if (iterationCost <= 0){
+		if (clocked || maxIterations < FIRST_BUDGET_ITERATIONS){
+			return maxIterations;
+		}
+		return FIRST_BUDGET_ITERATIONS;
+	}
+	return std::max(std::min(static_cast<int>(budget / iterationCost), maxIterations), 1);
+}
+void CGSolver::recordStats(float initialRLenSq, float tol2, bool limited){
+	stats = SolveStats();
+	stats.iterations = residuals.size();
+	stats.wastedIterations = wastedIterations;
+	stats.initialResidual = std::sqrt(initialRLenSq);
+	stats.finalResidual = residuals.empty() ? stats.initialResidual : residuals.back();
+	stats.converged = stats.finalResidual * stats.finalResidual <= tol2;
+	stats.tolerance = std::sqrt(tol2);
+	stats.budgetLimited = limited && !stats.converged;
+	stats.wallTime = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now()
+		- solveStart).count();
+	//The fixed cost of a solve is folded into the time per iteration, which makes the
+	//estimate err on the side of fewer iterations when solves are short
+	if (stats.iterations > 0){
+		double cost = stats.wallTime / stats.iterations;
+		iterationCost = iterationCost <= 0 ? cost : 0.75 * iterationCost + 0.25 * cost;
+	}
+	if (keepHistory){
+		stats.residualHistory = residuals;
+	}
+	collectPhaseTimes(stats);
+	if (verbose){
+		std::cout << stats << std::endl;
+	}
+}
+void CGSolver::setMode(MODE m){
+	mode = m;
+	//The pipelined iteration needs some more vectors, allocate them the first time it's picked
+	if (mode == MODE::PIPELINED && w() == nullptr){
+		w = context.buffer(CL_MEM_READ_WRITE, dimensions * sizeof(float), nullptr);
+		q = context.buffer(CL_MEM_READ_WRITE, dimensions * sizeof(float), nullptr);
+		z = context.buffer(CL_MEM_READ_WRITE, dimensions * sizeof(float), nullptr);
+		s = context.buffer(CL_MEM_READ_WRITE, dimensions * sizeof(float), nullptr);
+		pipeScalars = context.buffer(CL_MEM_READ_WRITE, 4 * sizeof(float), nullptr);
+		pipePartial = context.buffer(CL_MEM_READ_WRITE, 2 * nGroups * accSize, nullptr);
 
-		//copy r_dot_r_k+1 over to r_dot_r_k for next step
-		context.mQueue.enqueueCopyBuffer(rDotr, rDotr, sizeof(float), 0, sizeof(float));
+		pipelined_update.setArg(0, pipeScalars);
+		pipelined_update.setArg(1, q);
+		pipelined_update.setArg(2, w);
+		pipelined_update.setArg(3, z);
+		pipelined_update.setArg(4, s);
+		pipelined_update.setArg(5, p);
+		pipelined_update.setArg(6, x);
+		pipelined_update.setArg(7, r);
+		pipelined_update.setArg(8, dimensions);
+		pipelined_update.setArg(9, cl::__local(groupSize * accSize));
+		pipelined_update.setArg(10, pipePartial);
 
-		//Read back residual length
-		context.readData(rDotr, sizeof(float), &rLen, sizeof(float), true);
-		rLen = std::sqrt(rLen);
+		pipelined_scalars.setArg(0, pipePartial);
+		pipelined_scalars.setArg(1, nGroups);
+		pipelined_scalars.setArg(2, cl::__local(groupSize * accSize));
+		pipelined_scalars.setArg(3, pipeScalars);
+		pipelined_scalars.setArg(6, iterCount);
+		pipelined_scalars.setArg(7, residualLog);
+	}
+}
+void CGSolver::setPreconditioner(std::shared_ptr<Preconditioner> pc){
+	precon = pc;
+	int resIdx = 0;
+	if (precon){
+		precon->init(context, cgProgram);
+		if (u() == nullptr || u() == r()){
+			u = context.buffer(CL_MEM_READ_WRITE, dimensions * sizeof(float), nullptr);
+		}
+		resIdx = 1;
+	}
+	else {
+		u = r;
+	}
+	update_xr.setArg(7, resIdx);
+	update_p.setArg(1, u);
+	update_p.setArg(4, resIdx);
+}
+void CGSolver::setGuess(const cl::Buffer &xBuf){
+	if (permutation.empty()){
+		context.mQueue.enqueueCopyBuffer(xBuf, x, 0, 0, dimensions * sizeof(float));
+	}
+	else {
+		permute_vector.setArg(1, xBuf);
+		permute_vector.setArg(2, x);
+		context.runNDKernel(permute_vector, cl::NDRange(dimensions), cl::NullRange, cl::NullRange);
+	}
+	haveSolution = true;
+}
+void CGSolver::setInitialGuess(GUESS g){
+	guess = g;
+	//xPrev may be stale if we weren't extrapolating before
+	havePrevious = false;
+	if (guess == GUESS::EXTRAPOLATE && xPrev() == nullptr){
+		xPrev = context.buffer(CL_MEM_READ_WRITE, dimensions * sizeof(float), nullptr);
+		extrapolate_guess.setArg(0, x);
+		extrapolate_guess.setArg(1, xPrev);
+	}
+}
+void CGSolver::setRefinement(int maxSteps, float innerTol){
+	maxRefinements = std::max(maxSteps, 0);
+	innerTolerance = innerTol;
+	if (maxRefinements > 0 && refineB() == nullptr){
+		refineB = context.buffer(CL_MEM_READ_ONLY, dimensions * sizeof(float), nullptr);
+	}
+	refinedX.clear();
+}
+const std::vector<double>& CGSolver::getRefinedResult() const {
+	return permutation.empty() ? refinedX : refinedResult;
+}
+bool CGSolver::usesDoubleReductions() const {
+	return accSize == sizeof(double);
+}
+void CGSolver::setConvergenceCheck(int interval, bool spec){
+	checkInterval = std::max(interval, 1);
+	speculative = spec;
+}
+void CGSolver::setBudget(double budgetMs, float relTol){
+	budget = std::max(budgetMs, 0.0);
+	relTolerance = relTol;
+}
+double CGSolver::getIterationCost() const {
+	return iterationCost;
+}
+void CGSolver::setLocalSolve(bool enable){
+	allowLocalSolve = enable;
+}
+bool CGSolver::usesLocalSolve() const {
+	return allowLocalSolve && localSolveFits && !precon;
+}
+void CGSolver::setConstantNullspace(bool constant){
+	constantNullspace = constant;
+}
+bool CGSolver::hasConstantNullspace() const {
+	return constantNullspace;
+}
+void CGSolver::setVerbose(bool v){
+	verbose = v;
+}
+void CGSolver::setTelemetry(bool history, bool timing){
+	keepHistory = history;
+	timePhases = timing && context.profilingEnabled();
+	if (timing && !timePhases){
+		std::cout << "CGSolver: the context doesn't have profiling enabled, solves won't be timed" << std::endl;
 	}
-	std::cout << "solution took: " << i << " iterations, final residual length: " << rLen << std::endl;
+}
+const SolveStats& CGSolver::getStats() const {
+	return stats;
+}
+const std::vector<float>& CGSolver::getResidualHistory() const {
+	return residuals;
+}
+int CGSolver::getWastedIterations() const {
+	return wastedIterations;
 }
 void CGSolver::updateB(const std::vector<float> &bVec){
-	b = context.buffer(tcl::MEM::READ_ONLY, dimensions * sizeof(float), &bVec[0]);
+	if (permutation.empty()){
+		b = context.buffer(tcl::MEM::READ_ONLY, dimensions * sizeof(float), &bVec[0]);
+		return;
+	}
+	std::vector<float> permuted(dimensions);
+	for (int i = 0; i < dimensions; ++i){
+		permuted[i] = bVec[permutation[i]];
+	}
+	//The buffer is written from a temporary so the write has to finish before we return
+	b = context.buffer(tcl::MEM::READ_ONLY, dimensions * sizeof(float), &permuted[0], 0, true);
 }
 void CGSolver::updateB(cl::Buffer &bBuf){
-	b = bBuf;
+	if (permutation.empty()){
+		b = bBuf;
+		return;
+	}
+	if (permutedB() == nullptr){
+		permutedB = context.buffer(CL_MEM_READ_WRITE, dimensions * sizeof(float), nullptr);
+	}
+	//Gather the buffer into the reordered system's order
+	permute_vector.setArg(1, bBuf);
+	permute_vector.setArg(2, permutedB);
+	context.runNDKernel(permute_vector, cl::NDRange(dimensions), cl::NullRange, cl::NullRange);
+	b = permutedB;
 }
 std::vector<float> CGSolver::getResult(){
+	std::vector<float> res = readX();
+	if (permutation.empty()){
+		return res;
+	}
+	std::vector<float> original(dimensions);
+	for (int i = 0; i < dimensions; ++i){
+		original[permutation[i]] = res[i];
+	}
+	return original;
+}
+std::vector<float> CGSolver::readX(){
 	std::vector<float> res;
 	res.resize(dimensions);
 	float *xBuf = static_cast<float*>(context.mQueue.enqueueMapBuffer(x, CL_TRUE, CL_MAP_READ, 0, dimensions * sizeof(float)));
@@ -84,38 +401,74 @@ std::vector<float> CGSolver::getResult(){
 	return res;
 }
 cl::Buffer CGSolver::getResultBuffer(){
-	return x;
+	if (permutation.empty()){
+		return x;
+	}
+	if (originalX() == nullptr){
+		originalX = context.buffer(CL_MEM_READ_WRITE, dimensions * sizeof(float), nullptr);
+	}
+	unpermute_vector.setArg(1, x);
+	unpermute_vector.setArg(2, originalX);
+	context.runNDKernel(unpermute_vector, cl::NDRange(dimensions), cl::NullRange, cl::NullRange);
+	return originalX;
+}
+const std::vector<int>& CGSolver::getPermutation() const {
+	return permutation;
+}
+std::vector<int> CGSolver::findOrdering(const SparseMatrix<float> &mat, REORDER reorder){
+	if (reorder == REORDER::NONE){
+		return std::vector<int>();
+	}
+	std::vector<int> rowPtr(mat.dim + 1), col(mat.nonZeros());
+	std::vector<float> val(col.size());
+	mat.getCSR(&rowPtr[0], &col[0], &val[0]);
+	if (reorder == REORDER::RCM){
+		return reorder::reverseCuthillMcKee(rowPtr, col);
+	}
+	return reorder::nestedDissection(rowPtr, col);
 }
 void CGSolver::loadKernels(){
-	cgProgram = context.loadProgram("../res/cg_kernels.cl");
-	sparse_mat_vec_mult = cl::Kernel(cgProgram, "sparse_mat_vec_mult");
-	big_dot = cl::Kernel(cgProgram, "big_dot");
-	sum_partial = cl::Kernel(cgProgram, "sum_partial");
+	//Accumulate the dot products in double if the device can
+	const cl::Device &device = context.mDevices.at(0);
+	bool useDouble = supportsDouble(device);
+	accSize = useDouble ? sizeof(double) : sizeof(float);
+	cgProgram = context.loadProgram("../res/cg_kernels.cl", useDouble ? "-DCG_USE_DOUBLE" : "");
+	op->init(context, cgProgram);
 	update_xr = cl::Kernel(cgProgram, "update_xr");
 	update_p = cl::Kernel(cgProgram, "update_p");
-}
-void CGSolver::createBuffers(const SparseMatrix<float> &mat, const std::vector<float> &bVec){
-	matrix[MATRIX::ROW] = context.buffer(CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR,
-		matNVals * sizeof(int), nullptr);
-	matrix[MATRIX::COL] = context.buffer(CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR,
-		matNVals * sizeof(int), nullptr);
-	matrix[MATRIX::VAL] = context.buffer(CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR,
-		matNVals * sizeof(float), nullptr);
-	//Map the buffers and write the matrix over
-	int *rows = static_cast<int*>(context.mQueue.enqueueMapBuffer(matrix[MATRIX::ROW], CL_FALSE,
-		CL_MAP_WRITE, 0, matNVals * sizeof(int)));
-	int *cols = static_cast<int*>(context.mQueue.enqueueMapBuffer(matrix[MATRIX::COL], CL_FALSE,
-		CL_MAP_WRITE, 0, matNVals * sizeof(int)));
-	//Block on the final map so that we can now start writing
-	float *vals = static_cast<float*>(context.mQueue.enqueueMapBuffer(matrix[MATRIX::VAL], CL_TRUE,
-		CL_MAP_WRITE, 0, matNVals * sizeof(float)));
-
-	mat.getRaw(rows, cols, vals);
-	
-	context.mQueue.enqueueUnmapMemObject(matrix[MATRIX::ROW], rows);
-	context.mQueue.enqueueUnmapMemObject(matrix[MATRIX::COL], cols);
-	context.mQueue.enqueueUnmapMemObject(matrix[MATRIX::VAL], vals);
+	pipelined_update = cl::Kernel(cgProgram, "pipelined_update");
+	pipelined_scalars = cl::Kernel(cgProgram, "pipelined_scalars");
+	compute_residual = cl::Kernel(cgProgram, "compute_residual");
+	extrapolate_guess = cl::Kernel(cgProgram, "extrapolate_guess");
+	permute_vector = cl::Kernel(cgProgram, "permute_vector");
+	unpermute_vector = cl::Kernel(cgProgram, "unpermute_vector");
+	cg_local_solve = cl::Kernel(cgProgram, "cg_local_solve");
+	remove_mean = cl::Kernel(cgProgram, "remove_mean");
+
+	//The dot products of the plain iteration go through context.reduce, but the pipelined
+	//kernels fuse their own reductions which need a power of 2 work group size
+	groupSize = context.powerOfTwoGroupSize({ pipelined_update, pipelined_scalars });
+	//Limit the number of groups so the final pipelined_scalars pass has at most one partial per work item
+	nGroups = std::min(groupSize, (dimensions + groupSize - 1) / groupSize);
 
+	//The local solve's group can be larger than the reduction groups, but there's no use
+	//having more work items than rows
+	localGroupSize = context.powerOfTwoGroupSize({ cg_local_solve }, std::min(1024, dimensions));
+	//p and Ap are shared through local memory, along with the reduction scratch space
+	cl_ulong localNeeded = 2 * dimensions * sizeof(float) + localGroupSize * accSize
+		+ cg_local_solve.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device);
+	localSolveFits = localNeeded <= device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+	if (localSolveFits){
+		int gridDim = 0;
+		cl::Buffer rowPtr, col, val;
+		localSolveFits = op->localSolveForm(context, gridDim, rowPtr, col, val);
+		cg_local_solve.setArg(0, rowPtr);
+		cg_local_solve.setArg(1, col);
+		cg_local_solve.setArg(2, val);
+		cg_local_solve.setArg(3, gridDim);
+	}
+}
+void CGSolver::createBuffers(const std::vector<float> &bVec){
 	//In the case that we want to upload everything but the b vector
 	if (!bVec.empty()){
 		b = context.buffer(CL_MEM_READ_ONLY, dimensions * sizeof(float), &bVec[0]);
@@ -126,41 +479,325 @@ void CGSolver::createBuffers(const SparseMatrix<float> &mat, const std::vector<f
 
 	matP = context.buffer(CL_MEM_READ_WRITE, dimensions * sizeof(float), nullptr);
 	pMatp = context.buffer(CL_MEM_READ_WRITE, dimensions * sizeof(float), nullptr);
-	rDotr = context.buffer(CL_MEM_READ_WRITE, 2 * sizeof(float), nullptr);
-	dotPartial = context.buffer(CL_MEM_READ_WRITE, dimensions * sizeof(float), nullptr);
+	rDotr = context.buffer(CL_MEM_READ_WRITE, 4 * sizeof(float), nullptr);
+	meanSum = context.buffer(CL_MEM_READ_WRITE, sizeof(float), nullptr);
+	u = r;
+	iterCount = context.buffer(CL_MEM_READ_WRITE, sizeof(int), nullptr);
+	residualLog = context.buffer(CL_MEM_READ_WRITE, std::max(maxIterations, 1) * sizeof(float), nullptr);
 }
 void CGSolver::initKernelArgs(){
-	sparse_mat_vec_mult.setArg(0, matNVals);
-	for (int i = 0; i < 3; ++i){
-		sparse_mat_vec_mult.setArg(i + 1, matrix[i]);
-	}
-	sparse_mat_vec_mult.setArg(4, p);
-	sparse_mat_vec_mult.setArg(5, matP);
-
-	big_dot.setArg(2, dotPartial);
-	sum_partial.setArg(0, dotPartial);
-	sum_partial.setArg(1, dimensions);
-
 	update_xr.setArg(0, rDotr);
 	update_xr.setArg(1, pMatp);
 	update_xr.setArg(2, p);
 	update_xr.setArg(3, matP);
 	update_xr.setArg(4, x);
 	update_xr.setArg(5, r);
+	update_xr.setArg(7, 0);
 
 	update_p.setArg(0, rDotr);
-	update_p.setArg(1, r);
+	update_p.setArg(1, u);
 	update_p.setArg(2, p);
+	update_p.setArg(4, 0);
+	update_p.setArg(5, iterCount);
+	update_p.setArg(6, residualLog);
+
+	compute_residual.setArg(1, matP);
+	compute_residual.setArg(2, r);
+
+	remove_mean.setArg(0, meanSum);
+	remove_mean.setArg(3, dimensions);
+
+	if (localSolveFits){
+		cg_local_solve.setArg(4, dimensions);
+		cg_local_solve.setArg(6, x);
+		cg_local_solve.setArg(7, r);
+		cg_local_solve.setArg(8, cl::__local(dimensions * sizeof(float)));
+		cg_local_solve.setArg(9, cl::__local(dimensions * sizeof(float)));
+		cg_local_solve.setArg(10, cl::__local(localGroupSize * accSize));
+		cg_local_solve.setArg(12, maxIterations);
+		cg_local_solve.setArg(14, rDotr);
+		cg_local_solve.setArg(15, iterCount);
+		cg_local_solve.setArg(16, residualLog);
+		cg_local_solve.setArg(17, 0.f);
+		cg_local_solve.setArg(18, 0);
+	}
 }
-void CGSolver::initSolve(){
-	context.mQueue.enqueueCopyBuffer(b, r, 0, 0, dimensions * sizeof(float));
-	context.mQueue.enqueueCopyBuffer(b, p, 0, 0, dimensions * sizeof(float));
+void CGSolver::beginPhase(PHASE phase){
+	if (timePhases){
+		context.recordKernelEvents(&phaseEvents[phase]);
+	}
+}
+void CGSolver::collectPhaseTimes(SolveStats &solveStats){
+	if (!timePhases){
+		return;
+	}
+	context.recordKernelEvents(nullptr);
+	std::array<double, 4> times = { 0, 0, 0, 0 };
+	for (int i = 0; i < 4; ++i){
+		for (const cl::Event &e : phaseEvents[i]){
+			//Profiling times are in nanoseconds
+			times[i] += (e.getProfilingInfo<CL_PROFILING_COMMAND_END>()
+				- e.getProfilingInfo<CL_PROFILING_COMMAND_START>()) / 1e6;
+		}
+	}
+	solveStats.timed = true;
+	solveStats.spmvTime += times[PHASE::SPMV];
+	solveStats.reductionTime += times[PHASE::REDUCTION];
+	solveStats.updateTime += times[PHASE::UPDATE];
+	solveStats.preconditionerTime += times[PHASE::PRECONDITIONER];
+}
+void CGSolver::setTolerance(float tol2){
+	tolerance = tol2;
+	update_xr.setArg(6, tol2);
+	update_p.setArg(3, tol2);
+	pipelined_update.setArg(11, tol2);
+	pipelined_scalars.setArg(5, tol2);
+	if (localSolveFits){
+		cg_local_solve.setArg(11, tol2);
+	}
+}
+void CGSolver::solveRefined(){
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	//Read back b to find the true residual in double precision on the host
+	std::vector<float> bHost(dimensions);
+	context.readData(b, dimensions * sizeof(float), &bHost[0], 0, true);
+	//The mean of b is in the nullspace so the true residual is measured against the rest of it
+	if (constantNullspace){
+		double mean = 0;
+		for (float v : bHost){
+			mean += v;
+		}
+		mean /= dimensions;
+		for (float &v : bHost){
+			v = static_cast<float>(v - mean);
+		}
+	}
+	//Continue from the last refined solution if we're warm starting
+	if (guess == GUESS::ZERO || refinedX.size() != static_cast<size_t>(dimensions)){
+		refinedX.assign(dimensions, 0.0);
+	}
+	//The corrections are solved from scratch with the residual as b
+	cl::Buffer origB = b;
+	GUESS origGuess = guess;
+	b = refineB;
+	guess = GUESS::ZERO;
+
+	std::vector<double> matX(dimensions);
+	std::vector<float> res(dimensions);
+	std::vector<float> history;
+	int steps = 0, wasted = 0;
+	double rLen = 0;
+	SolveStats total;
+	while (true){
+		op->applyHost(refinedX, matX);
+		double rLenSq = 0;
+		for (int i = 0; i < dimensions; ++i){
+			double ri = bHost[i] - matX[i];
+			res[i] = static_cast<float>(ri);
+			rLenSq += ri * ri;
+		}
+		rLen = std::sqrt(rLenSq);
+		if (steps == 0){
+			total.initialResidual = static_cast<float>(rLen);
+		}
+		if (rLen <= convergeLen || steps == maxRefinements){
+			break;
+		}
+		//The correction only needs to shrink the residual by innerTolerance, which float
+		//can do, since the next step will correct for its error
+		context.writeData(refineB, dimensions * sizeof(float), &res[0], 0, false);
+		runSolve(static_cast<float>(rLen) * innerTolerance);
+		std::vector<float> correction = readX();
+		for (int i = 0; i < dimensions; ++i){
+			refinedX[i] += correction[i];
+		}
+		history.insert(history.end(), residuals.begin(), residuals.end());
+		wasted += wastedIterations;
+		total.timed = stats.timed;
+		total.spmvTime += stats.spmvTime;
+		total.reductionTime += stats.reductionTime;
+		total.updateTime += stats.updateTime;
+		total.preconditionerTime += stats.preconditionerTime;
+		++steps;
+	}
+	b = origB;
+	guess = origGuess;
+	if (constantNullspace){
+		double mean = 0;
+		for (double v : refinedX){
+			mean += v;
+		}
+		mean /= dimensions;
+		for (double &v : refinedX){
+			v -= mean;
+		}
+	}
+	//Leave the refined solution in x for getResultBuffer and warm starts
+	std::vector<float> xHost(refinedX.begin(), refinedX.end());
+	context.writeData(x, dimensions * sizeof(float), &xHost[0], 0, true);
+	haveSolution = true;
+	if (!permutation.empty()){
+		refinedResult.resize(dimensions);
+		for (int i = 0; i < dimensions; ++i){
+			refinedResult[permutation[i]] = refinedX[i];
+		}
+	}
+	residuals = history;
+	wastedIterations = wasted;
+
+	total.iterations = residuals.size();
+	total.wastedIterations = wasted;
+	total.finalResidual = static_cast<float>(rLen);
+	total.converged = rLen <= convergeLen;
+	total.tolerance = convergeLen;
+	total.wallTime = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now()
+		- start).count();
+	if (keepHistory){
+		total.residualHistory = residuals;
+	}
+	stats = total;
+	if (verbose){
+		std::cout << "refined solution with " << steps << " refinement steps, " << stats << std::endl;
+	}
+}
+void CGSolver::setupClassic(){
+	if (precon){
+		//Start searching along u_0 = M^-1 r_0 and compute r_dot_u_0 and r_dot_r_0
+		beginPhase(PHASE::PRECONDITIONER);
+		precon->apply(context, r, u);
+		//The preconditioner needn't keep its output out of the nullspace
+		if (constantNullspace){
+			removeMean(u, u);
+		}
+		context.mQueue.enqueueCopyBuffer(u, p, 0, 0, dimensions * sizeof(float));
+		dot(r, u, rDotr, 0);
+		dot(r, r, rDotr, 1);
+	}
+	else {
+		//Compute initial r_dot_r_0
+		dot(r, r, rDotr, 0);
+	}
+}
+void CGSolver::iterateClassic(){
+	//find matP = Ap
+	matVec(p, matP);
+
+	//find pMatp = p dot Ap
+	dot(p, matP, pMatp, 0);
+
+	//find x_k+1 and r_k+1
+	beginPhase(PHASE::UPDATE);
+	context.runNDKernel(update_xr, cl::NDRange(dimensions), cl::NullRange, cl::NullRange);
+
+	//find u_k+1 = M^-1 r_k+1, r_dot_u_k+1 and r_dot_r_k+1
+	if (precon){
+		beginPhase(PHASE::PRECONDITIONER);
+		precon->apply(context, r, u);
+		if (constantNullspace){
+			removeMean(u, u);
+		}
+		dot(r, u, rDotr, 2);
+		dot(r, r, rDotr, 3);
+	}
+	else {
+		dot(r, r, rDotr, 2);
+	}
+
+	//find p_k+1
+	beginPhase(PHASE::UPDATE);
+	context.runNDKernel(update_p, cl::NDRange(dimensions), cl::NullRange, cl::NullRange);
+
+	//copy the k+1 dot products over to the k ones for next step
+	context.mQueue.enqueueCopyBuffer(rDotr, rDotr, 2 * sizeof(float), 0, 2 * sizeof(float));
+}
+void CGSolver::setupPipelined(){
+	cl::NDRange reduceGlobal(nGroups * groupSize), reduceLocal(groupSize);
+	//z and s are scaled by beta = 0 on the first update, but must not start out as NaN garbage
+	zeroBuffer(z, dimensions * sizeof(float));
+	zeroBuffer(s, dimensions * sizeof(float));
+	zeroBuffer(pipeScalars, 4 * sizeof(float));
+
+	//Find w_0 = Ar_0 and q_0 = Aw_0, then with alpha = beta = 0 the update will just find
+	//r_dot_r_0 and w_dot_r_0 which we use to get the initial step size. The update
+	//is forced to run by the negative tolerance since the scalars start at 0
+	matVec(r, w);
+	matVec(w, q);
+	pipelined_update.setArg(11, -1.f);
+	beginPhase(PHASE::UPDATE);
+	context.runNDKernel(pipelined_update, reduceGlobal, reduceLocal, cl::NullRange);
+	pipelined_update.setArg(11, tolerance);
+	pipelined_scalars.setArg(4, 1);
+	beginPhase(PHASE::REDUCTION);
+	context.runNDKernel(pipelined_scalars, reduceLocal, reduceLocal, cl::NullRange);
+	pipelined_scalars.setArg(4, 0);
+}
+void CGSolver::iteratePipelined(){
+	cl::NDRange reduceGlobal(nGroups * groupSize), reduceLocal(groupSize);
+	//find x_k+1, r_k+1 and w_k+1 along with the partial dot products for the next step, the
+	//partials are counted as part of the update since they're fused into it
+	beginPhase(PHASE::UPDATE);
+	context.runNDKernel(pipelined_update, reduceGlobal, reduceLocal, cl::NullRange);
+
+	//find r_dot_r_k+1, w_dot_r_k+1, alpha_k+1 and beta_k+1
+	beginPhase(PHASE::REDUCTION);
+	context.runNDKernel(pipelined_scalars, reduceLocal, reduceLocal, cl::NullRange);
+
+	//find q_k+1 = Aw_k+1
+	matVec(w, q);
+}
+void CGSolver::dot(const cl::Buffer &a, const cl::Buffer &b, cl::Buffer &out, int outIdx){
+	beginPhase(PHASE::REDUCTION);
+	context.reduce<float>(tcl::DOT, a, dimensions, out, outIdx, &b);
+}
+void CGSolver::matVec(const cl::Buffer &in, cl::Buffer &out){
+	beginPhase(PHASE::SPMV);
+	op->apply(context, in, out);
+}
+void CGSolver::removeMean(const cl::Buffer &in, cl::Buffer &out){
+	beginPhase(PHASE::REDUCTION);
+	context.reduce<float>(tcl::SUM, in, dimensions, meanSum);
+	beginPhase(PHASE::UPDATE);
+	remove_mean.setArg(1, in);
+	remove_mean.setArg(2, out);
+	context.runNDKernel(remove_mean, cl::NDRange(dimensions), cl::NullRange, cl::NullRange);
+}
+void CGSolver::zeroBuffer(cl::Buffer &buf, size_t size){
 #ifdef CL_VERSION_1_2
-	//Use FillBuffer to fill X with 0's but not have to transfer between host/device
-	//cl::CommandQueue::enqueueFillBuffer(buffer, pattern, offset, size, events, event);
+	//Use FillBuffer to fill with 0's but not have to transfer between host/device
+	context.mQueue.enqueueFillBuffer(buf, 0.f, 0, size);
 #else
-	float *xBuf = static_cast<float*>(context.mQueue.enqueueMapBuffer(x, CL_TRUE, CL_MAP_WRITE, 0, dimensions * sizeof(float)));
-	std::memset(xBuf, 0, dimensions * sizeof(float));
-	context.mQueue.enqueueUnmapMemObject(x, xBuf);
+	float *mapped = static_cast<float*>(context.mQueue.enqueueMapBuffer(buf, CL_TRUE, CL_MAP_WRITE, 0, size));
+	std::memset(mapped, 0, size);
+	context.mQueue.enqueueUnmapMemObject(buf, mapped);
 #endif
 }
+void CGSolver::initSolve(){
+	zeroBuffer(iterCount, sizeof(int));
+	if (guess == GUESS::ZERO || !haveSolution){
+		context.mQueue.enqueueCopyBuffer(b, r, 0, 0, dimensions * sizeof(float));
+		context.mQueue.enqueueCopyBuffer(b, p, 0, 0, dimensions * sizeof(float));
+		zeroBuffer(x, dimensions * sizeof(float));
+		//The solution will be left in x for the next solve
+		haveSolution = true;
+		return;
+	}
+	if (guess == GUESS::EXTRAPOLATE){
+		extrapolateGuess();
+	}
+	//Find r_0 = b - Ax_0 for the guess we're starting from
+	matVec(x, matP);
+	compute_residual.setArg(0, b);
+	beginPhase(PHASE::UPDATE);
+	context.runNDKernel(compute_residual, cl::NDRange(dimensions), cl::NullRange, cl::NullRange);
+	context.mQueue.enqueueCopyBuffer(r, p, 0, 0, dimensions * sizeof(float));
+}
+void CGSolver::extrapolateGuess(){
+	if (havePrevious){
+		beginPhase(PHASE::UPDATE);
+		context.runNDKernel(extrapolate_guess, cl::NDRange(dimensions), cl::NullRange, cl::NullRange);
+	}
+	else {
+		context.mQueue.enqueueCopyBuffer(x, xPrev, 0, 0, dimensions * sizeof(float));
+		havePrevious = true;
+	}
+}
@@ -0,0 +1,226 @@
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include "sparsematrix.h"
+#include "cpucgsolver.h"
+
+//Dot product of a[begin, end) and b[begin, end). The independent accumulators
+//let the compiler vectorize the loop without reassociating a single running sum
+static double dotRange(const float *a, const float *b, int begin, int end){
+	double acc[4] = { 0, 0, 0, 0 };
+	int i = begin;
+	for (; i + 4 <= end; i += 4){
+		acc[0] += static_cast<double>(a[i]) * b[i];
+		acc[1] += static_cast<double>(a[i + 1]) * b[i + 1];
+		acc[2] += static_cast<double>(a[i + 2]) * b[i + 2];
+		acc[3] += static_cast<double>(a[i + 3]) * b[i + 3];
+	}
+	for (; i < end; ++i){
+		acc[0] += static_cast<double>(a[i]) * b[i];
+	}
+	return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+CPUCGSolver::SpinBarrier::SpinBarrier(int n) : n(n), count(0), generation(0)
+{}
+void CPUCGSolver::SpinBarrier::wait(){
+	int gen = generation.load(std::memory_order_acquire);
+	if (count.fetch_add(1, std::memory_order_acq_rel) == n - 1){
+		count.store(0, std::memory_order_relaxed);
+		generation.fetch_add(1, std::memory_order_release);
+	}
+	else {
+		while (generation.load(std::memory_order_acquire) == gen){
+			std::this_thread::yield();
+		}
+	}
+}
+
+CPUCGSolver::CPUCGSolver(const SparseMatrix<float> &mat, const std::vector<float> &bVec, int iter,
+	float convergeLen, int threads)
+		: maxIterations(iter), dimensions(mat.dim), convergeLen(convergeLen),
+		nThreads(threads > 0 ? threads : std::max(static_cast<int>(std::thread::hardware_concurrency()), 1)),
+		verbose(false), pMatpPartial(nThreads * PARTIAL_STRIDE), rDotrPartial(nThreads * PARTIAL_STRIDE), barrier(nThreads),
+		taskGeneration(0), finished(0), quit(false)
+{
+	int nVals = mat.nonZeros();
+	std::vector<int> csrRowPtr(dimensions + 1), csrCol(nVals);
+	std::vector<float> csrVal(nVals);
+	mat.getCSR(&csrRowPtr[0], &csrCol[0], &csrVal[0]);
+	partitionRows(csrRowPtr);
+
+	rowPtr.reset(new int[dimensions + 1]);
+	col.reset(new int[nVals]);
+	val.reset(new float[nVals]);
+	x.reset(new float[dimensions]);
+	r.reset(new float[dimensions]);
+	p.reset(new float[dimensions]);
+	matP.reset(new float[dimensions]);
+	b.reset(new float[dimensions]);
+
+	for (int i = 0; i < nThreads; ++i){
+		workers.push_back(std::thread(&CPUCGSolver::worker, this, i));
+	}
+	//Have each worker do the first write to the parts of the arrays it owns
+	run([&](int t){
+		int begin = rowStart[t], end = rowStart[t + 1];
+		std::copy(csrRowPtr.begin() + begin, csrRowPtr.begin() + end, &rowPtr[begin]);
+		if (t == nThreads - 1){
+			rowPtr[dimensions] = csrRowPtr[dimensions];
+		}
+		std::copy(csrCol.begin() + csrRowPtr[begin], csrCol.begin() + csrRowPtr[end], &col[csrRowPtr[begin]]);
+		std::copy(csrVal.begin() + csrRowPtr[begin], csrVal.begin() + csrRowPtr[end], &val[csrRowPtr[begin]]);
+		std::fill(&x[0] + begin, &x[0] + end, 0.f);
+		std::fill(&r[0] + begin, &r[0] + end, 0.f);
+		std::fill(&p[0] + begin, &p[0] + end, 0.f);
+		std::fill(&matP[0] + begin, &matP[0] + end, 0.f);
+		std::fill(&b[0] + begin, &b[0] + end, 0.f);
+	});
+	if (!bVec.empty()){
+		updateB(bVec);
+	}
+}
+CPUCGSolver::~CPUCGSolver(){
+	{
+		std::lock_guard<std::mutex> lock(taskMutex);
+		quit = true;
+	}
+	taskReady.notify_all();
+	for (std::thread &t : workers){
+		t.join();
+	}
+}
+void CPUCGSolver::solve(){
+	residuals.clear();
+	run([this](int t){ solveTask(t); });
+	if (verbose){
+		std::cout << "solution took: " << residuals.size() << " iterations, final residual length: "
+			<< (residuals.empty() ? 0.f : residuals.back()) << std::endl;
+	}
+}
+void CPUCGSolver::updateB(const std::vector<float> &bVec){
+	run([&](int t){
+		std::copy(bVec.begin() + rowStart[t], bVec.begin() + rowStart[t + 1], &b[0] + rowStart[t]);
+	});
+}
+std::vector<float> CPUCGSolver::getResult() const {
+	return std::vector<float>(&x[0], &x[0] + dimensions);
+}
+const std::vector<float>& CPUCGSolver::getResidualHistory() const {
+	return residuals;
+}
+int CPUCGSolver::getThreads() const {
+	return nThreads;
+}
+void CPUCGSolver::setVerbose(bool v){
+	verbose = v;
+}
+void CPUCGSolver::run(const std::function<void(int)> &t){
+	std::unique_lock<std::mutex> lock(taskMutex);
+	task = t;
+	finished = 0;
+	++taskGeneration;
+	taskReady.notify_all();
+	taskDone.wait(lock, [this](){ return finished == nThreads; });
+}
+void CPUCGSolver::worker(int id){
+	int seen = 0;
+	while (true){
+		std::function<void(int)> current;
+		{
+			std::unique_lock<std::mutex> lock(taskMutex);
+			taskReady.wait(lock, [&](){ return quit || taskGeneration != seen; });
+			if (quit){
+				return;
+			}
+			seen = taskGeneration;
+			current = task;
+		}
+		current(id);
+		{
+			std::lock_guard<std::mutex> lock(taskMutex);
+			++finished;
+		}
+		taskDone.notify_one();
+	}
+}
+void CPUCGSolver::partitionRows(const std::vector<int> &csrRowPtr){
+	rowStart.resize(nThreads + 1);
+	long long nVals = csrRowPtr[dimensions];
+	rowStart[0] = 0;
+	for (int t = 1; t < nThreads; ++t){
+		int target = static_cast<int>(nVals * t / nThreads);
+		rowStart[t] = std::lower_bound(csrRowPtr.begin(), csrRowPtr.end() - 1, target) - csrRowPtr.begin();
+		rowStart[t] = std::max(rowStart[t], rowStart[t - 1]);
+	}
+	rowStart[nThreads] = dimensions;
+}
+void CPUCGSolver::solveTask(int t){
+	int begin = rowStart[t], end = rowStart[t + 1];
+	float tol2 = convergeLen * convergeLen;
+	//x = 0, r = p = b
+	std::fill(&x[0] + begin, &x[0] + end, 0.f);
+	std::copy(&b[0] + begin, &b[0] + end, &r[0] + begin);
+	std::copy(&b[0] + begin, &b[0] + end, &p[0] + begin);
+	rDotrPartial[t * PARTIAL_STRIDE] = dotRange(&r[0], &r[0], begin, end);
+	barrier.wait();
+	//Every worker sums the partials in the same order so they all agree on when to stop
+	double rDotr = sumPartials(rDotrPartial);
+	for (int iter = 0; iter < maxIterations && rDotr > tol2; ++iter){
+		//find matP = Ap for our rows along with our part of pAp
+		double pMatp = 0;
+		for (int i = begin; i < end; ++i){
+			float sum = 0.f;
+			for (int j = rowPtr[i]; j < rowPtr[i + 1]; ++j){
+				sum += val[j] * p[col[j]];
+			}
+			matP[i] = sum;
+			pMatp += static_cast<double>(p[i]) * sum;
+		}
+		pMatpPartial[t * PARTIAL_STRIDE] = pMatp;
+		barrier.wait();
+		float alpha = static_cast<float>(rDotr / sumPartials(pMatpPartial));
+
+		//find x_k+1, r_k+1 and our part of r_dot_r_k+1 in one pass, with
+		//independent accumulators like dotRange
+		double acc[4] = { 0, 0, 0, 0 };
+		int i = begin;
+		for (; i + 4 <= end; i += 4){
+			for (int l = 0; l < 4; ++l){
+				x[i + l] += alpha * p[i + l];
+				r[i + l] -= alpha * matP[i + l];
+				acc[l] += static_cast<double>(r[i + l]) * r[i + l];
+			}
+		}
+		for (; i < end; ++i){
+			x[i] += alpha * p[i];
+			r[i] -= alpha * matP[i];
+			acc[0] += static_cast<double>(r[i]) * r[i];
+		}
+		double rDotrNext = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+		rDotrPartial[t * PARTIAL_STRIDE] = rDotrNext;
+		barrier.wait();
+		rDotrNext = sumPartials(rDotrPartial);
+
+		//find p_k+1
+		float beta = static_cast<float>(rDotrNext / rDotr);
+		rDotr = rDotrNext;
+		for (i = begin; i < end; ++i){
+			p[i] = r[i] + beta * p[i];
+		}
+		if (t == 0){
+			residuals.push_back(static_cast<float>(std::sqrt(rDotr)));
+		}
+		//Everyone's part of p must be updated before anyone multiplies by it
+		barrier.wait();
+	}
+}
+double CPUCGSolver::sumPartials(const std::vector<double> &partials) const {
+	double sum = 0;
+	for (int t = 0; t < nThreads; ++t){
+		sum += partials[t * PARTIAL_STRIDE];
+	}
+	return sum;
+}
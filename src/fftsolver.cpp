@@ -0,0 +1,120 @@
+#include <vector>
+#include <complex>
+#include <cmath>
+#include <stdexcept>
+#include "tinycl.h"
+#include "fftsolver.h"
+
+//In place radix-2 FFT of the n values of data spaced stride apart, sign is -1
+//for the forward transform and 1 for the inverse, which is left unscaled
+static void fft(std::complex<double> *data, int n, int stride, double sign){
+	//Bit reverse the order then combine pairs of transforms of doubling length
+	for (int i = 1, j = 0; i < n; ++i){
+		int bit = n >> 1;
+		for (; j & bit; bit >>= 1){
+			j ^= bit;
+		}
+		j ^= bit;
+		if (i < j){
+			std::swap(data[i * stride], data[j * stride]);
+		}
+	}
+	const double pi = 3.14159265358979323846;
+	for (int len = 2; len <= n; len <<= 1){
+		std::complex<double> step = std::polar(1.0, sign * 2.0 * pi / len);
+		for (int i = 0; i < n; i += len){
+			std::complex<double> w(1.0, 0.0);
+			for (int k = 0; k < len / 2; ++k){
+				std::complex<double> u0 = data[(i + k) * stride];
+				std::complex<double> u1 = w * data[(i + k + len / 2) * stride];
+				data[(i + k) * stride] = u0 + u1;
+				data[(i + k + len / 2) * stride] = u0 - u1;
+				w *= step;
+			}
+		}
+	}
+}
+
+FFTSolver::FFTSolver(int gridDim) : gridDim(gridDim), initialized(false), current(0)
+{
+	if (gridDim < 2 || (gridDim & (gridDim - 1)) != 0){
+		throw std::runtime_error("FFTSolver needs a power of 2 grid dimension");
+	}
+}
+void FFTSolver::init(tcl::Context &context){
+	if (initialized){
+		return;
+	}
+	fftProgram = context.loadProgram("../res/fft_kernels.cl");
+	fft_load_real = cl::Kernel(fftProgram, "fft_load_real");
+	fft_radix2 = cl::Kernel(fftProgram, "fft_radix2");
+	fft_poisson_divide = cl::Kernel(fftProgram, "fft_poisson_divide");
+	fft_store_real = cl::Kernel(fftProgram, "fft_store_real");
+
+	size_t size = gridDim * gridDim * 2 * sizeof(float);
+	work[0] = context.buffer(CL_MEM_READ_WRITE, size, nullptr);
+	work[1] = context.buffer(CL_MEM_READ_WRITE, size, nullptr);
+	fft_poisson_divide.setArg(1, 1.f / (gridDim * gridDim));
+	initialized = true;
+}
+void FFTSolver::solve(tcl::Context &context, const cl::Buffer &b, cl::Buffer &x){
+	cl::NDRange cells(gridDim * gridDim);
+	current = 0;
+	fft_load_real.setArg(0, b);
+	fft_load_real.setArg(1, work[current]);
+	context.runNDKernel(fft_load_real, cells, cl::NullRange, cl::NullRange);
+
+	transform(context, -1.f);
+	fft_poisson_divide.setArg(0, work[current]);
+	context.runNDKernel(fft_poisson_divide, cl::NDRange(gridDim, gridDim), cl::NullRange, cl::NullRange);
+	transform(context, 1.f);
+
+	fft_store_real.setArg(0, work[current]);
+	fft_store_real.setArg(1, x);
+	context.runNDKernel(fft_store_real, cells, cl::NullRange, cl::NullRange);
+}
+void FFTSolver::solveHost(const std::vector<float> &b, std::vector<float> &x) const {
+	int n = gridDim;
+	std::vector<std::complex<double>> data(b.begin(), b.end());
+	//Rows then columns
+	for (int i = 0; i < n; ++i){
+		fft(&data[i * n], n, 1, -1.0);
+	}
+	for (int i = 0; i < n; ++i){
+		fft(&data[i], n, n, -1.0);
+	}
+	const double pi = 3.14159265358979323846;
+	for (int ky = 0; ky < n; ++ky){
+		for (int kx = 0; kx < n; ++kx){
+			double eigen = 4.0 - 2.0 * std::cos(2.0 * pi * kx / n) - 2.0 * std::cos(2.0 * pi * ky / n);
+			//The zero mode is the Laplacian's null space, dropping it gives the zero mean solution
+			data[kx + ky * n] = (kx == 0 && ky == 0) ? 0.0 : data[kx + ky * n] / (eigen * n * n);
+		}
+	}
+	for (int i = 0; i < n; ++i){
+		fft(&data[i * n], n, 1, 1.0);
+	}
+	for (int i = 0; i < n; ++i){
+		fft(&data[i], n, n, 1.0);
+	}
+	x.resize(n * n);
+	for (int i = 0; i < n * n; ++i){
+		x[i] = static_cast<float>(data[i].real());
+	}
+}
+int FFTSolver::getGridDim() const {
+	return gridDim;
+}
+void FFTSolver::transform(tcl::Context &context, float sign){
+	fft_radix2.setArg(3, sign);
+	for (int axis = 0; axis < 2; ++axis){
+		fft_radix2.setArg(4, axis);
+		for (int p = 1; p < gridDim; p *= 2){
+			fft_radix2.setArg(0, work[current]);
+			fft_radix2.setArg(1, work[1 - current]);
+			fft_radix2.setArg(2, p);
+			context.runNDKernel(fft_radix2, cl::NDRange(gridDim / 2, gridDim), cl::NullRange, cl::NullRange);
+			current = 1 - current;
+		}
+	}
+}
@@ -0,0 +1,46 @@
+#include <vector>
+#include <cmath>
+#include "sparsematrix.h"
+#include "fluidsystem.h"
+
+int cellNumber(int x, int y, int dim){
+	if (x < 0){
+		x += dim * (std::abs(x / dim) + 1);
+	}
+	if (y < 0){
+		y += dim * (std::abs(y / dim) + 1);
+	}
+	return x % dim + (y % dim) * dim;
+}
+void cellPos(int n, int &x, int &y, int dim){
+	x = n % dim;
+	y = (n - x) / dim;
+}
+SparseMatrix<float> createInteractionMatrix(int dim){
+	std::vector<MatrixElement<float>> elems;
+	int nCells = dim * dim;
+	elems.reserve(5 * nCells);
+	for (int i = 0; i < nCells; ++i){
+		//In the matrix all diagonal entires are 4 and neighbor cells are -1
+		elems.push_back(MatrixElement<float>(i, i, 4));
+		int x, y;
+		cellPos(i, x, y, dim);
+		elems.push_back(MatrixElement<float>(i, cellNumber(x - 1, y, dim), -1));
+		elems.push_back(MatrixElement<float>(i, cellNumber(x + 1, y, dim), -1));
+		elems.push_back(MatrixElement<float>(i, cellNumber(x, y - 1, dim), -1));
+		elems.push_back(MatrixElement<float>(i, cellNumber(x, y + 1, dim), -1));
+	}
+	return SparseMatrix<float>(std::move(elems), nCells, true);
+}
+std::vector<float> createFluidRHS(int n){
+	std::vector<float> b(n);
+	float mean = 0;
+	for (int i = 0; i < n; ++i){
+		b[i] = std::sin(0.37f * i);
+		mean += b[i] / n;
+	}
+	for (float &f : b){
+		f -= mean;
+	}
+	return b;
+}
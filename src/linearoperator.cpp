@@ -0,0 +1,417 @@
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <stdexcept>
+#include <climits>
+#include <cmath>
+#include "tinycl.h"
+#include "sparsematrix.h"
+#include "linearoperator.h"
+
+//Padding every row to the longest or each slice to its longest row is only worth
+//it if it adds at most this fraction of extra values to read
+static const float ELL_MAX_FILL = 1.2f;
+static const float SELL_MAX_FILL = 1.5f;
+//The SELL layout sorts rows in windows of this many slices
+static const int SELL_SIGMA_SLICES = 8;
+
+//Find the # of values stored in the SELL layout for some row lengths, including padding
+static long long sellSize(std::vector<int> lengths, int c, int sigma){
+	int n = lengths.size();
+	for (int i = 0; i < n; i += sigma){
+		std::sort(lengths.begin() + i, lengths.begin() + std::min(i + sigma, n), std::greater<int>());
+	}
+	long long size = 0;
+	//After sorting the first row of each slice is its longest
+	for (int i = 0; i < n; i += c){
+		size += static_cast<long long>(lengths[i]) * c;
+	}
+	return size;
+}
+
+//Check if every row of a CSR matrix sums to 0 within float rounding of the row's magnitude.
+//If only the upper half is stored each off diagonal element also counts toward the row of its column
+static bool rowsSumToZero(const std::vector<int> &rowPtr, const std::vector<int> &col,
+	const std::vector<float> &val, bool upper)
+{
+	int n = rowPtr.size() - 1;
+	std::vector<double> sum(n, 0.0), magnitude(n, 0.0);
+	for (int i = 0; i < n; ++i){
+		for (int j = rowPtr[i]; j < rowPtr[i + 1]; ++j){
+			sum[i] += val[j];
+			magnitude[i] += std::abs(val[j]);
+			if (upper && col[j] != i){
+				sum[col[j]] += val[j];
+				magnitude[col[j]] += std::abs(val[j]);
+			}
+		}
+	}
+	for (int i = 0; i < n; ++i){
+		if (std::abs(sum[i]) > 1e-6 * magnitude[i]){
+			return false;
+		}
+	}
+	return n > 0;
+}
+
+//Run f(begin, end) on threads threads, each given an even block of the n rows
+static void parallelRows(int n, int threads, const std::function<void(int, int, int)> &f){
+	std::vector<std::thread> workers;
+	for (int t = 1; t < threads; ++t){
+		workers.emplace_back(f, t, static_cast<long long>(n) * t / threads,
+			static_cast<long long>(n) * (t + 1) / threads);
+	}
+	f(0, 0, n / threads);
+	for (std::thread &w : workers){
+		w.join();
+	}
+}
+
+SparseOperator::SparseOperator(const SparseMatrix<float> &mat, FORMAT format, int sliceHeight)
+	: dimensions(mat.dim), format(format), sliceHeight(sliceHeight), ellWidth(0), stored(0),
+	initialized(false), csrUploaded(false), zeroRowSums(false)
+{
+	//A half stored matrix stays half stored on the device unless another format is asked for
+	if (this->format == FORMAT::AUTO && mat.upper){
+		this->format = FORMAT::SYMMETRIC;
+	}
+	if (this->format == FORMAT::SYMMETRIC){
+		if (!mat.symmetric){
+			throw std::runtime_error("SparseOperator's SYMMETRIC format needs a symmetric matrix");
+		}
+		mat.getUpperCSR(rowPtr, col, val);
+		stored = val.size();
+		zeroRowSums = rowsSumToZero(rowPtr, col, val, true);
+		return;
+	}
+	stored = mat.nonZeros();
+	rowPtr.resize(mat.dim + 1);
+	col.resize(stored);
+	val.resize(stored);
+	mat.getCSR(&rowPtr[0], &col[0], &val[0]);
+	zeroRowSums = rowsSumToZero(rowPtr, col, val, false);
+	std::vector<int> lengths = mat.rowLengths();
+	if (this->format == FORMAT::AUTO){
+		this->format = selectFormat(lengths, sliceHeight);
+	}
+	if (this->format == FORMAT::ELL){
+		ellWidth = lengths.empty() ? 0 : *std::max_element(lengths.begin(), lengths.end());
+		stored = dimensions * ellWidth;
+		fmtCol.resize(stored);
+		fmtVal.resize(stored);
+		mat.getELL(ellWidth, &fmtCol[0], &fmtVal[0]);
+	}
+	else if (this->format == FORMAT::SELL){
+		mat.getSELL(sliceHeight, SELL_SIGMA_SLICES * sliceHeight, slicePtr, perm, fmtCol, fmtVal);
+		stored = fmtVal.size();
+	}
+}
+SparseOperator::SparseOperator(tcl::Context &context, int dim, const std::function<int(int)> &rowLength,
+	const std::function<void(int, int*, float*)> &fillRow, int threads)
+	: dimensions(dim), format(FORMAT::CSR), sliceHeight(0), ellWidth(0), stored(0),
+	assembledQueue(context.mQueue), initialized(false), csrUploaded(false), zeroRowSums(false)
+{
+	if (threads <= 0){
+		threads = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+	}
+	threads = std::max(std::min(threads, dim / 1024), 1);
+#ifdef CL_VERSION_1_2
+	cl_map_flags mapFlags = CL_MAP_WRITE_INVALIDATE_REGION;
+#else
+	cl_map_flags mapFlags = CL_MAP_WRITE;
+#endif
+	//Count the rows into rowPtr[i + 1], each thread also sums its block so the scan can
+	//be done by scanning the block sums then each block in parallel
+	buffers[MATRIX::ROW_PTR] = context.buffer(CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, (dim + 1) * sizeof(int), nullptr);
+	int *rows = static_cast<int*>(context.mQueue.enqueueMapBuffer(buffers[MATRIX::ROW_PTR], CL_TRUE, mapFlags,
+		0, (dim + 1) * sizeof(int)));
+	std::vector<long long> blockSums(threads + 1, 0);
+	parallelRows(dim, threads, [&](int t, int begin, int end){
+		long long sum = 0;
+		for (int i = begin; i < end; ++i){
+			rows[i + 1] = rowLength(i);
+			sum += rows[i + 1];
+		}
+		blockSums[t + 1] = sum;
+	});
+	for (int t = 0; t < threads; ++t){
+		blockSums[t + 1] += blockSums[t];
+	}
+	if (blockSums[threads] > INT_MAX){
+		context.mQueue.enqueueUnmapMemObject(buffers[MATRIX::ROW_PTR], rows);
+		throw std::runtime_error("Too many elements to assemble a SparseOperator indexed by int");
+	}
+	rows[0] = 0;
+	parallelRows(dim, threads, [&](int t, int begin, int end){
+		int offset = static_cast<int>(blockSums[t]);
+		for (int i = begin; i < end; ++i){
+			offset += rows[i + 1];
+			rows[i + 1] = offset;
+		}
+	});
+	stored = static_cast<int>(blockSums[threads]);
+
+	//Fill the rows straight into the mapped column and value buffers
+	buffers[MATRIX::COL] = context.buffer(CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR,
+		std::max(stored, 1) * sizeof(int), nullptr);
+	buffers[MATRIX::VAL] = context.buffer(CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR,
+		std::max(stored, 1) * sizeof(float), nullptr);
+	int *cols = static_cast<int*>(context.mQueue.enqueueMapBuffer(buffers[MATRIX::COL], CL_TRUE, mapFlags,
+		0, std::max(stored, 1) * sizeof(int)));
+	float *vals = static_cast<float*>(context.mQueue.enqueueMapBuffer(buffers[MATRIX::VAL], CL_TRUE, mapFlags,
+		0, std::max(stored, 1) * sizeof(float)));
+	parallelRows(dim, threads, [&](int, int begin, int end){
+		for (int i = begin; i < end; ++i){
+			fillRow(i, cols + rows[i], vals + rows[i]);
+		}
+	});
+	context.mQueue.enqueueUnmapMemObject(buffers[MATRIX::ROW_PTR], rows);
+	context.mQueue.enqueueUnmapMemObject(buffers[MATRIX::COL], cols);
+	context.mQueue.enqueueUnmapMemObject(buffers[MATRIX::VAL], vals);
+}
+int SparseOperator::dim() const {
+	return dimensions;
+}
+void SparseOperator::init(tcl::Context &context, const cl::Program &program){
+	if (initialized){
+		return;
+	}
+	csr_mat_vec_mult = cl::Kernel(program, "csr_mat_vec_mult");
+	csr_block_mat_vec_mult = cl::Kernel(program, "csr_block_mat_vec_mult");
+	if (format == FORMAT::SYMMETRIC){
+		zero_vector = cl::Kernel(program, "zero_vector");
+		block_zero_active = cl::Kernel(program, "block_zero_active");
+		csr_sym_mat_vec_mult = cl::Kernel(program, "csr_sym_mat_vec_mult");
+		csr_sym_block_mat_vec_mult = cl::Kernel(program, "csr_sym_block_mat_vec_mult");
+	}
+	if (format == FORMAT::CSR || format == FORMAT::SYMMETRIC){
+		uploadCSR(context);
+	}
+	else {
+		buffers[MATRIX::FMT_COL] = context.buffer(CL_MEM_READ_ONLY, fmtCol.size() * sizeof(int), &fmtCol[0], 0, true);
+		buffers[MATRIX::FMT_VAL] = context.buffer(CL_MEM_READ_ONLY, fmtVal.size() * sizeof(float), &fmtVal[0], 0, true);
+	}
+	if (format == FORMAT::ELL){
+		ell_mat_vec_mult = cl::Kernel(program, "ell_mat_vec_mult");
+		ell_mat_vec_mult.setArg(0, ellWidth);
+		ell_mat_vec_mult.setArg(1, buffers[MATRIX::FMT_COL]);
+		ell_mat_vec_mult.setArg(2, buffers[MATRIX::FMT_VAL]);
+	}
+	else if (format == FORMAT::SELL){
+		buffers[MATRIX::SLICE_PTR] = context.buffer(CL_MEM_READ_ONLY, slicePtr.size() * sizeof(int), &slicePtr[0], 0, true);
+		buffers[MATRIX::PERM] = context.buffer(CL_MEM_READ_ONLY, perm.size() * sizeof(int), &perm[0], 0, true);
+		sell_mat_vec_mult = cl::Kernel(program, "sell_mat_vec_mult");
+		sell_mat_vec_mult.setArg(0, dimensions);
+		sell_mat_vec_mult.setArg(1, sliceHeight);
+		sell_mat_vec_mult.setArg(2, buffers[MATRIX::SLICE_PTR]);
+		sell_mat_vec_mult.setArg(3, buffers[MATRIX::PERM]);
+		sell_mat_vec_mult.setArg(4, buffers[MATRIX::FMT_COL]);
+		sell_mat_vec_mult.setArg(5, buffers[MATRIX::FMT_VAL]);
+	}
+	//The uploads block, so the device has its own copy now
+	std::vector<int>().swap(fmtCol);
+	std::vector<float>().swap(fmtVal);
+	std::vector<int>().swap(slicePtr);
+	std::vector<int>().swap(perm);
+	initialized = true;
+}
+void SparseOperator::apply(tcl::Context &context, const cl::Buffer &in, cl::Buffer &out){
+	switch (format){
+		case FORMAT::ELL:
+			ell_mat_vec_mult.setArg(3, in);
+			ell_mat_vec_mult.setArg(4, out);
+			context.runNDKernel(ell_mat_vec_mult, cl::NDRange(dimensions), cl::NullRange, cl::NullRange);
+			break;
+		case FORMAT::SELL:
+			sell_mat_vec_mult.setArg(6, in);
+			sell_mat_vec_mult.setArg(7, out);
+			//A work group per slice so the rows of a slice run in lock step
+			context.runNDKernel(sell_mat_vec_mult,
+				cl::NDRange((dimensions + sliceHeight - 1) / sliceHeight * sliceHeight),
+				cl::NDRange(sliceHeight), cl::NullRange);
+			break;
+		case FORMAT::SYMMETRIC:
+			//The transposed half is added into out atomically so it has to start at zero
+			zero_vector.setArg(0, out);
+			context.runNDKernel(zero_vector, cl::NDRange(dimensions), cl::NullRange, cl::NullRange);
+			csr_sym_mat_vec_mult.setArg(3, in);
+			csr_sym_mat_vec_mult.setArg(4, out);
+			context.runNDKernel(csr_sym_mat_vec_mult, cl::NDRange(dimensions), cl::NullRange, cl::NullRange);
+			break;
+		default:
+			csr_mat_vec_mult.setArg(3, in);
+			csr_mat_vec_mult.setArg(4, out);
+			context.runNDKernel(csr_mat_vec_mult, cl::NDRange(dimensions), cl::NullRange, cl::NullRange);
+			break;
+	}
+}
+
+void SparseOperator::applyBlock(tcl::Context &context, const cl::Buffer &in, cl::Buffer &out, int k,
+	const cl::Buffer &active)
+{
+	uploadCSR(context);
+	if (format == FORMAT::SYMMETRIC){
+		block_zero_active.setArg(0, active);
+		block_zero_active.setArg(1, out);
+		context.runNDKernel(block_zero_active, cl::NDRange(k, dimensions), cl::NullRange, cl::NullRange);
+		csr_sym_block_mat_vec_mult.setArg(3, active);
+		csr_sym_block_mat_vec_mult.setArg(4, in);
+		csr_sym_block_mat_vec_mult.setArg(5, out);
+		context.runNDKernel(csr_sym_block_mat_vec_mult, cl::NDRange(k, dimensions), cl::NullRange, cl::NullRange);
+		return;
+	}
+	csr_block_mat_vec_mult.setArg(3, active);
+	csr_block_mat_vec_mult.setArg(4, in);
+	csr_block_mat_vec_mult.setArg(5, out);
+	context.runNDKernel(csr_block_mat_vec_mult, cl::NDRange(k, dimensions), cl::NullRange, cl::NullRange);
+}
+void SparseOperator::applyHost(const std::vector<double> &in, std::vector<double> &out) const {
+	if (rowPtr.empty()){
+		readCSR();
+	}
+	if (format == FORMAT::SYMMETRIC){
+		std::fill(out.begin(), out.begin() + dimensions, 0.0);
+		for (int i = 0; i < dimensions; ++i){
+			double sum = 0;
+			for (int j = rowPtr[i]; j < rowPtr[i + 1]; ++j){
+				sum += val[j] * in[col[j]];
+				if (col[j] != i){
+					out[col[j]] += val[j] * in[i];
+				}
+			}
+			out[i] += sum;
+		}
+		return;
+	}
+	for (int i = 0; i < dimensions; ++i){
+		double sum = 0;
+		for (int j = rowPtr[i]; j < rowPtr[i + 1]; ++j){
+			sum += val[j] * in[col[j]];
+		}
+		out[i] = sum;
+	}
+}
+
+LaplacianOperator::LaplacianOperator(int gridDim) : gridDim(gridDim), initialized(false)
+{}
+int LaplacianOperator::dim() const {
+	return gridDim * gridDim;
+}
+void LaplacianOperator::init(tcl::Context&, const cl::Program &program){
+	if (initialized){
+		return;
+	}
+	laplacian_mat_vec_mult = cl::Kernel(program, "laplacian_mat_vec_mult");
+	laplacian_block_mat_vec_mult = cl::Kernel(program, "laplacian_block_mat_vec_mult");
+	initialized = true;
+}
+void LaplacianOperator::apply(tcl::Context &context, const cl::Buffer &in, cl::Buffer &out){
+	laplacian_mat_vec_mult.setArg(0, in);
+	laplacian_mat_vec_mult.setArg(1, out);
+	context.runNDKernel(laplacian_mat_vec_mult, cl::NDRange(gridDim, gridDim), cl::NullRange, cl::NullRange);
+}
+void LaplacianOperator::applyBlock(tcl::Context &context, const cl::Buffer &in, cl::Buffer &out, int k,
+	const cl::Buffer &active)
+{
+	laplacian_block_mat_vec_mult.setArg(0, active);
+	laplacian_block_mat_vec_mult.setArg(1, in);
+	laplacian_block_mat_vec_mult.setArg(2, out);
+	context.runNDKernel(laplacian_block_mat_vec_mult, cl::NDRange(k, gridDim, gridDim), cl::NullRange, cl::NullRange);
+}
+void LaplacianOperator::applyHost(const std::vector<double> &in, std::vector<double> &out) const {
+	for (int y = 0; y < gridDim; ++y){
+		int down = (y + gridDim - 1) % gridDim;
+		int up = (y + 1) % gridDim;
+		for (int x = 0; x < gridDim; ++x){
+			int left = (x + gridDim - 1) % gridDim;
+			int right = (x + 1) % gridDim;
+			out[x + y * gridDim] = 4.0 * in[x + y * gridDim] - in[left + y * gridDim] - in[right + y * gridDim]
+				- in[x + down * gridDim] - in[x + up * gridDim];
+		}
+	}
+}
+bool SparseOperator::localSolveForm(tcl::Context &context, int &gridDim, cl::Buffer &rowPtr, cl::Buffer &col,
+	cl::Buffer &val)
+{
+	if (format == FORMAT::SYMMETRIC){
+		return false;
+	}
+	uploadCSR(context);
+	gridDim = 0;
+	rowPtr = buffers[MATRIX::ROW_PTR];
+	col = buffers[MATRIX::COL];
+	val = buffers[MATRIX::VAL];
+	return true;
+}
+bool SparseOperator::constantNullspace() const {
+	return zeroRowSums;
+}
+SparseOperator::FORMAT SparseOperator::getFormat() const {
+	return format;
+}
+int SparseOperator::storedValues() const {
+	return stored;
+}
+SparseOperator::FORMAT SparseOperator::selectFormat(const std::vector<int> &lengths, int sliceHeight){
+	long long nVals = 0;
+	int maxLength = 0;
+	for (int l : lengths){
+		nVals += l;
+		maxLength = std::max(maxLength, l);
+	}
+	if (nVals == 0){
+		return FORMAT::CSR;
+	}
+	if (static_cast<long long>(maxLength) * lengths.size() <= ELL_MAX_FILL * nVals){
+		return FORMAT::ELL;
+	}
+	if (sellSize(lengths, sliceHeight, SELL_SIGMA_SLICES * sliceHeight) <= SELL_MAX_FILL * nVals){
+		return FORMAT::SELL;
+	}
+	return FORMAT::CSR;
+}
+void SparseOperator::uploadCSR(tcl::Context &context){
+	if (csrUploaded){
+		return;
+	}
+	//An assembled operator already has its buffers
+	if (!rowPtr.empty()){
+		buffers[MATRIX::ROW_PTR] = context.buffer(CL_MEM_READ_ONLY, rowPtr.size() * sizeof(int), &rowPtr[0]);
+		buffers[MATRIX::COL] = context.buffer(CL_MEM_READ_ONLY, col.size() * sizeof(int), &col[0]);
+		buffers[MATRIX::VAL] = context.buffer(CL_MEM_READ_ONLY, val.size() * sizeof(float), &val[0]);
+	}
+	for (int i = 0; i < 3; ++i){
+		if (format == FORMAT::SYMMETRIC){
+			csr_sym_mat_vec_mult.setArg(i, buffers[i]);
+			csr_sym_block_mat_vec_mult.setArg(i, buffers[i]);
+		}
+		else {
+			csr_mat_vec_mult.setArg(i, buffers[i]);
+			csr_block_mat_vec_mult.setArg(i, buffers[i]);
+		}
+	}
+	csrUploaded = true;
+}
+void SparseOperator::readCSR() const {
+	rowPtr.resize(dimensions + 1);
+	col.resize(stored);
+	val.resize(stored);
+	assembledQueue.enqueueReadBuffer(buffers[MATRIX::ROW_PTR], CL_FALSE, 0, rowPtr.size() * sizeof(int), &rowPtr[0]);
+	if (stored > 0){
+		assembledQueue.enqueueReadBuffer(buffers[MATRIX::COL], CL_FALSE, 0, col.size() * sizeof(int), &col[0]);
+		assembledQueue.enqueueReadBuffer(buffers[MATRIX::VAL], CL_FALSE, 0, val.size() * sizeof(float), &val[0]);
+	}
+	assembledQueue.finish();
+}
+bool LaplacianOperator::localSolveForm(tcl::Context&, int &width, cl::Buffer&, cl::Buffer&, cl::Buffer&){
+	//The stencil is applied from the grid layout so there's no matrix to pass
+	width = gridDim;
+	return true;
+}
+bool LaplacianOperator::constantNullspace() const {
+	return true;
+}
+int LaplacianOperator::getGridDim() const {
+	return gridDim;
+}
@@ -2,6 +2,14 @@
 #include <iomanip>
 #include <chrono>
 #include <cmath>
+#include <array>
+#include <memory>
+#include <string>
+#include <numeric>
+#include <limits>
+#include <algorithm>
+#include <fstream>
+#include <cstdio>
 #include <GL/glew.h>
 #include <glm/glm.hpp>
 #include <glm/ext.hpp>
@@ -10,6 +18,15 @@
 #include "simplefluid.h"
 #include "tinycl.h"
 #include "window.h"
+#include "multigrid.h"
+#include "batchcgsolver.h"
+#include "cpucgsolver.h"
+#include "fftsolver.h"
+#include "relaxationsolver.h"
+#include "mtxloader.h"
+#include "reordering.h"
+#include "pressuresolver.h"
+#include "fluidsystem.h"
 
 void runCGTests();
 //Test CG solve on the identity, just a sanity check
@@ -18,8 +35,74 @@ void testCGSolveIdentity();
 void testCGSolveWiki();
 //Test CG for consistency/larger matrices, ie. as it'll be used in the fluid sim
 void testCGSim();
+//Check that pipelined CG gives the same residual history as classic CG
+void testCGPipelined();
+//Time solves of a dim x dim fluid system while checking for convergence at different intervals
+void testCGCheckInterval(int dim);
+//Solve a series of slowly changing dim x dim fluid systems, like consecutive frames of the sim,
+//starting from zero, the previous solution and an extrapolated guess
+void testCGWarmStart(int dim);
+//Solve a dim x dim fluid system to a tolerance float CG has trouble reaching, with and
+//without mixed precision iterative refinement
+void testCGRefinement(int dim);
+//Compare the single work group solve against the usual kernel per step solve on a dim x dim
+//fluid system, for both the matrix-free and the sparse matrix operator
+void testCGLocalSolve(int dim);
+//Solve a series of dim x dim fluid systems of growing size under a few time budgets with a
+//tolerance relative to ||b||, checking the solves stay in budget and report when they're cut short
+void testCGBudget(int dim);
+//Solve a dim x dim fluid system whose b has a nonzero mean with and without projecting out the
+//constant nullspace, for the kernel per step and single work group solves and multigrid
+//preconditioned CG, checking the projected solves converge to a mean-free solution
+void testCGNullspace(int dim);
+//Check the context's reductions and exclusive scans of n long float and int vectors against the
+//host, through a device buffer and through an event, and reusing the cached kernels and scratch
+void testReduceScan(int n);
+//Compare solving k dim x dim fluid systems as one batch against k separate solves
+void benchBatchCG(int dim);
+//Compare iterations and time of unpreconditioned, Jacobi and MIC(0) preconditioned CG
+//on a dim x dim fluid system and the bcsstk01 Matrix Market system
+void benchPreconditioners(int dim);
+//Compare CG, multigrid preconditioned CG and standalone multigrid on fluid systems from
+//16x16 up to maxDim x maxDim
+void benchMultigrid(int maxDim);
+//Compare the native multithreaded CPU solver against OpenCL CG on the CPU and GPU
+//on a dim x dim fluid system and the bcsstk01 Matrix Market system
+void benchCPUBackend(int dim);
+//Check the FFT pressure solver on the device and host against CG on a dim x dim fluid
+//system and compare the time of the solves
+void testFFTSolver(int dim);
+//Compare the residual and time of fixed budgets of SOR and Chebyshev sweeps against CG
+//on a dim x dim fluid system
+void benchRelaxation(int dim);
+//Collect timed solve stats over a series of changing dim x dim fluid systems, like frames
+//of the sim, and check them against the residual history
+void testSolveStats(int dim);
+//Tune the pressure solver for a dim x dim grid without the cache, printing each solver's
+//measurements, then check a second selection through a scratch cache file reuses the choice
+void testPressureTuner(int dim);
+//Compare loading a Matrix Market file with the stream parser, the fast loader and the fast
+//loader's binary cache, on the file or a dim x dim fluid system written out as one
+void benchMatrixLoad(const std::string &file);
+void benchMatrixLoad(int dim);
+//Compare building the dim x dim fluid system as a SparseMatrix and uploading it against
+//assembling it in parallel straight into device buffers, and check the products match
+void benchAssembly(int dim);
+//Check the products and CG solves of half stored symmetric matrices against full storage
+//on a dim x dim fluid system and the bcsstk01 Matrix Market system, and compare their timing
+void testSymmetricStorage(int dim);
+//Report the bandwidth, profile and CSR mat * vec time of a shuffled dim x dim fluid system and
+//the bcsstk01 system as given and reordered by RCM and nested dissection, and check reordered
+//CG solves give the same solution
+void benchReordering(int dim);
 //Give a stress test to the solver with a large fluid grid and solve it multiple times
 void testCGStress(int dim);
+//Compare the COO and CSR sparse matrix * vector kernels and the matrix-free Laplacian
+//on fluid systems from 16x16 to 512x512
+void benchSparseMatVec();
+//Report the GFLOP/s of the CSR, ELL and SELL sparse matrix * vector kernels and the format
+//picked automatically on fluid systems from 16x16 to 512x512 and the bcsstk01 system
+void benchSparseFormats();
 //Test the velocity divergence kernel
 void testVelocityDivergence();
 //Test the pressure subtraction to update the velocity field
@@ -33,8 +116,11 @@ void testVXFieldAdvect();
 void testVYFieldAdvect();
 
 int main(int argc, char **argv){
-	testCGStress(16);
-
+	//Run the solver tests instead of the sim with --test
+	if (argc > 1 && std::string(argv[1]) == "--test"){
+		runCGTests();
+		return 0;
+	}
 	SDL sdl(SDL_INIT_EVERYTHING);
 	Window win("Fluid!", 640, 480);
 	//16 is the dimensions of the textures we're loading
@@ -51,8 +137,32 @@ void runCGTests(){
 	testCGSolveWiki();
 	std::cout << "Using CG to solve an 16x16 fluid system\n";
 	testCGSim();
-	//Warning: be very wary of the memory usage of higher grid sizes.
+	std::cout << "Comparing pipelined CG against classic CG on a 16x16 fluid system\n";
+	testCGPipelined();
+	std::cout << "Checking the reductions and exclusive scans against the host\n";
+	testReduceScan(5000);
 	int dim = 32;
+	std::cout << "Checking for convergence at different intervals on a " << dim << "x" << dim << " fluid system\n";
+	testCGCheckInterval(dim);
+	std::cout << "Warm starting CG on a series of " << dim << "x" << dim << " fluid systems\n";
+	testCGWarmStart(dim);
+	std::cout << "Using mixed precision iterative refinement on a " << dim << "x" << dim << " fluid system\n";
+	testCGRefinement(dim);
+	std::cout << "Comparing the single work group solve on a " << dim << "x" << dim << " fluid system\n";
+	testCGLocalSolve(dim);
+	std::cout << "Solving " << dim << "x" << dim << " and larger fluid systems under time budgets\n";
+	testCGBudget(dim);
+	std::cout << "Projecting out the nullspace of a " << dim << "x" << dim << " fluid system\n";
+	testCGNullspace(dim);
+	std::cout << "Checking the FFT solver on a " << dim << "x" << dim << " fluid system\n";
+	testFFTSolver(dim);
+	std::cout << "Collecting solve stats over a series of " << dim << "x" << dim << " fluid systems\n";
+	testSolveStats(dim);
+	std::cout << "Checking half stored symmetric matrices on a " << dim << "x" << dim << " fluid system\n";
+	testSymmetricStorage(dim);
+	std::cout << "Tuning the pressure solver for a " << dim << "x" << dim << " grid\n";
+	testPressureTuner(dim);
+	//Warning: be very wary of the memory usage of higher grid sizes.
 	std::cout << "Stress testing CG with multiple solves of a "
 		<< dim << "x" << dim << " system\n";
 	testCGStress(dim);
@@ -70,6 +180,7 @@ void testCGSolveIdentity(){
 
 	//Make sure updateB works properly too
 	CGSolver solver(matrix, std::vector<float>(), context, 10);
+	solver.setVerbose(true);
 	solver.updateB(b);
 	solver.solve();
 	std::vector<float> x = solver.getResult();
@@ -102,6 +213,7 @@ void testCGSolveWiki(){
 	b.push_back(2);
 
 	CGSolver solver(matrix, b, context, 100);
+	solver.setVerbose(true);
 	solver.solve();
 	std::vector<float> x = solver.getResult();
 	std::cout << "Wiki Result: ";
@@ -110,42 +222,29 @@ void testCGSolveWiki(){
 	}
 	std::cout << std::endl;
 }
-int cellNumber(int x, int y, int dim){
-	if (x < 0){
-		x += dim * (std::abs(x / dim) + 1);
-	}
-	if (y < 0){
-		y += dim * (std::abs(y / dim) + 1);
-	}
-	return x % dim + (y % dim) * dim;
-}
-void cellPos(int n, int &x, int &y, int dim){
-	x = n % dim;
-	y = (n - x) / dim;
-}
-SparseMatrix<float> createInteractionMatrix(int dim){
-	std::vector<MatrixElement<float>> elems;
-	int nCells = dim * dim;
-	for (int i = 0; i < nCells; ++i){
-		//In the matrix all diagonal entires are 4 and neighbor cells are -1
-		elems.push_back(MatrixElement<float>(i, i, 4));
-		int x, y;
-		cellPos(i, x, y, dim);
-		elems.push_back(MatrixElement<float>(i, cellNumber(x - 1, y, dim), -1));
-		elems.push_back(MatrixElement<float>(i, cellNumber(x + 1, y, dim), -1));
-		elems.push_back(MatrixElement<float>(i, cellNumber(x, y - 1, dim), -1));
-		elems.push_back(MatrixElement<float>(i, cellNumber(x, y + 1, dim), -1));
-	}
-	return SparseMatrix<float>(elems, dim, true);
+//Assemble the same matrix as createInteractionMatrix straight into device buffers
+std::shared_ptr<SparseOperator> createInteractionOperator(tcl::Context &context, int dim){
+	return std::make_shared<SparseOperator>(context, dim * dim, [](int){ return 5; },
+		[dim](int i, int *col, float *val){
+			int x, y;
+			cellPos(i, x, y, dim);
+			const int cells[5] = { i, cellNumber(x - 1, y, dim), cellNumber(x + 1, y, dim),
+				cellNumber(x, y - 1, dim), cellNumber(x, y + 1, dim) };
+			for (int j = 0; j < 5; ++j){
+				col[j] = cells[j];
+				val[j] = j == 0 ? 4.f : -1.f;
+			}
+		});
 }
 void testCGSim(){
 	tcl::Context context(tcl::DEVICE::GPU, false, false);
 	SparseMatrix<float> matrix = createInteractionMatrix(16);
 	std::vector<float> b;
-	for (int i = 0; i < 16; ++i){
+	for (int i = 0; i < matrix.dim; ++i){
 		b.push_back(i + 1);
 	}
 	CGSolver solver(matrix, b, context);
+	solver.setVerbose(true);
 	solver.solve();
 	std::vector<float> x = solver.getResult();
 	for (float f : x){
@@ -153,12 +252,818 @@ void testCGSim(){
 	}
 	std::cout << std::endl;
 }
+void testCGPipelined(){
+	tcl::Context context(tcl::DEVICE::GPU, false, false);
+	SparseMatrix<float> matrix = createInteractionMatrix(16);
+	std::vector<float> b;
+	for (int i = 0; i < matrix.dim; ++i){
+		b.push_back(i % 16 - 7.5f);
+	}
+	CGSolver solver(matrix, b, context);
+	solver.solve();
+	std::vector<float> classic = solver.getResidualHistory();
+	std::vector<float> classicX = solver.getResult();
+
+	solver.setMode(CGSolver::MODE::PIPELINED);
+	solver.solve();
+	std::vector<float> pipelined = solver.getResidualHistory();
+	std::vector<float> pipelinedX = solver.getResult();
+
+	if (classic.size() != pipelined.size()){
+		std::cout << "classic took " << classic.size() << " iterations but pipelined took "
+			<< pipelined.size() << "\n";
+	}
+	//The residuals shrink by orders of magnitude so compare them relative to the classic residual
+	float maxDiff = 0.f;
+	for (size_t i = 0; i < std::min(classic.size(), pipelined.size()); ++i){
+		maxDiff = std::max(maxDiff, std::abs(classic[i] - pipelined[i]) / std::max(classic[i], 1e-5f));
+	}
+	float maxXDiff = 0.f;
+	for (size_t i = 0; i < classicX.size(); ++i){
+		maxXDiff = std::max(maxXDiff, std::abs(classicX[i] - pipelinedX[i]));
+	}
+	std::cout << "max relative residual difference: " << maxDiff
+		<< ", max x difference: " << maxXDiff << std::endl;
+}
+void testCGCheckInterval(int dim){
+	tcl::Context context(tcl::DEVICE::GPU, false, false);
+	SparseMatrix<float> matrix = createInteractionMatrix(dim);
+	std::vector<float> b;
+	for (int i = 0; i < matrix.dim; ++i){
+		b.push_back(i % dim - (dim - 1) / 2.f);
+	}
+	CGSolver solver(matrix, b, context);
+	for (int spec = 0; spec < 2; ++spec){
+		for (int interval = 1; interval <= 32; interval *= 2){
+			solver.setConvergenceCheck(interval, spec == 1);
+			std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+			solver.solve();
+			std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+			std::cout << "check every " << interval << (spec == 1 ? " speculative" : "")
+				<< ": " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()
+				<< "us, " << solver.getResidualHistory().size() << " iterations, "
+				<< solver.getWastedIterations() << " wasted\n";
+		}
+	}
+	std::cout << std::endl;
+}
+void testCGWarmStart(int dim){
+	tcl::Context context(tcl::DEVICE::GPU, false, false);
+	const int frames = 20;
+	const char *names[] = { "zero", "previous", "extrapolated" };
+	CGSolver solver(std::make_shared<LaplacianOperator>(dim), std::vector<float>(), context);
+	for (int g = 0; g < 3; ++g){
+		solver.setInitialGuess(static_cast<CGSolver::GUESS>(g));
+		int total = 0;
+		for (int f = 0; f < frames; ++f){
+			//A zero sum wave drifting slowly across the grid
+			std::vector<float> b;
+			for (int i = 0; i < dim * dim; ++i){
+				b.push_back(std::sin(6.2831853f * (i % dim + 0.2f * f) / dim));
+			}
+			solver.updateB(b);
+			solver.solve();
+			total += solver.getResidualHistory().size();
+		}
+		std::cout << names[g] << " guess: " << total << " iterations over " << frames << " solves\n";
+	}
+	std::cout << std::endl;
+}
+void testCGRefinement(int dim){
+	tcl::Context context(tcl::DEVICE::GPU, false, false);
+	std::vector<float> b;
+	for (int i = 0; i < dim * dim; ++i){
+		b.push_back(100.f * std::sin(6.2831853f * (i % dim) / dim));
+	}
+	CGSolver solver(std::make_shared<LaplacianOperator>(dim), b, context, 4 * dim, 1e-6);
+	std::cout << "dot products accumulate in " << (solver.usesDoubleReductions() ? "double" : "float")
+		<< "\nwithout refinement:\n";
+	solver.solve();
+	std::cout << "with refinement:\n";
+	solver.setRefinement(10);
+	solver.solve();
+	std::cout << std::endl;
+}
+void testCGLocalSolve(int dim){
+	typedef std::chrono::high_resolution_clock clock;
+	tcl::Context context(tcl::DEVICE::GPU, false, false);
+	std::vector<float> b;
+	for (int i = 0; i < dim * dim; ++i){
+		b.push_back(std::sin(6.2831853f * (i % dim) / dim) * std::cos(6.2831853f * (i / dim) / dim));
+	}
+	const char *names[] = { "laplacian", "sparse matrix" };
+	for (int o = 0; o < 2; ++o){
+		std::shared_ptr<LinearOperator> op;
+		if (o == 0){
+			op = std::make_shared<LaplacianOperator>(dim);
+		}
+		else {
+			op = std::make_shared<SparseOperator>(createInteractionMatrix(dim));
+		}
+		CGSolver solver(op, b, context);
+		std::cout << names[o] << " operator" << (solver.usesLocalSolve() ? "" : " doesn't fit the local solve") << "\n";
+		std::vector<float> x[2];
+		for (int local = 1; local >= 0; --local){
+			solver.setLocalSolve(local == 1);
+			solver.solve();
+			const int runs = 20;
+			clock::time_point start = clock::now();
+			for (int i = 0; i < runs; ++i){
+				solver.solve();
+			}
+			clock::time_point end = clock::now();
+			x[local] = solver.getResult();
+			std::cout << (local == 1 && solver.usesLocalSolve() ? "single work group: " : "kernel per step: ")
+				<< std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / runs << "us per solve, "
+				<< solver.getStats() << "\n";
+		}
+		float maxDiff = 0;
+		for (size_t i = 0; i < x[0].size(); ++i){
+			maxDiff = std::max(maxDiff, std::abs(x[0][i] - x[1][i]));
+		}
+		std::cout << "max x difference: " << maxDiff << "\n";
+	}
+	std::cout << std::endl;
+}
+void testCGBudget(int dim){
+	tcl::Context context(tcl::DEVICE::GPU, false, false);
+	CGSolver solver(std::make_shared<LaplacianOperator>(dim), std::vector<float>(), context);
+	solver.setInitialGuess(CGSolver::GUESS::PREVIOUS);
+	const double budgets[] = { 0.5, 2, 10 };
+	for (double budget : budgets){
+		solver.setBudget(budget, 1e-5f);
+		SolveStatsSummary summary;
+		double worst = 0;
+		for (int f = 0; f < 30; ++f){
+			//A wave that grows and shifts over the frames, so ||b|| changes from frame to frame
+			std::vector<float> b;
+			for (int i = 0; i < dim * dim; ++i){
+				b.push_back((1.f + f) * std::sin(6.2831853f * (i % dim + 0.5f * f) / dim)
+					* std::cos(6.2831853f * (i / dim) / dim));
+			}
+			solver.updateB(b);
+			solver.solve();
+			summary.add(solver.getStats());
+			worst = std::max(worst, solver.getStats().wallTime);
+		}
+		std::cout << budget << "ms budget, " << solver.getIterationCost() << "ms per iteration, slowest solve "
+			<< worst << "ms: ";
+		summary.print(std::cout);
+	}
+	std::cout << std::endl;
+}
+void testCGNullspace(int dim){
+	tcl::Context context(tcl::DEVICE::GPU, false, false);
+	//A wave plus a constant, the constant is the part of b no x can match
+	std::vector<float> b;
+	double bMean = 0;
+	for (int i = 0; i < dim * dim; ++i){
+		b.push_back(0.5f + std::sin(6.2831853f * (i % dim) / dim) * std::cos(6.2831853f * (i / dim) / dim));
+		bMean += b.back();
+	}
+	bMean /= dim * dim;
+	LaplacianOperator host(dim);
+	const char *names[] = { "kernel per step", "single work group", "multigrid preconditioned" };
+	for (int m = 0; m < 3; ++m){
+		CGSolver solver(std::make_shared<LaplacianOperator>(dim), b, context, 1000);
+		solver.setLocalSolve(m == 1);
+		if (m == 2){
+			solver.setPreconditioner(std::make_shared<Multigrid>(dim));
+		}
+		for (int projected = 0; projected < 2; ++projected){
+			solver.setConstantNullspace(projected == 1);
+			solver.solve();
+			std::vector<float> x = solver.getResult();
+			//Check the residual against the mean-free part of b on the host
+			std::vector<double> xd(x.begin(), x.end()), ax(x.size());
+			host.applyHost(xd, ax);
+			double xMean = 0, rLen = 0;
+			for (size_t i = 0; i < x.size(); ++i){
+				xMean += x[i];
+				double ri = b[i] - bMean - ax[i];
+				rLen += ri * ri;
+			}
+			xMean /= x.size();
+			rLen = std::sqrt(rLen);
+			std::cout << names[m] << (projected ? " with" : " without") << " the nullspace: "
+				<< solver.getStats() << ", mean of x " << xMean << ", mean-free residual " << rLen << "\n";
+			if (projected && (!solver.getStats().converged || std::abs(xMean) > 1e-4 || rLen > 1e-4)){
+				std::cout << "Projected solve didn't reach a mean-free solution!\n";
+			}
+		}
+	}
+	std::cout << std::endl;
+}
+void testReduceScan(int n){
+	tcl::Context context(tcl::DEVICE::GPU, false, false);
+	std::vector<float> a, b;
+	std::vector<int> c;
+	for (int i = 0; i < n; ++i){
+		a.push_back(std::sin(0.37f * i) * (1 + i % 7));
+		b.push_back(std::cos(0.11f * i));
+		c.push_back(i % 13 - 4);
+	}
+	cl::Buffer aBuf = context.buffer(tcl::MEM::READ_ONLY, n * sizeof(float), &a[0]);
+	cl::Buffer bBuf = context.buffer(tcl::MEM::READ_ONLY, n * sizeof(float), &b[0]);
+	cl::Buffer cBuf = context.buffer(tcl::MEM::READ_ONLY, n * sizeof(int), &c[0]);
+	cl::Buffer results = context.buffer(tcl::MEM::READ_WRITE, 4 * sizeof(float), nullptr);
+
+	double sum = 0, dot = 0;
+	float maxVal = a[0], minVal = a[0];
+	for (int i = 0; i < n; ++i){
+		sum += a[i];
+		dot += static_cast<double>(a[i]) * b[i];
+		maxVal = std::max(maxVal, a[i]);
+		minVal = std::min(minVal, a[i]);
+	}
+	//Run everything twice so the second pass uses the cached kernels and scratch buffers
+	bool failed = false;
+	for (int pass = 0; pass < 2; ++pass){
+		context.reduce<float>(tcl::SUM, aBuf, n, results, 0);
+		context.reduce<float>(tcl::MAX, aBuf, n, results, 1);
+		context.reduce<float>(tcl::MIN, aBuf, n, results, 2);
+		context.reduce<float>(tcl::DOT, aBuf, n, results, 3, &bBuf);
+		float res[4];
+		context.readData(results, 4 * sizeof(float), res, 0, true);
+		//The dot product is also read back through an event to check that path
+		float eventDot = 0;
+		cl::Event done;
+		context.reduce<float>(tcl::DOT, aBuf, n, &eventDot, &done, &bBuf);
+		done.wait();
+		int intSum = 0;
+		context.reduce<int>(tcl::SUM, cBuf, n, &intSum, nullptr);
+		double tol = 1e-5 * n;
+		if (std::abs(res[0] - sum) > tol || res[1] != maxVal || res[2] != minVal
+			|| std::abs(res[3] - dot) > tol || std::abs(eventDot - dot) > tol
+			|| intSum != std::accumulate(c.begin(), c.end(), 0))
+		{
+			std::cout << "Reduction mismatch on pass " << pass << ": sum " << res[0] << " vs " << sum
+				<< ", max " << res[1] << " vs " << maxVal << ", min " << res[2] << " vs " << minVal
+				<< ", dot " << res[3] << " & " << eventDot << " vs " << dot << ", int sum " << intSum << "\n";
+			failed = true;
+		}
+	}
+
+	//Scan the ints with SUM and MAX, in place for MAX
+	cl::Buffer scanned = context.buffer(tcl::MEM::READ_WRITE, n * sizeof(int), nullptr);
+	cl::Buffer maxScan = context.buffer(tcl::MEM::READ_WRITE, n * sizeof(int), &c[0]);
+	context.exclusiveScan<int>(tcl::SUM, cBuf, scanned, n);
+	context.exclusiveScan<int>(tcl::MAX, maxScan, maxScan, n);
+	std::vector<int> sumOut(n), maxOut(n);
+	context.readData(scanned, n * sizeof(int), &sumOut[0], 0, true);
+	context.readData(maxScan, n * sizeof(int), &maxOut[0], 0, true);
+	int runSum = 0, runMax = std::numeric_limits<int>::min();
+	int mismatches = 0;
+	for (int i = 0; i < n; ++i){
+		if (sumOut[i] != runSum || maxOut[i] != runMax){
+			++mismatches;
+		}
+		runSum += c[i];
+		runMax = std::max(runMax, c[i]);
+	}
+	if (mismatches != 0){
+		std::cout << mismatches << " of " << n << " scanned elements don't match the host\n";
+		failed = true;
+	}
+	std::cout << "Reductions and scans of " << n << " elements " << (failed ? "failed" : "passed") << std::endl;
+}
+void benchBatchCG(int dim){
+	tcl::Context context(tcl::DEVICE::GPU, false, false);
+	SparseMatrix<float> matrix = createInteractionMatrix(dim);
+	CGSolver solver(matrix, std::vector<float>(), context);
+	for (int k = 1; k <= 16; k *= 2){
+		//Each system gets a wave of a different frequency, all summing to 0
+		std::vector<std::vector<float>> bs(k);
+		for (int j = 0; j < k; ++j){
+			for (int i = 0; i < matrix.dim; ++i){
+				bs[j].push_back(std::sin(6.2831853f * (j + 1) * (i % dim) / dim));
+			}
+		}
+		std::vector<std::vector<float>> separate;
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		for (int j = 0; j < k; ++j){
+			solver.updateB(bs[j]);
+			solver.solve();
+			separate.push_back(solver.getResult());
+		}
+		std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+		double separateTime = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0;
+
+		BatchCGSolver batch(matrix, k, context);
+		batch.updateB(BatchCGSolver::interleave(bs));
+		start = std::chrono::high_resolution_clock::now();
+		batch.solve();
+		std::vector<float> block = batch.getResult();
+		end = std::chrono::high_resolution_clock::now();
+		double batchTime = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0;
+
+		float maxDiff = 0.f;
+		for (int j = 0; j < k; ++j){
+			std::vector<float> x = BatchCGSolver::deinterleave(block, k, j);
+			for (size_t i = 0; i < x.size(); ++i){
+				maxDiff = std::max(maxDiff, std::abs(x[i] - separate[j][i]));
+			}
+		}
+		std::cout << k << " systems: separate " << separateTime << "ms, batched " << batchTime
+			<< "ms, speedup " << separateTime / batchTime << "x, max x difference " << maxDiff << "\n";
+	}
+	std::cout << std::endl;
+}
+//Run solves of the system without a preconditioner, with Jacobi and with MIC(0)
+void benchPreconditioners(const SparseMatrix<float> &matrix, const std::vector<float> &b,
+	tcl::Context &context)
+{
+	CGSolver solver(matrix, b, context, 2 * matrix.dim);
+	std::array<std::shared_ptr<Preconditioner>, 3> precons = {
+		nullptr, std::make_shared<JacobiPreconditioner>(matrix), std::make_shared<MIC0Preconditioner>(matrix)
+	};
+	std::array<std::string, 3> names = { "none", "Jacobi", "MIC(0)" };
+	for (int i = 0; i < 3; ++i){
+		solver.setPreconditioner(precons[i]);
+		//Solve once to get everything uploaded and compiled before timing
+		solver.solve();
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		solver.solve();
+		std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+		std::cout << names[i] << ": " << solver.getResidualHistory().size() << " iterations, "
+			<< std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << "us\n";
+	}
+}
+void benchPreconditioners(int dim){
+	tcl::Context context(tcl::DEVICE::GPU, false, false);
+	SparseMatrix<float> matrix = createInteractionMatrix(dim);
+	std::vector<float> b;
+	//The periodic fluid system is singular so b must sum to 0 for it to have a solution
+	for (int i = 0; i < matrix.dim; ++i){
+		b.push_back(i % dim - (dim - 1) / 2.f);
+	}
+	std::cout << "Preconditioners on a " << dim << "x" << dim << " fluid system\n";
+	benchPreconditioners(matrix, b, context);
+
+	SparseMatrix<float> bcsstk("../res/bcsstk01.mtx");
+	std::cout << "Preconditioners on bcsstk01\n";
+	benchPreconditioners(bcsstk, std::vector<float>(bcsstk.dim, 1.f), context);
+	std::cout << std::endl;
+}
+void benchMultigrid(int maxDim){
+	tcl::Context context(tcl::DEVICE::GPU, false, false);
+	for (int dim = 16; dim <= maxDim; dim *= 2){
+		std::vector<float> b;
+		//The periodic fluid system is singular so b must sum to 0 for it to have a solution
+		for (int i = 0; i < dim * dim; ++i){
+			b.push_back(i % dim - (dim - 1) / 2.f);
+		}
+		std::cout << dim << "x" << dim << " grid\n";
+		std::shared_ptr<Multigrid> multigrid = std::make_shared<Multigrid>(dim);
+		CGSolver solver(std::make_shared<LaplacianOperator>(dim), b, context, 4 * dim);
+		for (int i = 0; i < 2; ++i){
+			if (i == 1){
+				solver.setPreconditioner(multigrid);
+			}
+			std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+			solver.solve();
+			std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+			std::cout << (i == 0 ? "CG: " : "MGPCG: ") << solver.getResidualHistory().size() << " iterations, "
+				<< std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << "us\n";
+		}
+
+		cl::Buffer bBuf = context.buffer(tcl::MEM::READ_ONLY, b.size() * sizeof(float), &b[0]);
+		cl::Buffer xBuf = context.buffer(tcl::MEM::READ_WRITE, b.size() * sizeof(float), nullptr);
+		std::vector<float> zeros(b.size(), 0.f);
+		context.writeData(xBuf, zeros.size() * sizeof(float), &zeros[0], 0, true);
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		int cycles = multigrid->solve(context, bBuf, xBuf);
+		std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+		std::cout << "Multigrid (" << multigrid->getLevels() << " levels): " << cycles << " V-cycles, "
+			<< std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << "us\n";
+	}
+	std::cout << std::endl;
+}
+//Time a solve of the system with the native solver and OpenCL CG on each device
+void benchCPUBackend(const SparseMatrix<float> &matrix, const std::vector<float> &b, int iter,
+	float convergeLen)
+{
+	CPUCGSolver cpuSolver(matrix, b, iter, convergeLen);
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	cpuSolver.solve();
+	std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+	std::vector<float> native = cpuSolver.getResult();
+	std::cout << "native (" << cpuSolver.getThreads() << " threads): " << cpuSolver.getResidualHistory().size()
+		<< " iterations, " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << "us\n";
+
+	std::array<tcl::DEVICE, 2> devices = { tcl::DEVICE::CPU, tcl::DEVICE::GPU };
+	std::array<std::string, 2> names = { "OpenCL CPU", "OpenCL GPU" };
+	for (int i = 0; i < 2; ++i){
+		tcl::Context context(devices[i], false, false);
+		CGSolver solver(matrix, b, context, iter, convergeLen);
+		//Solve once to get everything uploaded and compiled before timing
+		solver.solve();
+		start = std::chrono::high_resolution_clock::now();
+		solver.solve();
+		end = std::chrono::high_resolution_clock::now();
+		std::vector<float> x = solver.getResult();
+		float maxDiff = 0.f;
+		for (size_t j = 0; j < x.size(); ++j){
+			maxDiff = std::max(maxDiff, std::abs(x[j] - native[j]));
+		}
+		std::cout << names[i] << ": " << solver.getResidualHistory().size() << " iterations, "
+			<< std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()
+			<< "us, max x difference from native " << maxDiff << "\n";
+	}
+}
+void benchCPUBackend(int dim){
+	SparseMatrix<float> matrix = createInteractionMatrix(dim);
+	std::vector<float> b;
+	//The periodic fluid system is singular so b must sum to 0 for it to have a solution
+	for (int i = 0; i < matrix.dim; ++i){
+		b.push_back(i % dim - (dim - 1) / 2.f);
+	}
+	std::cout << "CPU backends on a " << dim << "x" << dim << " fluid system\n";
+	benchCPUBackend(matrix, b, 4 * dim, 1e-2);
+
+	SparseMatrix<float> bcsstk("../res/bcsstk01.mtx");
+	std::cout << "CPU backends on bcsstk01\n";
+	benchCPUBackend(bcsstk, std::vector<float>(bcsstk.dim, 1.f), 2 * bcsstk.dim, 1e-5);
+	std::cout << std::endl;
+}
+void testFFTSolver(int dim){
+	tcl::Context context(tcl::DEVICE::GPU, false, false);
+	std::vector<float> b;
+	float mean = 0.f;
+	for (int i = 0; i < dim * dim; ++i){
+		b.push_back(static_cast<float>(std::rand()) / RAND_MAX * 2.f - 1.f);
+		mean += b.back();
+	}
+	//The periodic fluid system is singular so b must sum to 0 for it to have a solution
+	mean /= b.size();
+	for (float &f : b){
+		f -= mean;
+	}
+	FFTSolver fft(dim);
+	fft.init(context);
+	cl::Buffer bBuf = context.buffer(tcl::MEM::READ_ONLY, b.size() * sizeof(float), &b[0]);
+	cl::Buffer xBuf = context.buffer(tcl::MEM::READ_WRITE, b.size() * sizeof(float), nullptr);
+	//Solve once to get the kernels compiled before timing
+	fft.solve(context, bBuf, xBuf);
+	context.mQueue.finish();
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	fft.solve(context, bBuf, xBuf);
+	context.mQueue.finish();
+	std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+	long long fftTime = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+	std::vector<float> x(b.size()), hostX;
+	context.readData(xBuf, x.size() * sizeof(float), &x[0], 0, true);
+
+	start = std::chrono::high_resolution_clock::now();
+	fft.solveHost(b, hostX);
+	end = std::chrono::high_resolution_clock::now();
+	long long hostTime = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+
+	CGSolver solver(std::make_shared<LaplacianOperator>(dim), b, context, 4 * dim * dim);
+	start = std::chrono::high_resolution_clock::now();
+	solver.solve();
+	end = std::chrono::high_resolution_clock::now();
+	long long cgTime = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+	//CG from zero stays in the range of the matrix so it also finds the zero mean solution
+	std::vector<float> cgX = solver.getResult();
+
+	LaplacianOperator op(dim);
+	std::vector<double> hostXd(hostX.begin(), hostX.end()), ax(b.size());
+	op.applyHost(hostXd, ax);
+	double residual = 0, deviceDiff = 0, cgDiff = 0;
+	for (size_t i = 0; i < b.size(); ++i){
+		residual += (b[i] - ax[i]) * (b[i] - ax[i]);
+		deviceDiff = std::max(deviceDiff, static_cast<double>(std::abs(x[i] - hostX[i])));
+		cgDiff = std::max(cgDiff, static_cast<double>(std::abs(cgX[i] - hostX[i])));
+	}
+	std::cout << dim << "x" << dim << " FFT solve: device " << fftTime << "us, host " << hostTime
+		<< "us, host residual length " << std::sqrt(residual) << ", max device difference " << deviceDiff
+		<< "\nCG: " << solver.getResidualHistory().size() << " iterations, " << cgTime
+		<< "us, max difference from FFT " << cgDiff << "\n" << std::endl;
+}
+void benchRelaxation(int dim){
+	tcl::Context context(tcl::DEVICE::GPU, false, false);
+	std::vector<float> b;
+	//The periodic fluid system is singular so b must sum to 0 for it to have a solution
+	for (int i = 0; i < dim * dim; ++i){
+		b.push_back(i % dim - (dim - 1) / 2.f);
+	}
+	cl::Buffer bBuf = context.buffer(tcl::MEM::READ_ONLY, b.size() * sizeof(float), &b[0]);
+	cl::Buffer xBuf = context.buffer(tcl::MEM::READ_WRITE, b.size() * sizeof(float), nullptr);
+	std::vector<float> zeros(b.size(), 0.f);
+	RelaxationSolver relax(dim);
+	relax.init(context);
+	std::array<RelaxationSolver::METHOD, 2> methods = { RelaxationSolver::METHOD::SOR, RelaxationSolver::METHOD::CHEBYSHEV };
+	std::array<std::string, 2> names = { "SOR", "Chebyshev" };
+	std::cout << dim << "x" << dim << " grid, initial residual length "
+		<< std::sqrt(std::inner_product(b.begin(), b.end(), b.begin(), 0.0)) << "\n";
+	for (int sweeps = 10; sweeps <= 40 * dim; sweeps *= 4){
+		relax.setSweeps(sweeps);
+		for (int m = 0; m < 2; ++m){
+			relax.setMethod(methods[m]);
+			context.writeData(xBuf, zeros.size() * sizeof(float), &zeros[0], 0, true);
+			std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+			relax.solve(context, bBuf, xBuf);
+			context.mQueue.finish();
+			std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+			std::cout << names[m] << " " << sweeps << " sweeps: residual length " << relax.residualLength(context, bBuf, xBuf)
+				<< ", " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << "us\n";
+		}
+	}
+	CGSolver solver(std::make_shared<LaplacianOperator>(dim), b, context, 4 * dim * dim, 1e-2);
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	solver.solve();
+	std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+	std::cout << "CG to residual length 1e-2: " << solver.getResidualHistory().size() << " iterations, "
+		<< std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << "us\n" << std::endl;
+}
+void testSolveStats(int dim){
+	tcl::Context context(tcl::DEVICE::GPU, false, true);
+	CGSolver solver(std::make_shared<LaplacianOperator>(dim), std::vector<float>(), context);
+	solver.setPreconditioner(std::make_shared<Multigrid>(dim));
+	solver.setInitialGuess(CGSolver::GUESS::PREVIOUS);
+	solver.setTelemetry(true, true);
+	SolveStatsSummary summary;
+	for (int frame = 0; frame < 30; ++frame){
+		//A wave drifting across the grid, which sums to 0 as the singular system needs
+		std::vector<float> b;
+		for (int i = 0; i < dim * dim; ++i){
+			b.push_back(std::sin(6.2831853f * (i % dim + 0.5f * frame) / dim));
+		}
+		solver.updateB(b);
+		solver.solve();
+		const SolveStats &stats = solver.getStats();
+		if (stats.iterations != static_cast<int>(solver.getResidualHistory().size())
+			|| stats.residualHistory != solver.getResidualHistory())
+		{
+			std::cout << "frame " << frame << " stats don't match the residual history!\n";
+		}
+		summary.add(stats);
+	}
+	std::cout << "last frame: " << solver.getStats() << "\n" << dim << "x" << dim << " grid over 30 frames: ";
+	summary.print(std::cout);
+	std::cout << std::endl;
+}
+void testPressureTuner(int dim){
+	tcl::Context context(tcl::DEVICE::GPU, false, false);
+	PressureTuner tuner(dim);
+	std::shared_ptr<PressureSolver> solver = tuner.select(context, "");
+	for (const PressureTuner::Result &r : tuner.getResults()){
+		std::cout << std::setw(16) << r.name << ": " << r.meanTime << "ms/frame, worst relative residual "
+			<< r.worstResidual << (r.converged ? "" : ", didn't converge") << "\n";
+	}
+	std::cout << "picked " << solver->name() << " for a " << dim << "x" << dim << " grid\n";
+
+	const std::string cacheFile = "pressure_tuning_test.cache";
+	std::remove(cacheFile.c_str());
+	std::string tuned = tuner.select(context, cacheFile)->name();
+	std::string cached = tuner.select(context, cacheFile)->name();
+	if (!tuner.fromCache() || cached != tuned){
+		std::cout << "Second selection didn't come from the cache! tuned " << tuned
+			<< ", got " << cached << "\n";
+	}
+	std::remove(cacheFile.c_str());
+	std::cout << std::endl;
+}
+void benchMatrixLoad(const std::string &file){
+	typedef std::chrono::high_resolution_clock clock;
+	std::remove(mtx::cachePath(file).c_str());
+	clock::time_point start = clock::now();
+	SparseMatrix<float> streamed(file, true, false);
+	clock::time_point end = clock::now();
+	std::cout << file << ": " << streamed.dim << " rows, " << streamed.elements.size() << " non-zeros\n"
+		<< "stream parser: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms\n";
+
+	start = clock::now();
+	mtx::CSRMatrix parsed = mtx::parse(file);
+	end = clock::now();
+	std::cout << "fast parse: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms\n";
+	start = clock::now();
+	mtx::writeCache(file, parsed);
+	end = clock::now();
+	std::cout << "writing cache: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms\n";
+	start = clock::now();
+	mtx::CSRMatrix cached = mtx::load(file, true);
+	end = clock::now();
+	std::cout << "cached load" << (cached.fromCache() ? "" : " (cache missed!)") << ": "
+		<< std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << "us\n";
+	start = clock::now();
+	SparseMatrix<float> fast(file, true, true, false, true);
+	end = clock::now();
+	std::cout << "SparseMatrix from cache: "
+		<< std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms\n";
+
+	bool match = fast.dim == streamed.dim && fast.elements.size() == streamed.elements.size();
+	for (size_t i = 0; match && i < fast.elements.size(); ++i){
+		const MatrixElement<float> &a = fast.elements[i], &e = streamed.elements[i];
+		match = a.row == e.row && a.col == e.col && a.val == e.val;
+	}
+	std::cout << (match ? "fast loader matches the stream parser" : "fast loader doesn't match the stream parser!")
+		<< "\n" << std::endl;
+	std::remove(mtx::cachePath(file).c_str());
+}
+void benchMatrixLoad(int dim){
+	//Write out the lower triangle of the fluid system, as a symmetric Matrix Market file stores it
+	SparseMatrix<float> matrix = createInteractionMatrix(dim);
+	int lower = 0;
+	for (const MatrixElement<float> &e : matrix.elements){
+		if (e.row >= e.col)
+			++lower;
+	}
+	std::string file = "../res/fluid" + std::to_string(dim) + ".mtx";
+	std::ofstream out(file.c_str());
+	out << "%%MatrixMarket matrix coordinate real symmetric\n" << matrix.dim << " " << matrix.dim << " " << lower << "\n";
+	for (const MatrixElement<float> &e : matrix.elements){
+		if (e.row >= e.col)
+			out << e.row + 1 << " " << e.col + 1 << " " << e.val << "\n";
+	}
+	out.close();
+	benchMatrixLoad(file);
+	std::remove(file.c_str());
+	std::remove(mtx::cachePath(file).c_str());
+}
+void benchAssembly(int dim){
+	typedef std::chrono::high_resolution_clock clock;
+	tcl::Context context(tcl::DEVICE::GPU, false, false);
+	cl::Program program = context.loadProgram("../res/cg_kernels.cl");
+	clock::time_point start = clock::now();
+	SparseOperator built(createInteractionMatrix(dim), SparseOperator::FORMAT::CSR);
+	built.init(context, program);
+	context.mQueue.finish();
+	clock::time_point end = clock::now();
+	std::cout << dim << "x" << dim << " fluid system, SparseMatrix then upload: "
+		<< std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms\n";
+
+	start = clock::now();
+	std::shared_ptr<SparseOperator> assembled = createInteractionOperator(context, dim);
+	assembled->init(context, program);
+	context.mQueue.finish();
+	end = clock::now();
+	std::cout << "parallel assembly into device buffers: "
+		<< std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms\n";
+
+	int n = dim * dim;
+	std::vector<float> v = createFluidRHS(n);
+	cl::Buffer in = context.buffer(tcl::MEM::READ_ONLY, n * sizeof(float), &v[0]);
+	cl::Buffer out[2] = { context.buffer(tcl::MEM::READ_WRITE, n * sizeof(float), nullptr),
+		context.buffer(tcl::MEM::READ_WRITE, n * sizeof(float), nullptr) };
+	built.apply(context, in, out[0]);
+	assembled->apply(context, in, out[1]);
+	std::vector<float> res[2] = { std::vector<float>(n), std::vector<float>(n) };
+	context.readData(out[0], n * sizeof(float), &res[0][0], 0, false);
+	context.readData(out[1], n * sizeof(float), &res[1][0], 0, true);
+	//The assembled rows aren't sorted by column so the sums may round a little differently
+	float maxDiff = 0;
+	for (int i = 0; i < n; ++i){
+		maxDiff = std::max(maxDiff, std::abs(res[0][i] - res[1][i]));
+	}
+	std::vector<double> hostIn(v.begin(), v.end()), hostOut(n);
+	assembled->applyHost(hostIn, hostOut);
+	for (int i = 0; i < n; ++i){
+		maxDiff = std::max(maxDiff, static_cast<float>(std::abs(hostOut[i] - res[0][i])));
+	}
+	std::cout << "max difference in products: " << maxDiff << "\n" << std::endl;
+}
+//Compare the full CSR and half stored SYMMETRIC operators for the matrix
+void testSymmetricStorage(const SparseMatrix<float> &matrix, tcl::Context &context, const cl::Program &program){
+	SparseMatrix<float> half = matrix;
+	half.storeUpper();
+	std::shared_ptr<SparseOperator> ops[2] = { std::make_shared<SparseOperator>(matrix, SparseOperator::FORMAT::CSR),
+		std::make_shared<SparseOperator>(half) };
+	int n = matrix.dim;
+	std::vector<float> v = createFluidRHS(n);
+	cl::Buffer in = context.buffer(tcl::MEM::READ_ONLY, n * sizeof(float), &v[0]);
+	cl::Buffer out = context.buffer(tcl::MEM::READ_WRITE, n * sizeof(float), nullptr);
+	std::vector<float> res[2] = { std::vector<float>(n), std::vector<float>(n) };
+	const int runs = 100;
+	for (int f = 0; f < 2; ++f){
+		ops[f]->init(context, program);
+		ops[f]->apply(context, in, out);
+		context.mQueue.finish();
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < runs; ++i){
+			ops[f]->apply(context, in, out);
+		}
+		context.mQueue.finish();
+		std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+		context.readData(out, n * sizeof(float), &res[f][0], 0, true);
+		std::cout << (f == 0 ? "CSR" : "SYMMETRIC") << ": " << ops[f]->storedValues() << " values stored, "
+			<< std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / runs << "us per product\n";
+	}
+	//The atomic adds happen in any order, so compare relative to the size of the values
+	float maxDiff = 0, maxVal = 0;
+	for (int i = 0; i < n; ++i){
+		maxDiff = std::max(maxDiff, std::abs(res[0][i] - res[1][i]));
+		maxVal = std::max(maxVal, std::abs(res[0][i]));
+	}
+	std::cout << "max relative difference in products: " << maxDiff / std::max(maxVal, 1e-30f) << "\n";
+
+	std::vector<float> b(n);
+	for (int i = 0; i < n; ++i){
+		b[i] = std::sin(6.2831853f * (i % 16) / 16.f);
+	}
+	for (int f = 0; f < 2; ++f){
+		CGSolver solver(ops[f], b, context, 4 * n, 1e-3);
+		solver.solve();
+		std::cout << (f == 0 ? "CSR" : "SYMMETRIC") << " CG solve: " << solver.getResidualHistory().size()
+			<< " iterations, final residual length " << solver.getStats().finalResidual << "\n";
+	}
+	std::cout << std::endl;
+}
+void testSymmetricStorage(int dim){
+	tcl::Context context(tcl::DEVICE::GPU, false, false);
+	bool useDouble = CGSolver::supportsDouble(context.mDevices.at(0));
+	cl::Program program = context.loadProgram("../res/cg_kernels.cl", useDouble ? "-DCG_USE_DOUBLE" : "");
+	std::cout << dim << "x" << dim << " fluid system:\n";
+	testSymmetricStorage(createInteractionMatrix(dim), context, program);
+	std::cout << "bcsstk01:\n";
+	testSymmetricStorage(SparseMatrix<float>("../res/bcsstk01.mtx"), context, program);
+}
+//Run the reordering comparison on some matrix
+void benchReordering(const SparseMatrix<float> &matrix, const std::vector<float> &b, tcl::Context &context,
+	const cl::Program &program)
+{
+	const CGSolver::REORDER orders[3] = { CGSolver::REORDER::NONE, CGSolver::REORDER::RCM,
+		CGSolver::REORDER::NESTED_DISSECTION };
+	const std::string names[3] = { "as given", "RCM", "nested dissection" };
+	std::vector<int> rowPtr(matrix.dim + 1), col(matrix.nonZeros());
+	std::vector<float> val(col.size());
+	matrix.getCSR(&rowPtr[0], &col[0], &val[0]);
+	int n = matrix.dim;
+	std::vector<float> v(n, 1.f);
+	cl::Buffer in = context.buffer(tcl::MEM::READ_ONLY, n * sizeof(float), &v[0]);
+	cl::Buffer out = context.buffer(tcl::MEM::READ_WRITE, n * sizeof(float), nullptr);
+	std::vector<float> baseline;
+	double baseTime = 0;
+	for (int o = 0; o < 3; ++o){
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		std::vector<int> perm = o == 1 ? reorder::reverseCuthillMcKee(rowPtr, col)
+			: o == 2 ? reorder::nestedDissection(rowPtr, col) : std::vector<int>();
+		std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+		long long orderTime = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+		SparseMatrix<float> reordered = perm.empty() ? matrix : matrix.permuted(perm);
+		SparseOperator op(reordered, SparseOperator::FORMAT::CSR);
+		op.init(context, program);
+		const int runs = 100;
+		op.apply(context, in, out);
+		context.mQueue.finish();
+		start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < runs; ++i){
+			op.apply(context, in, out);
+		}
+		context.mQueue.finish();
+		end = std::chrono::high_resolution_clock::now();
+		double time = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / static_cast<double>(runs);
+		if (o == 0){
+			baseTime = time;
+		}
+		std::cout << names[o] << ": bandwidth " << reordered.bandwidth() << ", profile " << reordered.profile()
+			<< ", ordering took " << orderTime << "ms, CSR mat * vec " << time << "us, speedup " << baseTime / time << "x\n";
+
+		CGSolver solver(matrix, b, context, 4 * n, 1e-3, orders[o]);
+		solver.solve();
+		std::vector<float> x = solver.getResult();
+		if (o == 0){
+			baseline = x;
+		}
+		float maxDiff = 0;
+		for (int i = 0; i < n; ++i){
+			maxDiff = std::max(maxDiff, std::abs(x[i] - baseline[i]));
+		}
+		std::cout << "\tCG solve: " << solver.getResidualHistory().size() << " iterations, max difference from "
+			<< "the solve as given " << maxDiff << "\n";
+	}
+	std::cout << std::endl;
+}
+void benchReordering(int dim){
+	tcl::Context context(tcl::DEVICE::GPU, false, false);
+	bool useDouble = CGSolver::supportsDouble(context.mDevices.at(0));
+	cl::Program program = context.loadProgram("../res/cg_kernels.cl", useDouble ? "-DCG_USE_DOUBLE" : "");
+	//Shuffle the fluid system's cells to stand in for a matrix loaded in some arbitrary order
+	SparseMatrix<float> fluid = createInteractionMatrix(dim);
+	std::vector<int> shuffle(fluid.dim);
+	std::iota(shuffle.begin(), shuffle.end(), 0);
+	std::srand(7);
+	for (int i = fluid.dim - 1; i > 0; --i){
+		std::swap(shuffle[i], shuffle[std::rand() % (i + 1)]);
+	}
+	std::vector<float> b(fluid.dim);
+	for (int i = 0; i < fluid.dim; ++i){
+		b[i] = std::sin(6.2831853f * (shuffle[i] % dim) / dim);
+	}
+	std::cout << "shuffled " << dim << "x" << dim << " fluid system:\n";
+	benchReordering(fluid.permuted(shuffle), b, context, program);
+
+	SparseMatrix<float> bcsstk("../res/bcsstk01.mtx");
+	std::cout << "bcsstk01:\n";
+	benchReordering(bcsstk, std::vector<float>(bcsstk.dim, 1.f), context, program);
+}
 void testCGStress(int dim){
 	tcl::Context context(tcl::DEVICE::GPU, false, false);
 	SparseMatrix<float> matrix = createInteractionMatrix(dim);
 	std::vector<float> b;
 	std::srand(std::time(NULL));
-	for (int i = 0; i < dim; ++i){
+	for (int i = 0; i < matrix.dim; ++i){
 		//Get random values between 150/-150
 		b.push_back(static_cast<float>(std::rand()) / RAND_MAX * 300.f - 150.f);
 	}
@@ -184,6 +1089,156 @@ void testCGStress(int dim){
 			<< "ms\n";
 	}
 }
+void benchSparseMatVec(){
+	tcl::Context context(tcl::DEVICE::GPU, false, false);
+	cl::Program program = context.loadProgram("../res/cg_kernels.cl");
+	cl::Kernel cooKernel(program, "sparse_mat_vec_mult");
+	cl::Kernel csrKernel(program, "csr_mat_vec_mult");
+	cl::Kernel stencilKernel(program, "laplacian_mat_vec_mult");
+	for (int dim = 16; dim <= 512; dim *= 2){
+		SparseMatrix<float> matrix = createInteractionMatrix(dim);
+		int n = matrix.dim;
+		int nVals = matrix.elements.size();
+		std::vector<int> row(nVals), rowPtr(n + 1), col(nVals);
+		std::vector<float> val(nVals), vect(n, 1.f), cooRes(n), csrRes(n), stencilRes(n);
+		matrix.getRaw(&row[0], &col[0], &val[0]);
+		cl::Buffer rowBuf = context.buffer(tcl::MEM::READ_ONLY, nVals * sizeof(int), &row[0]);
+		cl::Buffer colBuf = context.buffer(tcl::MEM::READ_ONLY, nVals * sizeof(int), &col[0]);
+		cl::Buffer valBuf = context.buffer(tcl::MEM::READ_ONLY, nVals * sizeof(float), &val[0]);
+		matrix.getCSR(&rowPtr[0], &col[0], &val[0]);
+		cl::Buffer rowPtrBuf = context.buffer(tcl::MEM::READ_ONLY, (n + 1) * sizeof(int), &rowPtr[0]);
+		cl::Buffer csrColBuf = context.buffer(tcl::MEM::READ_ONLY, nVals * sizeof(int), &col[0]);
+		cl::Buffer csrValBuf = context.buffer(tcl::MEM::READ_ONLY, nVals * sizeof(float), &val[0]);
+		//Use a vector of cell numbers so that a mismatched row would show up in the result
+		for (int i = 0; i < n; ++i){
+			vect[i] = i % dim;
+		}
+		cl::Buffer vectBuf = context.buffer(tcl::MEM::READ_ONLY, n * sizeof(float), &vect[0]);
+		cl::Buffer cooResBuf = context.buffer(tcl::MEM::WRITE_ONLY, n * sizeof(float), nullptr);
+		cl::Buffer csrResBuf = context.buffer(tcl::MEM::WRITE_ONLY, n * sizeof(float), nullptr);
+		cl::Buffer stencilResBuf = context.buffer(tcl::MEM::WRITE_ONLY, n * sizeof(float), nullptr);
+
+		cooKernel.setArg(0, nVals);
+		cooKernel.setArg(1, rowBuf);
+		cooKernel.setArg(2, colBuf);
+		cooKernel.setArg(3, valBuf);
+		cooKernel.setArg(4, vectBuf);
+		cooKernel.setArg(5, cooResBuf);
+		csrKernel.setArg(0, rowPtrBuf);
+		csrKernel.setArg(1, csrColBuf);
+		csrKernel.setArg(2, csrValBuf);
+		csrKernel.setArg(3, vectBuf);
+		csrKernel.setArg(4, csrResBuf);
+		stencilKernel.setArg(0, vectBuf);
+		stencilKernel.setArg(1, stencilResBuf);
+		context.mQueue.finish();
+
+		//The COO kernel is O(n * nVals) so back off the runs as the grid grows to keep this reasonable
+		int cooRuns = std::max(1, 50 / (dim / 16) / (dim / 16));
+		int csrRuns = 50;
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < cooRuns; ++i){
+			context.runNDKernel(cooKernel, cl::NDRange(n), cl::NullRange, cl::NullRange);
+		}
+		context.mQueue.finish();
+		std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+		double cooTime = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()
+			/ 1000.0 / cooRuns;
+
+		start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < csrRuns; ++i){
+			context.runNDKernel(csrKernel, cl::NDRange(n), cl::NullRange, cl::NullRange);
+		}
+		context.mQueue.finish();
+		end = std::chrono::high_resolution_clock::now();
+		double csrTime = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()
+			/ 1000.0 / csrRuns;
+
+		start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < csrRuns; ++i){
+			context.runNDKernel(stencilKernel, cl::NDRange(dim, dim), cl::NullRange, cl::NullRange);
+		}
+		context.mQueue.finish();
+		end = std::chrono::high_resolution_clock::now();
+		double stencilTime = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()
+			/ 1000.0 / csrRuns;
+
+		context.readData(cooResBuf, n * sizeof(float), &cooRes[0], 0, true);
+		context.readData(csrResBuf, n * sizeof(float), &csrRes[0], 0, true);
+		context.readData(stencilResBuf, n * sizeof(float), &stencilRes[0], 0, true);
+		int mismatches = 0;
+		for (int i = 0; i < n; ++i){
+			if (std::abs(cooRes[i] - csrRes[i]) > 1e-5 || std::abs(stencilRes[i] - csrRes[i]) > 1e-5){
+				++mismatches;
+			}
+		}
+		std::cout << dim << "x" << dim << " grid: COO " << cooTime << "ms, CSR " << csrTime
+			<< "ms, speedup " << cooTime / csrTime << "x, Laplacian stencil " << stencilTime << "ms";
+		if (mismatches != 0){
+			std::cout << ", " << mismatches << " rows differ between the kernels!";
+		}
+		std::cout << "\n";
+	}
+	std::cout << std::endl;
+}
+//Time the matrix * vector product of the matrix in each format, checking each against CSR
+void benchSparseFormats(const SparseMatrix<float> &matrix, tcl::Context &context, const cl::Program &program){
+	int n = matrix.dim;
+	std::vector<float> vect(n), csrRes(n), res(n);
+	for (int i = 0; i < n; ++i){
+		vect[i] = i % 16;
+	}
+	cl::Buffer vectBuf = context.buffer(tcl::MEM::READ_ONLY, n * sizeof(float), &vect[0]);
+	cl::Buffer resBuf = context.buffer(tcl::MEM::READ_WRITE, n * sizeof(float), nullptr);
+	std::array<SparseOperator::FORMAT, 3> formats = {
+		SparseOperator::FORMAT::CSR, SparseOperator::FORMAT::ELL, SparseOperator::FORMAT::SELL
+	};
+	std::array<std::string, 3> names = { "CSR", "ELL", "SELL" };
+	const int runs = 50;
+	for (int f = 0; f < 3; ++f){
+		SparseOperator op(matrix, formats[f]);
+		op.init(context, program);
+		op.apply(context, vectBuf, resBuf);
+		context.mQueue.finish();
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < runs; ++i){
+			op.apply(context, vectBuf, resBuf);
+		}
+		context.mQueue.finish();
+		std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+		double seconds = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1e6 / runs;
+		//2 flops per non-zero, padding doesn't count as useful work
+		double gflops = 2.0 * matrix.nonZeros() / seconds / 1e9;
+
+		context.readData(resBuf, n * sizeof(float), &res[0], 0, true);
+		if (f == 0){
+			csrRes = res;
+		}
+		int mismatches = 0;
+		for (int i = 0; i < n; ++i){
+			if (std::abs(res[i] - csrRes[i]) > 1e-4 * std::max(1.f, std::abs(csrRes[i]))){
+				++mismatches;
+			}
+		}
+		std::cout << names[f] << ": " << gflops << " GFLOP/s, " << op.storedValues() << " values stored";
+		if (mismatches != 0){
+			std::cout << ", " << mismatches << " rows differ from CSR!";
+		}
+		std::cout << "\n";
+	}
+	std::cout << "auto picks " << names[SparseOperator::selectFormat(matrix.rowLengths(), 32)] << "\n";
+}
+void benchSparseFormats(){
+	tcl::Context context(tcl::DEVICE::GPU, false, false);
+	cl::Program program = context.loadProgram("../res/cg_kernels.cl");
+	for (int dim = 16; dim <= 512; dim *= 2){
+		std::cout << dim << "x" << dim << " grid\n";
+		benchSparseFormats(createInteractionMatrix(dim), context, program);
+	}
+	std::cout << "bcsstk01\n";
+	benchSparseFormats(SparseMatrix<float>("../res/bcsstk01.mtx"), context, program);
+	std::cout << std::endl;
+}
 void testVelocityDivergence(){
 	tcl::Context context(tcl::DEVICE::GPU, false, false);
 	cl::Program program = context.loadProgram("../res/simple_fluid.cl");
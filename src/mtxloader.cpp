@@ -0,0 +1,428 @@
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <charconv>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <cstdint>
+#include <sys/stat.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "mtxloader.h"
+
+namespace {
+	//The cache file starts with this header, followed by the row pointers, columns and
+	//values, with the values aligned to 8 bytes
+	struct CacheHeader {
+		char magic[8];
+		int32_t dim, symmetric;
+		int64_t nnz;
+		//The size and modification time of the .mtx the cache was written from
+		int64_t sourceSize, sourceTime;
+	};
+	const char cacheMagic[8] = { 'S', 'F', 'C', 'S', 'R', '\0', '\0', '\1' };
+
+	size_t valOffset(int dim, int nnz){
+		size_t off = sizeof(CacheHeader) + (static_cast<size_t>(dim) + 1 + nnz) * sizeof(int32_t);
+		return (off + 7) & ~static_cast<size_t>(7);
+	}
+	void sourceInfo(const std::string &file, int64_t &size, int64_t &time){
+		struct stat info;
+		if (stat(file.c_str(), &info) != 0){
+			throw std::runtime_error("Failed to stat Matrix Market file: " + file);
+		}
+		size = static_cast<int64_t>(info.st_size);
+		time = static_cast<int64_t>(info.st_mtime);
+	}
+
+	struct Entry {
+		int row, col;
+		double val;
+	};
+	const char* skipBlanks(const char *p, const char *end){
+		while (p != end && (*p == ' ' || *p == '\t')){
+			++p;
+		}
+		return p;
+	}
+	const char* nextLine(const char *p, const char *end){
+		p = static_cast<const char*>(std::memchr(p, '\n', end - p));
+		return p ? p + 1 : end;
+	}
+	bool blankLine(const char *p, const char *end){
+		p = skipBlanks(p, end);
+		return p == end || *p == '\n' || *p == '\r';
+	}
+	bool parseInt(const char *&p, const char *end, int &v){
+		p = skipBlanks(p, end);
+		std::from_chars_result res = std::from_chars(p, end, v);
+		p = res.ptr;
+		return res.ec == std::errc();
+	}
+	bool parseDouble(const char *&p, const char *end, double &v){
+		p = skipBlanks(p, end);
+		//from_chars doesn't take a leading +, which some writers put on the values
+		if (p != end && *p == '+'){
+			++p;
+		}
+#ifdef __cpp_lib_to_chars
+		std::from_chars_result res = std::from_chars(p, end, v);
+		p = res.ptr;
+		return res.ec == std::errc();
+#else
+		//Without floating point from_chars copy the token out so strtod can't run off the mapping
+		char buf[64];
+		size_t n = 0;
+		while (p + n != end && n < sizeof(buf) - 1 && !std::isspace(static_cast<unsigned char>(p[n]))){
+			buf[n] = p[n];
+			++n;
+		}
+		buf[n] = '\0';
+		char *stop = nullptr;
+		v = std::strtod(buf, &stop);
+		p += stop - buf;
+		return stop != buf;
+#endif
+	}
+	//Run f(t) for t in [0, threads) on its own thread and wait for them all
+	template<class F>
+	void parallel(int threads, const F &f){
+		std::vector<std::thread> workers;
+		for (int t = 1; t < threads; ++t){
+			workers.emplace_back(f, t);
+		}
+		f(0);
+		for (std::thread &w : workers){
+			w.join();
+		}
+	}
+}
+
+namespace mtx {
+#ifdef _WIN32
+	MappedFile::MappedFile(const std::string &file) : ptr(nullptr), len(0), fileHandle(INVALID_HANDLE_VALUE),
+		mapHandle(nullptr)
+	{
+		fileHandle = CreateFileA(file.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+			FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		LARGE_INTEGER fileSize;
+		if (fileHandle == INVALID_HANDLE_VALUE || !GetFileSizeEx(fileHandle, &fileSize) || fileSize.QuadPart == 0){
+			if (fileHandle != INVALID_HANDLE_VALUE){
+				CloseHandle(fileHandle);
+			}
+			throw std::runtime_error("Failed to open file for mapping: " + file);
+		}
+		len = static_cast<size_t>(fileSize.QuadPart);
+		mapHandle = CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapHandle != nullptr){
+			ptr = static_cast<const char*>(MapViewOfFile(mapHandle, FILE_MAP_READ, 0, 0, 0));
+		}
+		if (ptr == nullptr){
+			if (mapHandle != nullptr){
+				CloseHandle(mapHandle);
+			}
+			CloseHandle(fileHandle);
+			throw std::runtime_error("Failed to map file: " + file);
+		}
+	}
+	MappedFile::~MappedFile(){
+		UnmapViewOfFile(ptr);
+		CloseHandle(mapHandle);
+		CloseHandle(fileHandle);
+	}
+#else
+	MappedFile::MappedFile(const std::string &file) : ptr(nullptr), len(0)
+	{
+		int fd = open(file.c_str(), O_RDONLY);
+		struct stat info;
+		if (fd < 0 || fstat(fd, &info) != 0 || info.st_size == 0){
+			if (fd >= 0){
+				close(fd);
+			}
+			throw std::runtime_error("Failed to open file for mapping: " + file);
+		}
+		len = static_cast<size_t>(info.st_size);
+		void *m = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		//The mapping stays valid after the descriptor is closed
+		close(fd);
+		if (m == MAP_FAILED){
+			throw std::runtime_error("Failed to map file: " + file);
+		}
+		madvise(m, len, MADV_SEQUENTIAL);
+		ptr = static_cast<const char*>(m);
+	}
+	MappedFile::~MappedFile(){
+		munmap(const_cast<char*>(ptr), len);
+	}
+#endif
+	const char* MappedFile::data() const {
+		return ptr;
+	}
+	size_t MappedFile::size() const {
+		return len;
+	}
+
+	CSRMatrix::CSRMatrix() : n(0), nnz(0), sym(false), cached(false), rows(nullptr), cols(nullptr), vals(nullptr)
+	{}
+	int CSRMatrix::dim() const {
+		return n;
+	}
+	int CSRMatrix::nonZeros() const {
+		return nnz;
+	}
+	bool CSRMatrix::symmetric() const {
+		return sym;
+	}
+	bool CSRMatrix::fromCache() const {
+		return cached;
+	}
+	//The pointers are only used for a mapped cache so copies of a parsed matrix see their own arrays
+	const int* CSRMatrix::rowPtr() const {
+		return mapping ? rows : ownRows.data();
+	}
+	const int* CSRMatrix::col() const {
+		return mapping ? cols : ownCols.data();
+	}
+	const double* CSRMatrix::val() const {
+		return mapping ? vals : ownVals.data();
+	}
+
+	CSRMatrix load(const std::string &file, bool useCache, int threads){
+		if (useCache){
+			try {
+				return loadCache(file);
+			}
+			catch (const std::runtime_error&){
+				//No valid cache, fall through to parsing the file
+			}
+		}
+		CSRMatrix mat = parse(file, threads);
+		if (useCache && !writeCache(file, mat)){
+			std::cout << "Warning: failed to write matrix cache: " << cachePath(file) << std::endl;
+		}
+		return mat;
+	}
+	CSRMatrix parse(const std::string &file, int threads){
+		MappedFile mapped(file);
+		const char *p = mapped.data();
+		const char *end = p + mapped.size();
+
+		//The banner: %%MatrixMarket matrix coordinate <field> <symmetry>
+		std::string banner(p, nextLine(p, end));
+		std::transform(banner.begin(), banner.end(), banner.begin(), ::tolower);
+		if (banner.compare(0, 14, "%%matrixmarket") != 0){
+			throw std::runtime_error("Not a Matrix Market file: " + file);
+		}
+		if (banner.find("coordinate") == std::string::npos){
+			throw std::runtime_error("non-coordinate matrix is unsupported: " + file);
+		}
+		if (banner.find("complex") != std::string::npos){
+			throw std::runtime_error("complex matrix is unsupported: " + file);
+		}
+		bool pattern = banner.find("pattern") != std::string::npos;
+		bool symmetric = banner.find(" symmetric") != std::string::npos;
+		if (!symmetric && banner.find("general") == std::string::npos){
+			throw std::runtime_error("only general and symmetric matrices are supported: " + file);
+		}
+		//Skip the comments to the M N L line
+		p = nextLine(p, end);
+		while (p != end && (*p == '%' || blankLine(p, end))){
+			p = nextLine(p, end);
+		}
+		int m = 0, n = 0, l = 0;
+		if (!parseInt(p, end, m) || !parseInt(p, end, n) || !parseInt(p, end, l) || m != n || m <= 0 || l < 0){
+			throw std::runtime_error("Bad size line or non-square matrix in: " + file);
+		}
+		const char *body = nextLine(p, end);
+
+		if (threads <= 0){
+			threads = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+		}
+		//Don't bother splitting small files up too much
+		threads = std::max(std::min(threads, static_cast<int>((end - body) / (1 << 16))), 1);
+		//Split the body into roughly equal chunks starting on line boundaries
+		std::vector<const char*> bounds(threads + 1, end);
+		bounds[0] = body;
+		for (int t = 1; t < threads; ++t){
+			const char *b = body + (end - body) * t / threads;
+			bounds[t] = b == body ? body : nextLine(b - 1, end);
+		}
+		std::vector<std::vector<Entry>> entries(threads);
+		std::vector<std::string> errors(threads);
+		parallel(threads, [&](int t){
+			std::vector<Entry> &local = entries[t];
+			local.reserve((static_cast<size_t>(l) / threads) * 11 / 10 + 16);
+			const char *q = bounds[t];
+			const char *stop = bounds[t + 1];
+			while (q < stop){
+				if (blankLine(q, stop) || *skipBlanks(q, stop) == '%'){
+					q = nextLine(q, stop);
+					continue;
+				}
+				const char *s = q;
+				Entry e;
+				e.val = 1.0;
+				if (!parseInt(s, stop, e.row) || !parseInt(s, stop, e.col) || (!pattern && !parseDouble(s, stop, e.val))
+					|| e.row < 1 || e.row > n || e.col < 1 || e.col > n)
+				{
+					errors[t] = "Bad entry in: " + file;
+					return;
+				}
+				//Matrix Market is 1-indexed
+				--e.row;
+				--e.col;
+				local.push_back(e);
+				q = nextLine(s, stop);
+			}
+		});
+		for (const std::string &err : errors){
+			if (!err.empty()){
+				throw std::runtime_error(err);
+			}
+		}
+
+		//Count the entries in each row, including the mirror of each off-diagonal entry
+		//of a symmetric matrix, then scan the counts to find where the rows start
+		std::unique_ptr<std::atomic<int>[]> counts(new std::atomic<int>[n]);
+		for (int i = 0; i < n; ++i){
+			counts[i].store(0, std::memory_order_relaxed);
+		}
+		parallel(threads, [&](int t){
+			for (const Entry &e : entries[t]){
+				counts[e.row].fetch_add(1, std::memory_order_relaxed);
+				if (symmetric && e.row != e.col){
+					counts[e.col].fetch_add(1, std::memory_order_relaxed);
+				}
+			}
+		});
+		CSRMatrix mat;
+		mat.ownRows.resize(n + 1);
+		mat.ownRows[0] = 0;
+		long long total = 0;
+		for (int i = 0; i < n; ++i){
+			total += counts[i].load(std::memory_order_relaxed);
+			if (total > INT_MAX){
+				throw std::runtime_error("Too many non-zeros to index with int: " + file);
+			}
+			mat.ownRows[i + 1] = static_cast<int>(total);
+			//The counts become the next free slot of each row for the scatter
+			counts[i].store(mat.ownRows[i], std::memory_order_relaxed);
+		}
+		mat.ownCols.resize(total);
+		mat.ownVals.resize(total);
+		//Scatter the entries and their mirrors into the rows in one pass
+		parallel(threads, [&](int t){
+			for (const Entry &e : entries[t]){
+				int k = counts[e.row].fetch_add(1, std::memory_order_relaxed);
+				mat.ownCols[k] = e.col;
+				mat.ownVals[k] = e.val;
+				if (symmetric && e.row != e.col){
+					k = counts[e.col].fetch_add(1, std::memory_order_relaxed);
+					mat.ownCols[k] = e.row;
+					mat.ownVals[k] = e.val;
+				}
+			}
+			std::vector<Entry>().swap(entries[t]);
+		});
+		//The threads filled the rows in any order, so sort each row by column
+		parallel(threads, [&](int t){
+			std::vector<std::pair<int, double>> row;
+			for (int i = n * static_cast<long long>(t) / threads; i < n * static_cast<long long>(t + 1) / threads; ++i){
+				int *c = &mat.ownCols[0] + mat.ownRows[i];
+				int len = mat.ownRows[i + 1] - mat.ownRows[i];
+				if (std::is_sorted(c, c + len)){
+					continue;
+				}
+				double *v = &mat.ownVals[0] + mat.ownRows[i];
+				row.clear();
+				for (int j = 0; j < len; ++j){
+					row.push_back(std::make_pair(c[j], v[j]));
+				}
+				std::sort(row.begin(), row.end());
+				for (int j = 0; j < len; ++j){
+					c[j] = row[j].first;
+					v[j] = row[j].second;
+				}
+			}
+		});
+		mat.n = n;
+		mat.nnz = static_cast<int>(total);
+		mat.sym = symmetric;
+		return mat;
+	}
+	std::string cachePath(const std::string &file){
+		return file + ".csr";
+	}
+	CSRMatrix loadCache(const std::string &file){
+		int64_t srcSize = 0, srcTime = 0;
+		sourceInfo(file, srcSize, srcTime);
+		std::shared_ptr<MappedFile> mapped = std::make_shared<MappedFile>(cachePath(file));
+		if (mapped->size() < sizeof(CacheHeader)){
+			throw std::runtime_error("Matrix cache is truncated: " + cachePath(file));
+		}
+		CacheHeader header;
+		std::memcpy(&header, mapped->data(), sizeof(CacheHeader));
+		if (std::memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) != 0 || header.sourceSize != srcSize
+			|| header.sourceTime != srcTime || header.dim <= 0 || header.nnz < 0 || header.nnz > INT_MAX
+			|| mapped->size() != valOffset(header.dim, static_cast<int>(header.nnz)) + header.nnz * sizeof(double))
+		{
+			throw std::runtime_error("Matrix cache is stale or invalid: " + cachePath(file));
+		}
+		CSRMatrix mat;
+		mat.n = header.dim;
+		mat.nnz = static_cast<int>(header.nnz);
+		mat.sym = header.symmetric != 0;
+		mat.cached = true;
+		const char *base = mapped->data();
+		mat.rows = reinterpret_cast<const int*>(base + sizeof(CacheHeader));
+		mat.cols = mat.rows + mat.n + 1;
+		mat.vals = reinterpret_cast<const double*>(base + valOffset(mat.n, mat.nnz));
+		mat.mapping = mapped;
+		return mat;
+	}
+	bool writeCache(const std::string &file, const CSRMatrix &mat){
+		CacheHeader header;
+		std::memset(&header, 0, sizeof(CacheHeader));
+		try {
+			sourceInfo(file, header.sourceSize, header.sourceTime);
+		}
+		catch (const std::runtime_error&){
+			return false;
+		}
+		std::ofstream out(cachePath(file).c_str(), std::ios::binary | std::ios::trunc);
+		if (!out.is_open()){
+			return false;
+		}
+		//Write a blank header first and fill it in at the end, so a partly written cache is never valid
+		out.write(reinterpret_cast<const char*>(&header), sizeof(CacheHeader));
+		out.write(reinterpret_cast<const char*>(mat.rowPtr()), (mat.dim() + 1) * sizeof(int32_t));
+		out.write(reinterpret_cast<const char*>(mat.col()), static_cast<size_t>(mat.nonZeros()) * sizeof(int32_t));
+		size_t pad = valOffset(mat.dim(), mat.nonZeros()) - sizeof(CacheHeader)
+			- (static_cast<size_t>(mat.dim()) + 1 + mat.nonZeros()) * sizeof(int32_t);
+		const char zeros[8] = { 0 };
+		out.write(zeros, pad);
+		out.write(reinterpret_cast<const char*>(mat.val()), static_cast<size_t>(mat.nonZeros()) * sizeof(double));
+		std::memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+		header.dim = mat.dim();
+		header.symmetric = mat.symmetric() ? 1 : 0;
+		header.nnz = mat.nonZeros();
+		out.seekp(0);
+		out.write(reinterpret_cast<const char*>(&header), sizeof(CacheHeader));
+		return out.good();
+	}
+}
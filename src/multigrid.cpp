@@ -0,0 +1,138 @@
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include "tinycl.h"
+#include "multigrid.h"
+
+Multigrid::Multigrid(int gridDim, int smoothSteps, float omega)
+	: gridDim(gridDim), smoothSteps(smoothSteps), omega(omega), initialized(false), verbose(false)
+{
+	if (gridDim < 2 || gridDim % 2 != 0){
+		throw std::runtime_error("Multigrid needs an even grid dimension");
+	}
+}
+void Multigrid::init(tcl::Context &context, const cl::Program&){
+	if (initialized){
+		return;
+	}
+	mgProgram = context.loadProgram("../res/poisson_kernels.cl");
+	smooth_red_black = cl::Kernel(mgProgram, "smooth_red_black");
+	poisson_residual = cl::Kernel(mgProgram, "poisson_residual");
+	restrict_residual = cl::Kernel(mgProgram, "restrict_residual");
+	prolong_add = cl::Kernel(mgProgram, "prolong_add");
+	zero_level = cl::Kernel(mgProgram, "zero_level");
+
+	//Halve the grid until it's small enough to solve by smoothing or halving it would give an odd
+	//grid, the red-black coloring doesn't wrap around the edges of an odd grid so every level must be even
+	for (int n = gridDim; ; n /= 2){
+		Level level;
+		level.n = n;
+		//The finest level's b and x are given to us when solving
+		if (n != gridDim){
+			level.b = context.buffer(CL_MEM_READ_WRITE, n * n * sizeof(float), nullptr);
+			level.x = context.buffer(CL_MEM_READ_WRITE, n * n * sizeof(float), nullptr);
+		}
+		level.r = context.buffer(CL_MEM_READ_WRITE, n * n * sizeof(float), nullptr);
+		levels.push_back(level);
+		if (n <= 4 || (n / 2) % 2 != 0){
+			break;
+		}
+	}
+	initialized = true;
+}
+void Multigrid::init(tcl::Context &context){
+	init(context, cl::Program());
+}
+void Multigrid::apply(tcl::Context &context, const cl::Buffer &r, cl::Buffer &z){
+	levels[0].b = r;
+	levels[0].x = z;
+	vcycle(context, 0, true);
+}
+int Multigrid::solve(tcl::Context &context, const cl::Buffer &b, cl::Buffer &x, int maxCycles,
+	float convergeLen)
+{
+	levels[0].b = b;
+	levels[0].x = x;
+	residuals.clear();
+	float tol2 = convergeLen * convergeLen;
+	int cycles = 0;
+	while (cycles < maxCycles){
+		vcycle(context, 0, false);
+		++cycles;
+
+		residual(context, levels[0]);
+		float rLenSq = 0.f;
+		context.reduce<float>(tcl::DOT, levels[0].r, gridDim * gridDim, &rLenSq, nullptr, &levels[0].r);
+		residuals.push_back(std::sqrt(rLenSq));
+		if (rLenSq <= tol2){
+			break;
+		}
+	}
+	if (verbose){
+		std::cout << "multigrid solution took: " << cycles << " V-cycles, final residual length: "
+			<< (residuals.empty() ? 0.f : residuals.back()) << std::endl;
+	}
+	return cycles;
+}
+const std::vector<float>& Multigrid::getResidualHistory() const {
+	return residuals;
+}
+int Multigrid::getLevels() const {
+	return levels.size();
+}
+void Multigrid::setVerbose(bool v){
+	verbose = v;
+}
+void Multigrid::vcycle(tcl::Context &context, int l, bool zeroGuess){
+	Level &level = levels[l];
+	cl::NDRange grid(level.n, level.n);
+	if (zeroGuess){
+		zero_level.setArg(0, level.x);
+		context.runNDKernel(zero_level, grid, cl::NullRange, cl::NullRange);
+	}
+	//The coarsest level is tiny so just smooth it until the error is negligible
+	if (l == static_cast<int>(levels.size()) - 1){
+		int sweeps = std::max(level.n * level.n / 2, 1);
+		for (int i = 0; i < sweeps; ++i){
+			smooth(context, level, true);
+			smooth(context, level, false);
+		}
+		return;
+	}
+	for (int i = 0; i < smoothSteps; ++i){
+		smooth(context, level, true);
+	}
+	residual(context, level);
+
+	Level &coarse = levels[l + 1];
+	restrict_residual.setArg(0, level.r);
+	restrict_residual.setArg(1, coarse.b);
+	context.runNDKernel(restrict_residual, cl::NDRange(coarse.n, coarse.n), cl::NullRange, cl::NullRange);
+	vcycle(context, l + 1, true);
+	prolong_add.setArg(0, coarse.x);
+	prolong_add.setArg(1, level.x);
+	context.runNDKernel(prolong_add, grid, cl::NullRange, cl::NullRange);
+
+	//Smooth in the reverse order on the way back up to keep the cycle symmetric
+	for (int i = 0; i < smoothSteps; ++i){
+		smooth(context, level, false);
+	}
+}
+void Multigrid::smooth(tcl::Context &context, Level &level, bool forward){
+	cl::NDRange grid(level.n, level.n);
+	smooth_red_black.setArg(0, level.b);
+	smooth_red_black.setArg(1, level.x);
+	smooth_red_black.setArg(3, omega);
+	for (int c = 0; c < 2; ++c){
+		smooth_red_black.setArg(2, forward ? c : 1 - c);
+		context.runNDKernel(smooth_red_black, grid, cl::NullRange, cl::NullRange);
+	}
+}
+void Multigrid::residual(tcl::Context &context, Level &level){
+	poisson_residual.setArg(0, level.b);
+	poisson_residual.setArg(1, level.x);
+	poisson_residual.setArg(2, level.r);
+	context.runNDKernel(poisson_residual, cl::NDRange(level.n, level.n), cl::NullRange, cl::NullRange);
+}
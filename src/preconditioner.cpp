@@ -0,0 +1,161 @@
+#include <vector>
+#include <algorithm>
+#include "tinycl.h"
+#include "sparsematrix.h"
+#include "preconditioner.h"
+
+JacobiPreconditioner::JacobiPreconditioner(const std::vector<float> &diag)
+	: invDiag(diag.size()), initialized(false)
+{
+	for (size_t i = 0; i < diag.size(); ++i){
+		invDiag[i] = diag[i] != 0.f ? 1.f / diag[i] : 1.f;
+	}
+}
+JacobiPreconditioner::JacobiPreconditioner(const SparseMatrix<float> &mat)
+	: invDiag(mat.dim, 0.f), initialized(false)
+{
+	//Sum into the diagonal in case the matrix has duplicate entries
+	for (const MatrixElement<float> &e : mat.elements){
+		if (e.row == e.col){
+			invDiag[e.row] += e.val;
+		}
+	}
+	for (float &d : invDiag){
+		d = d != 0.f ? 1.f / d : 1.f;
+	}
+}
+void JacobiPreconditioner::init(tcl::Context &context, const cl::Program &program){
+	if (initialized){
+		return;
+	}
+	invDiagBuf = context.buffer(tcl::MEM::READ_ONLY, invDiag.size() * sizeof(float), &invDiag[0]);
+	jacobi_apply = cl::Kernel(program, "jacobi_apply");
+	jacobi_apply.setArg(0, invDiagBuf);
+	initialized = true;
+}
+void JacobiPreconditioner::apply(tcl::Context &context, const cl::Buffer &r, cl::Buffer &z){
+	jacobi_apply.setArg(1, r);
+	jacobi_apply.setArg(2, z);
+	context.runNDKernel(jacobi_apply, cl::NDRange(invDiag.size()), cl::NullRange, cl::NullRange);
+}
+
+MIC0Preconditioner::MIC0Preconditioner(const SparseMatrix<float> &mat, float tau)
+	: dim(mat.dim), initialized(false), rowPtr(mat.dim + 1), col(mat.nonZeros()),
+	val(mat.nonZeros())
+{
+	mat.getCSR(&rowPtr[0], &col[0], &val[0]);
+	colorRows();
+	factor(tau);
+}
+void MIC0Preconditioner::colorRows(){
+	color.assign(dim, -1);
+	std::vector<bool> used;
+	for (int i = 0; i < dim; ++i){
+		used.assign(used.size(), false);
+		for (int j = rowPtr[i]; j < rowPtr[i + 1]; ++j){
+			int c = color[col[j]];
+			if (col[j] != i && c >= 0){
+				if (c >= static_cast<int>(used.size())){
+					used.resize(c + 1, false);
+				}
+				used[c] = true;
+			}
+		}
+		color[i] = std::find(used.begin(), used.end(), false) - used.begin();
+	}
+	//Group the rows by color, colorOffsets[c] is where color c starts in rows
+	int nColors = dim > 0 ? *std::max_element(color.begin(), color.end()) + 1 : 0;
+	colorOffsets.assign(nColors + 1, 0);
+	for (int c : color){
+		++colorOffsets[c + 1];
+	}
+	for (int c = 0; c < nColors; ++c){
+		colorOffsets[c + 1] += colorOffsets[c];
+	}
+	rows.resize(dim);
+	std::vector<int> next(colorOffsets.begin(), colorOffsets.end() - 1);
+	for (int i = 0; i < dim; ++i){
+		rows[next[color[i]]++] = i;
+	}
+}
+void MIC0Preconditioner::factor(float tau){
+	//Rows with a lower color come first in the elimination order, so each row's
+	//diagonal only depends on the already factored rows of lower colors
+	std::vector<float> diag(dim, 0.f);
+	invDiag.assign(dim, 1.f);
+	for (int i : rows){
+		float aii = 0.f;
+		for (int j = rowPtr[i]; j < rowPtr[i + 1]; ++j){
+			if (col[j] == i){
+				aii += val[j];
+			}
+		}
+		float d = aii;
+		for (int j = rowPtr[i]; j < rowPtr[i + 1]; ++j){
+			int k = col[j];
+			if (color[k] >= color[i]){
+				continue;
+			}
+			float aik = val[j] / diag[k];
+			d -= aik * val[j];
+			//Eliminating row k fills in (i, n) for each later row n coupled to k, which
+			//is dropped by the incomplete factorization
+			float fill = 0.f;
+			for (int n = rowPtr[k]; n < rowPtr[k + 1]; ++n){
+				if (col[n] != i && color[col[n]] > color[k]){
+					fill += val[n];
+				}
+			}
+			d -= tau * aik * fill;
+		}
+		//If the modification made the diagonal too small fall back to the matrix diagonal
+		if (d < 0.25f * aii){
+			d = aii;
+		}
+		if (d <= 0.f){
+			d = 1.f;
+		}
+		diag[i] = d;
+		invDiag[i] = 1.f / d;
+	}
+}
+void MIC0Preconditioner::init(tcl::Context &context, const cl::Program &program){
+	if (initialized){
+		return;
+	}
+	buffers[BUFFER::ROWS] = context.buffer(tcl::MEM::READ_ONLY, rows.size() * sizeof(int), &rows[0]);
+	buffers[BUFFER::ROW_PTR] = context.buffer(tcl::MEM::READ_ONLY, rowPtr.size() * sizeof(int), &rowPtr[0]);
+	buffers[BUFFER::COL] = context.buffer(tcl::MEM::READ_ONLY, col.size() * sizeof(int), &col[0]);
+	buffers[BUFFER::VAL] = context.buffer(tcl::MEM::READ_ONLY, val.size() * sizeof(float), &val[0]);
+	buffers[BUFFER::COLOR] = context.buffer(tcl::MEM::READ_ONLY, color.size() * sizeof(int), &color[0]);
+	buffers[BUFFER::INV_DIAG] = context.buffer(tcl::MEM::READ_ONLY, invDiag.size() * sizeof(float), &invDiag[0]);
+	buffers[BUFFER::Y] = context.buffer(tcl::MEM::READ_WRITE, dim * sizeof(float), nullptr);
+
+	mic0_forward = cl::Kernel(program, "mic0_forward");
+	mic0_backward = cl::Kernel(program, "mic0_backward");
+	for (int i = BUFFER::ROWS; i <= BUFFER::INV_DIAG; ++i){
+		mic0_forward.setArg(i + 1, buffers[i]);
+		mic0_backward.setArg(i + 1, buffers[i]);
+	}
+	mic0_forward.setArg(8, buffers[BUFFER::Y]);
+	mic0_backward.setArg(7, buffers[BUFFER::Y]);
+	initialized = true;
+}
+void MIC0Preconditioner::apply(tcl::Context &context, const cl::Buffer &r, cl::Buffer &z){
+	int nColors = getColors();
+	mic0_forward.setArg(7, r);
+	for (int c = 0; c < nColors; ++c){
+		mic0_forward.setArg(0, colorOffsets[c]);
+		context.runNDKernel(mic0_forward, cl::NDRange(colorOffsets[c + 1] - colorOffsets[c]),
+			cl::NullRange, cl::NullRange);
+	}
+	mic0_backward.setArg(8, z);
+	for (int c = nColors - 1; c >= 0; --c){
+		mic0_backward.setArg(0, colorOffsets[c]);
+		context.runNDKernel(mic0_backward, cl::NDRange(colorOffsets[c + 1] - colorOffsets[c]),
+			cl::NullRange, cl::NullRange);
+	}
+}
+int MIC0Preconditioner::getColors() const {
+	return colorOffsets.size() - 1;
+}
@@ -0,0 +1,358 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include "tinycl.h"
+#include "linearoperator.h"
+#include "pressuresolver.h"
+
+namespace {
+	struct Registration {
+		std::string name;
+		std::function<bool(int)> available;
+		PressureSolver::Factory make;
+	};
+	bool isEven(int dim){
+		return dim >= 2 && dim % 2 == 0;
+	}
+	//The registry starts out with the built in solvers, made on first use so registering
+	//from other files' static initializers is safe
+	std::vector<Registration>& registry(){
+		static std::vector<Registration> solvers = {
+			{ "cg", [](int dim){ return dim >= 1; },
+				[](int dim){ return std::make_shared<CGPressureSolver>(dim, false); } },
+			{ "cg_multigrid", isEven,
+				[](int dim){ return std::make_shared<CGPressureSolver>(dim, true); } },
+			{ "multigrid", isEven,
+				[](int dim){ return std::make_shared<MultigridPressureSolver>(dim); } },
+			{ "fft", [](int dim){ return dim >= 2 && (dim & (dim - 1)) == 0; },
+				[](int dim){ return std::make_shared<FFTPressureSolver>(dim); } },
+			{ "relax_chebyshev", isEven, [](int dim){
+				return std::make_shared<RelaxationPressureSolver>(dim, RelaxationSolver::METHOD::CHEBYSHEV); } },
+			{ "relax_sor", isEven, [](int dim){
+				return std::make_shared<RelaxationPressureSolver>(dim, RelaxationSolver::METHOD::SOR); } }
+		};
+		return solvers;
+	}
+	//Parse a line of the tuning cache: gridDim chosen count [name meanTime worstResidual converged]... device
+	//The device name goes last since it can have spaces in it
+	bool parseCacheLine(const std::string &line, int &gridDim, std::string &chosen,
+		std::vector<PressureTuner::Result> &entries, std::string &device)
+	{
+		std::stringstream ss(line);
+		int count = 0;
+		if (!(ss >> gridDim >> chosen >> count) || count < 0){
+			return false;
+		}
+		entries.resize(count);
+		for (PressureTuner::Result &r : entries){
+			ss >> r.name >> r.meanTime >> r.worstResidual >> r.converged;
+		}
+		ss >> std::ws;
+		std::getline(ss, device);
+		return !ss.fail() && !device.empty();
+	}
+	//The residual length of x for the periodic Laplacian, found on the host in double
+	double residualLength(const std::vector<float> &b, const std::vector<float> &x, int dim){
+		double sum = 0;
+		for (int y = 0; y < dim; ++y){
+			int down = (y + dim - 1) % dim;
+			int up = (y + 1) % dim;
+			for (int i = 0; i < dim; ++i){
+				int left = (i + dim - 1) % dim;
+				int right = (i + 1) % dim;
+				double ax = 4.0 * x[i + y * dim] - x[left + y * dim] - x[right + y * dim]
+					- x[i + down * dim] - x[i + up * dim];
+				double r = b[i + y * dim] - ax;
+				sum += r * r;
+			}
+		}
+		return std::sqrt(sum);
+	}
+}
+
+void PressureSolver::registerSolver(const std::string &name, const std::function<bool(int)> &available,
+	const Factory &make)
+{
+	std::vector<Registration> &solvers = registry();
+	for (Registration &r : solvers){
+		if (r.name == name){
+			r.available = available;
+			r.make = make;
+			return;
+		}
+	}
+	solvers.push_back({ name, available, make });
+}
+std::vector<std::string> PressureSolver::available(int gridDim){
+	std::vector<std::string> names;
+	for (const Registration &r : registry()){
+		if (r.available(gridDim)){
+			names.push_back(r.name);
+		}
+	}
+	return names;
+}
+std::shared_ptr<PressureSolver> PressureSolver::create(const std::string &name, int gridDim){
+	for (const Registration &r : registry()){
+		if (r.name == name){
+			return r.available(gridDim) ? r.make(gridDim) : nullptr;
+		}
+	}
+	return nullptr;
+}
+
+CGPressureSolver::CGPressureSolver(int gridDim, bool multigrid) : gridDim(gridDim), multigrid(multigrid)
+{}
+std::string CGPressureSolver::name() const {
+	return multigrid ? "cg_multigrid" : "cg";
+}
+void CGPressureSolver::init(tcl::Context &context){
+	if (solver){
+		return;
+	}
+	solver = std::make_shared<CGSolver>(std::make_shared<LaplacianOperator>(gridDim), std::vector<float>(), context);
+	//The pressure changes little between frames so start from the last frame's pressure
+	solver->setInitialGuess(CGSolver::GUESS::PREVIOUS);
+	if (multigrid){
+		solver->setPreconditioner(std::make_shared<Multigrid>(gridDim));
+	}
+}
+void CGPressureSolver::solve(tcl::Context &context, const cl::Buffer &b, cl::Buffer &x){
+	cl::Buffer bBuf = b;
+	solver->updateB(bBuf);
+	//x may have been written by another solver since our last solve, so start from it
+	solver->setGuess(x);
+	solver->solve();
+	context.mQueue.enqueueCopyBuffer(solver->getResultBuffer(), x, 0, 0, gridDim * gridDim * sizeof(float));
+}
+SolveStats CGPressureSolver::getStats() const {
+	return solver ? solver->getStats() : SolveStats();
+}
+CGSolver& CGPressureSolver::getSolver(){
+	return *solver;
+}
+
+MultigridPressureSolver::MultigridPressureSolver(int gridDim, int maxCycles, float convergeLen)
+	: multigrid(gridDim), maxCycles(maxCycles), convergeLen(convergeLen)
+{}
+std::string MultigridPressureSolver::name() const {
+	return "multigrid";
+}
+void MultigridPressureSolver::init(tcl::Context &context){
+	multigrid.init(context);
+}
+void MultigridPressureSolver::solve(tcl::Context &context, const cl::Buffer &b, cl::Buffer &x){
+	stats = SolveStats();
+	stats.iterations = multigrid.solve(context, b, x, maxCycles, convergeLen);
+	const std::vector<float> &history = multigrid.getResidualHistory();
+	stats.finalResidual = history.empty() ? 0 : history.back();
+	stats.tolerance = convergeLen;
+	stats.converged = stats.finalResidual <= convergeLen;
+}
+SolveStats MultigridPressureSolver::getStats() const {
+	return stats;
+}
+
+FFTPressureSolver::FFTPressureSolver(int gridDim) : fft(gridDim)
+{}
+std::string FFTPressureSolver::name() const {
+	return "fft";
+}
+void FFTPressureSolver::init(tcl::Context &context){
+	fft.init(context);
+}
+void FFTPressureSolver::solve(tcl::Context &context, const cl::Buffer &b, cl::Buffer &x){
+	fft.solve(context, b, x);
+}
+SolveStats FFTPressureSolver::getStats() const {
+	SolveStats stats;
+	stats.converged = true;
+	return stats;
+}
+
+RelaxationPressureSolver::RelaxationPressureSolver(int gridDim, RelaxationSolver::METHOD method, int sweeps,
+	float convergeLen, int statsInterval)
+	: relax(gridDim, method, sweeps), method(method), convergeLen(convergeLen),
+	statsInterval(statsInterval), solves(0)
+{
+	//Never check the residual during the sweeps, so they're queued back to back
+	relax.setResidualCheck(0, convergeLen);
+	stats.tolerance = convergeLen;
+}
+std::string RelaxationPressureSolver::name() const {
+	return method == RelaxationSolver::METHOD::SOR ? "relax_sor" : "relax_chebyshev";
+}
+void RelaxationPressureSolver::init(tcl::Context &context){
+	relax.init(context);
+}
+void RelaxationPressureSolver::solve(tcl::Context &context, const cl::Buffer &b, cl::Buffer &x){
+	stats.iterations = relax.solve(context, b, x);
+	++solves;
+	//Reading back the residual syncs with the host, so the stats keep the last one found
+	//in between checks
+	if (statsInterval > 0 && solves % statsInterval == 0){
+		stats.finalResidual = relax.residualLength(context, b, x);
+		stats.converged = stats.finalResidual <= convergeLen;
+	}
+}
+SolveStats RelaxationPressureSolver::getStats() const {
+	return stats;
+}
+
+PressureTuner::PressureTuner(int gridDim, float relTol, int frames, int warmup)
+	: gridDim(gridDim), frames(std::max(frames, 1)), warmup(std::max(warmup, 0)), relTol(relTol), cached(false)
+{}
+std::shared_ptr<PressureSolver> PressureTuner::select(tcl::Context &context, const std::string &cacheFile){
+	//The info strings can come back with their null terminator included
+	std::string device = context.mDevices.at(0).getInfo<CL_DEVICE_NAME>().c_str();
+	cached = false;
+	results.clear();
+	if (!cacheFile.empty()){
+		std::string name = readCache(cacheFile, device);
+		std::shared_ptr<PressureSolver> solver = PressureSolver::create(name, gridDim);
+		//The entry may be stale, eg. after a driver update, so re-tune if the cached choice fails
+		if (solver){
+			try {
+				solver->init(context);
+				cached = true;
+				return solver;
+			}
+			catch (const cl::Error &e){
+				std::cout << "Error: cached pressure solver " << name << " failed with OpenCL error " << e.err()
+					<< " in " << e.what() << ", re-tuning" << std::endl;
+			}
+			catch (const std::runtime_error &e){
+				std::cout << "Error: cached pressure solver " << name << " failed: " << e.what()
+					<< ", re-tuning" << std::endl;
+			}
+		}
+		results.clear();
+	}
+	std::shared_ptr<PressureSolver> best;
+	Result bestResult;
+	for (const std::string &name : PressureSolver::available(gridDim)){
+		std::shared_ptr<PressureSolver> solver = PressureSolver::create(name, gridDim);
+		Result res = { name, 0, 0, false };
+		try {
+			res = measure(context, *solver);
+		}
+		catch (const cl::Error &e){
+			std::cout << "Error: pressure solver " << name << " failed with OpenCL error " << e.err()
+				<< " in " << e.what() << std::endl;
+			continue;
+		}
+		catch (const std::runtime_error &e){
+			std::cout << "Error: pressure solver " << name << " failed: " << e.what() << std::endl;
+			continue;
+		}
+		//Prefer anything that converges, then the faster of those or the more accurate of those that don't
+		bool better = !best || (res.converged && !bestResult.converged)
+			|| (res.converged == bestResult.converged && (res.converged ? res.meanTime < bestResult.meanTime
+			: res.worstResidual < bestResult.worstResidual));
+		if (better){
+			best = solver;
+			bestResult = res;
+		}
+		results.push_back(res);
+	}
+	if (!best){
+		throw std::runtime_error("PressureTuner: no pressure solver could solve a "
+			+ std::to_string(gridDim) + "x" + std::to_string(gridDim) + " grid");
+	}
+	if (!cacheFile.empty()){
+		writeCache(cacheFile, device, best->name());
+	}
+	return best;
+}
+const std::vector<PressureTuner::Result>& PressureTuner::getResults() const {
+	return results;
+}
+bool PressureTuner::fromCache() const {
+	return cached;
+}
+PressureTuner::Result PressureTuner::measure(tcl::Context &context, PressureSolver &solver){
+	typedef std::chrono::high_resolution_clock clock;
+	int n = gridDim * gridDim;
+	solver.init(context);
+	cl::Buffer b = context.buffer(tcl::MEM::READ_ONLY, n * sizeof(float), nullptr);
+	std::vector<float> zero(n, 0.f);
+	cl::Buffer x = context.buffer(tcl::MEM::READ_WRITE, n * sizeof(float), &zero[0], 0, true);
+
+	Result res = { solver.name(), 0, 0, true };
+	std::vector<float> bHost(n), xHost(n);
+	for (int f = 0; f < warmup + frames; ++f){
+		//A zero sum field drifting across the grid, like the divergence of consecutive frames
+		double bLen = 0;
+		for (int i = 0; i < n; ++i){
+			float px = 6.2831853f * (i % gridDim + 0.3f * f) / gridDim;
+			float py = 6.2831853f * (i / gridDim) / gridDim;
+			bHost[i] = std::sin(px) * std::cos(py) + 0.5f * std::sin(2.f * px + py);
+			bLen += static_cast<double>(bHost[i]) * bHost[i];
+		}
+		bLen = std::sqrt(bLen);
+		context.writeData(b, n * sizeof(float), &bHost[0], 0, true);
+
+		clock::time_point start = clock::now();
+		solver.solve(context, b, x);
+		context.mQueue.finish();
+		clock::time_point end = clock::now();
+		if (f < warmup){
+			continue;
+		}
+		res.meanTime += std::chrono::duration<double, std::milli>(end - start).count() / frames;
+		context.readData(x, n * sizeof(float), &xHost[0], 0, true);
+		double rel = residualLength(bHost, xHost, gridDim) / std::max(bLen, 1e-30);
+		res.worstResidual = std::max(res.worstResidual, rel);
+		res.converged = res.converged && rel <= relTol;
+	}
+	return res;
+}
+std::string PressureTuner::readCache(const std::string &cacheFile, const std::string &device){
+	std::ifstream in(cacheFile.c_str());
+	std::string line;
+	while (std::getline(in, line)){
+		int dim = 0;
+		std::string chosen, name;
+		std::vector<Result> entries;
+		if (parseCacheLine(line, dim, chosen, entries, name) && dim == gridDim && name == device){
+			results = entries;
+			return chosen;
+		}
+	}
+	return "";
+}
+void PressureTuner::writeCache(const std::string &cacheFile, const std::string &device,
+	const std::string &chosen) const
+{
+	//Keep the entries of other devices and grids
+	std::vector<std::string> lines;
+	std::ifstream in(cacheFile.c_str());
+	std::string line;
+	while (std::getline(in, line)){
+		int dim = 0;
+		std::string c, name;
+		std::vector<Result> entries;
+		if (parseCacheLine(line, dim, c, entries, name) && !(dim == gridDim && name == device)){
+			lines.push_back(line);
+		}
+	}
+	in.close();
+
+	std::ofstream out(cacheFile.c_str());
+	if (!out.is_open()){
+		std::cout << "Error: couldn't write the pressure solver cache " << cacheFile << std::endl;
+		return;
+	}
+	for (const std::string &l : lines){
+		out << l << "\n";
+	}
+	out << gridDim << " " << chosen << " " << results.size();
+	for (const Result &r : results){
+		out << " " << r.name << " " << r.meanTime << " " << r.worstResidual << " " << r.converged;
+	}
+	out << " " << device << "\n";
+}
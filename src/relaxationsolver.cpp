@@ -0,0 +1,127 @@
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include "tinycl.h"
+#include "relaxationsolver.h"
+
+RelaxationSolver::RelaxationSolver(int gridDim, METHOD method, int sweeps)
+	: gridDim(gridDim), sweeps(sweeps), checkInterval(0), method(method), convergeLen(1e-5),
+	initialized(false)
+{
+	if (gridDim < 2 || gridDim % 2 != 0){
+		throw std::runtime_error("RelaxationSolver needs an even grid dimension");
+	}
+	const float pi = 3.14159265f;
+	//The smallest non-zero eigenvalue is the lowest frequency mode along one axis, and
+	//the largest the highest frequency along both
+	minEigen = 2.f - 2.f * std::cos(2.f * pi / gridDim);
+	maxEigen = 8.f;
+	//The Jacobi iteration's largest eigenvalue outside the nullspace is rho = 1 - minEigen / 4
+	//= (1 + cos(2pi / dim)) / 2, giving the optimal SOR weight 2 / (1 + sqrt(1 - rho^2))
+	//1 - rho = sin^2(pi / dim) is found directly so large grids don't lose it to rounding
+	float gap = std::sin(pi / gridDim) * std::sin(pi / gridDim);
+	omega = 2.f / (1.f + std::sqrt(gap * (2.f - gap)));
+}
+void RelaxationSolver::init(tcl::Context &context){
+	if (initialized){
+		return;
+	}
+	poissonProgram = context.loadProgram("../res/poisson_kernels.cl");
+	smooth_red_black = cl::Kernel(poissonProgram, "smooth_red_black");
+	chebyshev_step = cl::Kernel(poissonProgram, "chebyshev_step");
+	poisson_residual = cl::Kernel(poissonProgram, "poisson_residual");
+
+	int dim = gridDim * gridDim;
+	cheb[0] = context.buffer(CL_MEM_READ_WRITE, dim * sizeof(float), nullptr);
+	cheb[1] = context.buffer(CL_MEM_READ_WRITE, dim * sizeof(float), nullptr);
+	r = context.buffer(CL_MEM_READ_WRITE, dim * sizeof(float), nullptr);
+	initialized = true;
+}
+int RelaxationSolver::solve(tcl::Context &context, const cl::Buffer &b, cl::Buffer &x){
+	cl::NDRange grid(gridDim, gridDim);
+	residuals.clear();
+	float tol2 = convergeLen * convergeLen;
+	//With no residual check we just queue the whole budget, never waiting on the device
+	int interval = checkInterval > 0 ? checkInterval : sweeps;
+	smooth_red_black.setArg(0, b);
+	smooth_red_black.setArg(3, omega);
+	chebyshev_step.setArg(0, b);
+	//The iterates rotate through x and the two work buffers, x_k is in buffers[cur]
+	//and x_k-1 in buffers[prev]
+	cl::Buffer buffers[3] = { x, cheb[0], cheb[1] };
+	int prev = 0, cur = 0;
+	float chebOmega = 1.f;
+	float gamma = 2.f / (maxEigen + minEigen);
+	float sigma = (maxEigen - minEigen) / (maxEigen + minEigen);
+
+	int done = 0;
+	while (done < sweeps){
+		int n = std::min(interval, sweeps - done);
+		for (int i = 0; i < n; ++i){
+			if (method == METHOD::SOR){
+				smooth_red_black.setArg(1, x);
+				for (int c = 0; c < 2; ++c){
+					smooth_red_black.setArg(2, c);
+					context.runNDKernel(smooth_red_black, grid, cl::NullRange, cl::NullRange);
+				}
+			}
+			else {
+				//omega_1 = 1, omega_2 = 1 / (1 - sigma^2 / 2), omega_k+1 = 1 / (1 - sigma^2 omega_k / 4)
+				if (done + i == 1){
+					chebOmega = 1.f / (1.f - sigma * sigma / 2.f);
+				}
+				else if (done + i > 1){
+					chebOmega = 1.f / (1.f - sigma * sigma * chebOmega / 4.f);
+				}
+				//Write to whichever buffer isn't holding x_k or x_k-1, on the first step they're both x
+				int next = prev == cur ? 1 : 3 - prev - cur;
+				chebyshev_step.setArg(1, buffers[cur]);
+				chebyshev_step.setArg(2, buffers[prev]);
+				chebyshev_step.setArg(3, buffers[next]);
+				chebyshev_step.setArg(4, chebOmega);
+				chebyshev_step.setArg(5, gamma);
+				context.runNDKernel(chebyshev_step, grid, cl::NullRange, cl::NullRange);
+				prev = cur;
+				cur = next;
+			}
+		}
+		done += n;
+		if (checkInterval > 0){
+			residuals.push_back(residualLength(context, b, buffers[cur]));
+			if (residuals.back() * residuals.back() <= tol2){
+				break;
+			}
+		}
+	}
+	//Put the result back in x if the Chebyshev iteration left it in a work buffer
+	if (cur != 0){
+		context.mQueue.enqueueCopyBuffer(buffers[cur], x, 0, 0, gridDim * gridDim * sizeof(float));
+	}
+	return done;
+}
+void RelaxationSolver::setMethod(METHOD m){
+	method = m;
+}
+void RelaxationSolver::setSweeps(int s){
+	sweeps = std::max(s, 1);
+}
+void RelaxationSolver::setOmega(float w){
+	omega = w;
+}
+void RelaxationSolver::setResidualCheck(int interval, float len){
+	checkInterval = std::max(interval, 0);
+	convergeLen = len;
+}
+const std::vector<float>& RelaxationSolver::getResidualHistory() const {
+	return residuals;
+}
+float RelaxationSolver::residualLength(tcl::Context &context, const cl::Buffer &b, const cl::Buffer &x){
+	poisson_residual.setArg(0, b);
+	poisson_residual.setArg(1, x);
+	poisson_residual.setArg(2, r);
+	context.runNDKernel(poisson_residual, cl::NDRange(gridDim, gridDim), cl::NullRange, cl::NullRange);
+	float rLenSq = 0.f;
+	context.reduce<float>(tcl::DOT, r, gridDim * gridDim, &rLenSq, nullptr, &r);
+	return std::sqrt(rLenSq);
+}
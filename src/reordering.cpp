@@ -0,0 +1,233 @@
+#include <vector>
+#include <algorithm>
+#include "reordering.h"
+
+namespace {
+	//The graph of a matrix restricted to the rows with some part label, used to run
+	//the searches on just one part of the matrix during nested dissection
+	struct Graph {
+		const std::vector<int> &rowPtr, &col;
+		const std::vector<int> &part;
+		int label;
+
+		Graph(const std::vector<int> &rowPtr, const std::vector<int> &col, const std::vector<int> &part, int label)
+			: rowPtr(rowPtr), col(col), part(part), label(label)
+		{}
+		bool contains(int v) const {
+			return part[v] == label;
+		}
+		int degree(int v) const {
+			int d = 0;
+			for (int j = rowPtr[v]; j < rowPtr[v + 1]; ++j){
+				d += col[j] != v && contains(col[j]) ? 1 : 0;
+			}
+			return d;
+		}
+	};
+	//Breadth first search from start over the unvisited rows of the graph, appending them to
+	//order with the neighbors of each row visited by increasing degree. levelStart gets the
+	//position in order where each level starts, with one past the end at the back
+	void bfs(const Graph &g, int start, std::vector<char> &visited, std::vector<int> &order,
+		std::vector<int> &levelStart)
+	{
+		levelStart.assign(1, order.size());
+		order.push_back(start);
+		visited[start] = 1;
+		std::vector<std::pair<int, int>> neighbors;
+		size_t begin = levelStart[0], end = order.size();
+		while (begin < end){
+			for (size_t head = begin; head < end; ++head){
+				int v = order[head];
+				neighbors.clear();
+				for (int j = g.rowPtr[v]; j < g.rowPtr[v + 1]; ++j){
+					int u = g.col[j];
+					if (!visited[u] && g.contains(u)){
+						visited[u] = 1;
+						neighbors.push_back(std::make_pair(g.degree(u), u));
+					}
+				}
+				std::sort(neighbors.begin(), neighbors.end());
+				for (const std::pair<int, int> &n : neighbors){
+					order.push_back(n.second);
+				}
+			}
+			levelStart.push_back(end);
+			begin = end;
+			end = order.size();
+		}
+	}
+	//Find a pseudo-peripheral row in the component of start with George and Liu's method,
+	//repeatedly searching from the least connected row of the last level while the
+	//# of levels grows. levelStart and order get the search from the row returned
+	int peripheral(const Graph &g, int start, std::vector<char> &visited, std::vector<int> &order,
+		std::vector<int> &levelStart)
+	{
+		size_t base = order.size();
+		int levels = 0;
+		while (true){
+			order.resize(base);
+			bfs(g, start, visited, order, levelStart);
+			int found = levelStart.size() - 1;
+			int next = start;
+			if (found > levels){
+				int best = -1;
+				for (int k = levelStart[found - 1]; k < levelStart[found]; ++k){
+					int d = g.degree(order[k]);
+					if (best < 0 || d < best){
+						best = d;
+						next = order[k];
+					}
+				}
+			}
+			if (found <= levels || next == start){
+				return start;
+			}
+			levels = found;
+			start = next;
+			//Clear the search so it can be run again from the new start
+			for (size_t k = base; k < order.size(); ++k){
+				visited[order[k]] = 0;
+			}
+		}
+	}
+	//Append the reverse Cuthill-McKee order of the rows of nodes to order
+	void rcm(const Graph &g, const std::vector<int> &nodes, std::vector<char> &visited, std::vector<int> &order){
+		size_t base = order.size();
+		std::vector<int> levelStart;
+		//Start each component from its least connected row
+		std::vector<std::pair<int, int>> byDegree;
+		for (int v : nodes){
+			byDegree.push_back(std::make_pair(g.degree(v), v));
+		}
+		std::sort(byDegree.begin(), byDegree.end());
+		for (const std::pair<int, int> &s : byDegree){
+			if (!visited[s.second]){
+				peripheral(g, s.second, visited, order, levelStart);
+			}
+		}
+		std::reverse(order.begin() + base, order.end());
+	}
+	void dissect(const std::vector<int> &rowPtr, const std::vector<int> &col, std::vector<int> &part,
+		int label, int &nextLabel, const std::vector<int> &nodes, int leafSize, std::vector<char> &visited,
+		std::vector<int> &order);
+	//Order the rows of a connected part of the graph by nested dissection, appending them to order
+	void dissectConnected(const std::vector<int> &rowPtr, const std::vector<int> &col, std::vector<int> &part,
+		int label, int &nextLabel, const std::vector<int> &nodes, int leafSize, std::vector<char> &visited,
+		std::vector<int> &order)
+	{
+		Graph g(rowPtr, col, part, label);
+		//Search from a peripheral row of the part, starting at its least connected row
+		int start = nodes[0];
+		int startDegree = g.degree(start);
+		for (int v : nodes){
+			int d = g.degree(v);
+			if (d < startDegree){
+				start = v;
+				startDegree = d;
+			}
+		}
+		std::vector<int> levels, levelStart;
+		peripheral(g, start, visited, levels, levelStart);
+		int nLevels = levelStart.size() - 1;
+		for (int v : levels){
+			visited[v] = 0;
+		}
+		//Too few levels to split on, like a dense block, so order it as a leaf
+		if (nLevels < 3){
+			rcm(g, nodes, visited, order);
+			return;
+		}
+		//The separator is the first level that takes the rows searched past half the part
+		int mid = 1;
+		while (mid < nLevels - 2 && levelStart[mid + 1] < static_cast<int>(nodes.size()) / 2){
+			++mid;
+		}
+		int near = nextLabel++, far = nextLabel++, sep = nextLabel++;
+		std::vector<int> nearNodes, farNodes, sepNodes;
+		for (int k = 0; k < nLevels; ++k){
+			int l = k < mid ? near : k == mid ? sep : far;
+			std::vector<int> &dst = k < mid ? nearNodes : k == mid ? sepNodes : farNodes;
+			for (int m = levelStart[k]; m < levelStart[k + 1]; ++m){
+				part[levels[m]] = l;
+				dst.push_back(levels[m]);
+			}
+		}
+		dissect(rowPtr, col, part, near, nextLabel, nearNodes, leafSize, visited, order);
+		dissect(rowPtr, col, part, far, nextLabel, farNodes, leafSize, visited, order);
+		for (int v : sepNodes){
+			order.push_back(v);
+		}
+	}
+	//Order the rows of part label of the graph by nested dissection, appending them to order.
+	//The part is split into its connected components first so each is dissected on its own
+	void dissect(const std::vector<int> &rowPtr, const std::vector<int> &col, std::vector<int> &part,
+		int label, int &nextLabel, const std::vector<int> &nodes, int leafSize, std::vector<char> &visited,
+		std::vector<int> &order)
+	{
+		Graph g(rowPtr, col, part, label);
+		if (static_cast<int>(nodes.size()) <= leafSize){
+			rcm(g, nodes, visited, order);
+			return;
+		}
+		std::vector<std::vector<int>> components;
+		std::vector<int> levelStart;
+		for (int v : nodes){
+			if (!visited[v]){
+				components.push_back(std::vector<int>());
+				bfs(g, v, visited, components.back(), levelStart);
+			}
+		}
+		for (int v : nodes){
+			visited[v] = 0;
+		}
+		if (components.size() == 1){
+			dissectConnected(rowPtr, col, part, label, nextLabel, nodes, leafSize, visited, order);
+			return;
+		}
+		for (const std::vector<int> &c : components){
+			int l = nextLabel++;
+			for (int v : c){
+				part[v] = l;
+			}
+			if (static_cast<int>(c.size()) <= leafSize){
+				rcm(Graph(rowPtr, col, part, l), c, visited, order);
+			}
+			else {
+				dissectConnected(rowPtr, col, part, l, nextLabel, c, leafSize, visited, order);
+			}
+		}
+	}
+}
+
+namespace reorder {
+	std::vector<int> reverseCuthillMcKee(const std::vector<int> &rowPtr, const std::vector<int> &col){
+		int n = rowPtr.size() - 1;
+		std::vector<int> part(n, 0), nodes(n), order;
+		for (int i = 0; i < n; ++i){
+			nodes[i] = i;
+		}
+		std::vector<char> visited(n, 0);
+		order.reserve(n);
+		rcm(Graph(rowPtr, col, part, 0), nodes, visited, order);
+		return order;
+	}
+	std::vector<int> nestedDissection(const std::vector<int> &rowPtr, const std::vector<int> &col, int leafSize){
+		int n = rowPtr.size() - 1;
+		std::vector<int> part(n, 0), nodes(n), order;
+		for (int i = 0; i < n; ++i){
+			nodes[i] = i;
+		}
+		std::vector<char> visited(n, 0);
+		order.reserve(n);
+		int nextLabel = 1;
+		dissect(rowPtr, col, part, 0, nextLabel, nodes, std::max(leafSize, 1), visited, order);
+		return order;
+	}
+	std::vector<int> inverse(const std::vector<int> &perm){
+		std::vector<int> inv(perm.size());
+		for (size_t i = 0; i < perm.size(); ++i){
+			inv[perm[i]] = i;
+		}
+		return inv;
+	}
+}
@@ -1,5 +1,7 @@
 #include <iostream>
 #include <array>
+#include <memory>
+#include <algorithm>
 #include <GL/glew.h>
 #include <SOIL.h>
 #include <SDL.h>
@@ -8,12 +10,13 @@
 #include "util.h"
 #include "tinycl.h"
 #include "window.h"
-#include "sparsematrix.h"
+#include "pressuresolver.h"
 #include "simplefluid.h"
 
 SimpleFluid::SimpleFluid(int dim, Window &win) 
 	: context(tcl::DEVICE::GPU, true, false), dim(dim), window(win),
-	interactionMat(createInteractionMatrix()), cgSolver(interactionMat, std::vector<float>(), context)
+	pressureGuess(CGSolver::GUESS::PREVIOUS), pressureBudget(false), pressureSolver(0),
+	maxCFL(0.f), cflHigh(false)
 {}
 SimpleFluid::~SimpleFluid(){
 	glDeleteProgram(quadShader);
@@ -39,6 +42,9 @@ void SimpleFluid::runSim(){
 				quit = true;
 			}
 			//Controls: 1-4 will pick brush colors, q will toggle painting off/on
+			//g will cycle the pressure solve's initial guess between zero, previous and extrapolated
+			//f will cycle through the pressure solvers available for the grid
+			//b will toggle giving the CG pressure solves a fixed share of the frame time
 			if (e.type == SDL_KEYDOWN){
 				bool updateBrush = false;
 				float brush[3];
@@ -70,6 +76,30 @@ void SimpleFluid::runSim(){
 				case SDLK_q:
 					paintFluid = !paintFluid;
 					break;
+				case SDLK_g:
+					pressureGuess = static_cast<CGSolver::GUESS>((pressureGuess + 1) % 3);
+					for (std::shared_ptr<PressureSolver> &s : pressureSolvers){
+						CGPressureSolver *cg = dynamic_cast<CGPressureSolver*>(s.get());
+						if (cg){
+							cg->getSolver().setInitialGuess(pressureGuess);
+						}
+					}
+					break;
+				case SDLK_f:
+					pressureSolver = (pressureSolver + 1) % pressureSolvers.size();
+					std::cout << "solving pressure with " << pressureSolvers[pressureSolver]->name() << std::endl;
+					break;
+				case SDLK_b:
+					//Of a 33ms frame leave the rest for the other steps and drawing
+					pressureBudget = !pressureBudget;
+					for (std::shared_ptr<PressureSolver> &s : pressureSolvers){
+						CGPressureSolver *cg = dynamic_cast<CGPressureSolver*>(s.get());
+						if (cg){
+							cg->getSolver().setBudget(pressureBudget ? 10.0 : 0.0, 1e-4f);
+						}
+					}
+					std::cout << "pressure solve time budget " << (pressureBudget ? "on" : "off") << std::endl;
+					break;
 				default:
 					break;
 				}
@@ -104,6 +134,7 @@ void SimpleFluid::runSim(){
 		apply_force.setArg(3, velY[out]);
 		
 		stepSim(1 / 30.f);
+		checkCFL(out, 1 / 30.f);
 
 		//Make sure OpenCL is done with our GL Objects
 		context.mQueue.finish();
@@ -116,6 +147,7 @@ void SimpleFluid::runSim(){
 		SDL_Delay(30);
 		std::swap(in, out);
 	}
+	printSolveStats();
 }
 void SimpleFluid::initGL(){
 	GLint progStatus = util::loadProgram("../res/quad_v.glsl", "../res/quad_f.glsl");
@@ -208,12 +240,16 @@ void SimpleFluid::initCLBuffers(){
 #endif
 
 	velNegDivergence = context.buffer(tcl::MEM::READ_WRITE, dim * dim * sizeof(float), nullptr);
+	//Solvers that warm start read the last pressure so it must start out zeroed
+	std::vector<float> zeroPressure(dim * dim, 0.f);
+	pressure = context.buffer(tcl::MEM::READ_WRITE, dim * dim * sizeof(float), &zeroPressure[0], 0, true);
 
 	float color[] = { 1.f, 1.f, 1.f, 1.f };
 	int macDim[] = { dim, dim };
 	brushColor = context.buffer(tcl::MEM::READ_ONLY, 4 * sizeof(float), color);
 	clickForce = context.buffer(tcl::MEM::READ_ONLY, 2 * sizeof(float), nullptr);
 	gridDim = context.buffer(tcl::MEM::READ_ONLY, 2 * sizeof(int), macDim);
+	velRange = context.buffer(tcl::MEM::READ_WRITE, 4 * sizeof(float), nullptr);
 }
 void SimpleFluid::initCLKernels(){
 	clProg = context.loadProgram("../res/simple_fluid.cl");
@@ -228,7 +264,36 @@ void SimpleFluid::initCLKernels(){
 	apply_force = cl::Kernel(clProg, "apply_force");
 
 	velocity_divergence.setArg(2, velNegDivergence);
-	cgSolver.updateB(velNegDivergence);
+	//Pick the fastest solver for the grid on this device, the choice is cached so only
+	//the first run on a device tunes. The rest are set up too so they can be switched to,
+	//skipping any that fail to initialize like the tuner skips solvers that fail
+	PressureTuner tuner(dim);
+	std::shared_ptr<PressureSolver> best = tuner.select(context);
+	std::cout << "solving pressure with " << best->name()
+		<< (tuner.fromCache() ? " (cached choice)" : " (tuned)") << std::endl;
+	for (const std::string &name : PressureSolver::available(dim)){
+		if (name == best->name()){
+			pressureSolver = pressureSolvers.size();
+			pressureSolvers.push_back(best);
+		}
+		else {
+			std::shared_ptr<PressureSolver> solver = PressureSolver::create(name, dim);
+			try {
+				solver->init(context);
+			}
+			catch (const cl::Error &e){
+				std::cout << "Error: pressure solver " << name << " failed with OpenCL error " << e.err()
+					<< " in " << e.what() << std::endl;
+				continue;
+			}
+			catch (const std::runtime_error &e){
+				std::cout << "Error: pressure solver " << name << " failed: " << e.what() << std::endl;
+				continue;
+			}
+			pressureSolvers.push_back(solver);
+		}
+	}
+	pressureFrames.assign(pressureSolvers.size(), 0);
 	//Note: Some properties flip in/out buffers each step so those params aren't set here
 	//TODO: Configurable rho values, should probably also effect force application
 	float rho = 1.f;
@@ -236,11 +301,11 @@ void SimpleFluid::initCLKernels(){
 	float dt = 1.f / 30.f;
 	subtract_pressure_x.setArg(0, rho);
 	subtract_pressure_x.setArg(1, dt);
-	subtract_pressure_x.setArg(3, cgSolver.getResultBuffer());
+	subtract_pressure_x.setArg(3, pressure);
 	
 	subtract_pressure_y.setArg(0, rho);
 	subtract_pressure_y.setArg(1, dt);
-	subtract_pressure_y.setArg(3, cgSolver.getResultBuffer());
+	subtract_pressure_y.setArg(3, pressure);
 
 	advect_field.setArg(0, dt);
 	advect_vx.setArg(0, dt);
@@ -269,12 +334,42 @@ void SimpleFluid::stepSim(float dt){
 	context.mQueue.enqueueReleaseGLObjects(&clglObjs);
 
 	//Project
-	//Some unitialized values are making their way into the solver or something, keep getting 1.#QNAN
+	//The periodic pressure system is singular, so any mean the divergence picks up can't be solved
+	//for. CG projects it out rather than iterating on it until it blows up to NaN
 	context.runNDKernel(velocity_divergence, cl::NDRange(dim, dim), cl::NullRange, cl::NullRange);
-	cgSolver.solve();
+	//Every solver writes to the same pressure buffer so the pressure subtraction doesn't need
+	//to know which solver ran, and each can warm start from the last frame's pressure
+	pressureSolvers[pressureSolver]->solve(context, velNegDivergence, pressure);
+	++pressureFrames[pressureSolver];
+	if (dynamic_cast<CGPressureSolver*>(pressureSolvers[pressureSolver].get())){
+		solveStats[pressureGuess].add(pressureSolvers[pressureSolver]->getStats());
+	}
 	context.runNDKernel(subtract_pressure_x, cl::NDRange(dim + 1, dim), cl::NullRange, cl::NullRange);
 	context.runNDKernel(subtract_pressure_y, cl::NDRange(dim, dim + 1), cl::NullRange, cl::NullRange);
 }
+void SimpleFluid::checkCFL(int out, float dt){
+	if (velRangeRead() != nullptr){
+		velRangeRead.wait();
+		//Velocities are in cells per second, so the CFL number is the most cells moved in a step
+		float maxVel = 0.f;
+		for (float v : velRangeHost){
+			maxVel = std::max(maxVel, std::abs(v));
+		}
+		float cfl = maxVel * dt;
+		maxCFL = std::max(maxCFL, cfl);
+		if (cfl > 1.f && !cflHigh){
+			std::cout << "Warning: CFL number " << cfl << " is over 1, advection will be inaccurate"
+				<< std::endl;
+		}
+		cflHigh = cfl > 1.f;
+	}
+	size_t n = dim * (dim + 1);
+	context.reduce<float>(tcl::MAX, velX[out], n, velRange, 0);
+	context.reduce<float>(tcl::MIN, velX[out], n, velRange, 1);
+	context.reduce<float>(tcl::MAX, velY[out], n, velRange, 2);
+	context.reduce<float>(tcl::MIN, velY[out], n, velRange, 3);
+	context.readData(velRange, 4 * sizeof(float), &velRangeHost[0], 0, false, nullptr, &velRangeRead);
+}
 void SimpleFluid::clickFluid(){
 	//Must call GetRelativeMouseState each frame to update the mouse deltas
 	//even if we didn't click, otherwise we get spikes
@@ -316,21 +411,6 @@ void SimpleFluid::clickFluid(){
 		}
 	}
 }
-SparseMatrix<float> SimpleFluid::createInteractionMatrix(){
-	std::vector<MatrixElement<float>> elems;
-	int nCells = dim * dim;
-	for (int i = 0; i < nCells; ++i){
-		//In the matrix all diagonal entires are 4 and neighbor cells are -1
-		elems.push_back(MatrixElement<float>(i, i, 4));
-		int x, y;
-		cellPos(i, x, y);
-		elems.push_back(MatrixElement<float>(i, cellNumber(x - 1, y), -1));
-		elems.push_back(MatrixElement<float>(i, cellNumber(x + 1, y), -1));
-		elems.push_back(MatrixElement<float>(i, cellNumber(x, y - 1), -1));
-		elems.push_back(MatrixElement<float>(i, cellNumber(x, y + 1), -1));
-	}
-	return SparseMatrix<float>(elems, dim, true);
-}
 int SimpleFluid::cellNumber(int x, int y) const {
 	if (x < 0){
 		x += dim * (std::abs(x / dim) + 1);
@@ -344,3 +424,19 @@ void SimpleFluid::cellPos(int n, int &x, int &y) const {
 	x = n % dim;
 	y = (n - x) / dim;
 }
+void SimpleFluid::printSolveStats() const {
+	const char *names[] = { "zero", "previous", "extrapolated" };
+	for (int g = 0; g < 3; ++g){
+		if (solveStats[g].solves() != 0){
+			std::cout << "pressure solves from " << names[g] << " guess: ";
+			solveStats[g].print(std::cout);
+		}
+	}
+	for (size_t i = 0; i < pressureSolvers.size(); ++i){
+		if (pressureFrames[i] != 0){
+			std::cout << "pressure solves with " << pressureSolvers[i]->name() << ": "
+				<< pressureFrames[i] << " frames\n";
+		}
+	}
+	std::cout << "max CFL number: " << maxCFL << "\n";
+}
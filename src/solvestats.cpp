@@ -0,0 +1,119 @@
+#include <ostream>
+#include <cmath>
+#include <algorithm>
+#include "solvestats.h"
+
+SolveStats::SolveStats() : iterations(0), wastedIterations(0), initialResidual(0), finalResidual(0),
+	converged(false), tolerance(0), wallTime(0), budgetLimited(false), timed(false), spmvTime(0), reductionTime(0), updateTime(0), preconditionerTime(0)
+{}
+double SolveStats::deviceTime() const {
+	return spmvTime + reductionTime + updateTime + preconditionerTime;
+}
+std::ostream& operator<<(std::ostream &os, const SolveStats &s){
+	os << "solution took: " << s.iterations << " iterations, initial residual length: " << s.initialResidual
+		<< ", final residual length: " << s.finalResidual << ", wasted iterations: " << s.wastedIterations;
+	if (s.budgetLimited){
+		os << ", stopped by the time budget short of " << s.tolerance;
+	}
+	else if (!s.converged){
+		os << ", did not converge";
+	}
+	if (s.timed){
+		os << ", device time: " << s.deviceTime() << "ms (SpMV " << s.spmvTime << "ms, reductions "
+			<< s.reductionTime << "ms, updates " << s.updateTime << "ms, preconditioner "
+			<< s.preconditionerTime << "ms)";
+	}
+	return os;
+}
+
+SolveStatsSummary::SolveStatsSummary(){
+	clear();
+}
+void SolveStatsSummary::add(const SolveStats &s){
+	++count;
+	if (!s.converged){
+		++unconvergedCount;
+	}
+	if (s.budgetLimited){
+		++budgetLimitedCount;
+	}
+	wallTime += s.wallTime;
+	totalIterations += s.iterations;
+	iterationsSq += static_cast<double>(s.iterations) * s.iterations;
+	mostIterations = std::max(mostIterations, s.iterations);
+	worstResidual = std::max(worstResidual, s.finalResidual);
+	if (s.timed){
+		++timedCount;
+		spmvTime += s.spmvTime;
+		reductionTime += s.reductionTime;
+		updateTime += s.updateTime;
+		preconditionerTime += s.preconditionerTime;
+	}
+}
+void SolveStatsSummary::clear(){
+	count = 0;
+	unconvergedCount = 0;
+	budgetLimitedCount = 0;
+	timedCount = 0;
+	mostIterations = 0;
+	totalIterations = 0;
+	iterationsSq = 0;
+	worstResidual = 0;
+	wallTime = 0;
+	spmvTime = 0;
+	reductionTime = 0;
+	updateTime = 0;
+	preconditionerTime = 0;
+}
+int SolveStatsSummary::solves() const {
+	return count;
+}
+int SolveStatsSummary::unconverged() const {
+	return unconvergedCount;
+}
+int SolveStatsSummary::budgetLimited() const {
+	return budgetLimitedCount;
+}
+double SolveStatsSummary::meanWallTime() const {
+	return count == 0 ? 0 : wallTime / count;
+}
+double SolveStatsSummary::meanIterations() const {
+	return count == 0 ? 0 : static_cast<double>(totalIterations) / count;
+}
+double SolveStatsSummary::stddevIterations() const {
+	if (count == 0){
+		return 0;
+	}
+	double mean = meanIterations();
+	return std::sqrt(std::max(iterationsSq / count - mean * mean, 0.0));
+}
+int SolveStatsSummary::maxIterations() const {
+	return mostIterations;
+}
+float SolveStatsSummary::maxFinalResidual() const {
+	return worstResidual;
+}
+double SolveStatsSummary::meanSpMVTime() const {
+	return timedCount == 0 ? 0 : spmvTime / timedCount;
+}
+double SolveStatsSummary::meanReductionTime() const {
+	return timedCount == 0 ? 0 : reductionTime / timedCount;
+}
+double SolveStatsSummary::meanUpdateTime() const {
+	return timedCount == 0 ? 0 : updateTime / timedCount;
+}
+double SolveStatsSummary::meanPreconditionerTime() const {
+	return timedCount == 0 ? 0 : preconditionerTime / timedCount;
+}
+void SolveStatsSummary::print(std::ostream &os) const {
+	os << count << " solves, " << unconvergedCount << " didn't converge";
+	if (budgetLimitedCount != 0){
+		os << " (" << budgetLimitedCount << " stopped by the time budget)";
+	}
+	os << ", iterations mean " << meanIterations() << " stddev " << stddevIterations() << " max " << mostIterations
+		<< ", max final residual length " << worstResidual << ", mean wall time " << meanWallTime() << "ms\n";
+	if (timedCount != 0){
+		os << "mean device time per solve: SpMV " << meanSpMVTime() << "ms, reductions " << meanReductionTime()
+			<< "ms, updates " << meanUpdateTime() << "ms, preconditioner " << meanPreconditionerTime() << "ms\n";
+	}
+}
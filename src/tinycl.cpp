@@ -1,26 +1,38 @@
 #define __CL_ENABLE_EXCEPTIONS
 
 #include <iostream>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+#ifndef TCL_NO_GL
 #include <GL/glew.h>
+#endif
 #include <CL/cl.hpp>
 #include "util.h"
 #include "tinycl.h"
 
-tcl::Context::Context(DEVICE dev, bool interop, bool profile){
+tcl::Context::Context(DEVICE dev, bool interop, bool profile) : mKernelEvents(nullptr), mReducePartialSize(0)
+{
 	if (interop){
+#ifdef TCL_NO_GL
+		throw std::runtime_error("tcl::Context built with TCL_NO_GL can't make an interop context");
+#else
 		selectInteropDevice(dev, profile);
+#endif
 	}
 	else {
 		selectDevice(dev, profile);
 	}
+	//Room for the result of any type reduced to the host
+	mReduceResult = buffer(READ_WRITE, sizeof(double), nullptr);
 }
-cl::Program tcl::Context::loadProgram(const std::string &file){
+cl::Program tcl::Context::loadProgram(const std::string &file, const std::string &options){
 	cl::Program prog;
 	try {
 		std::string content = util::readFile(file);
 		cl::Program::Sources src(1, std::make_pair(content.c_str(), content.size()));
 		prog = cl::Program(mContext, src);
-		prog.build(mDevices);
+		prog.build(mDevices, options.c_str());
 		return prog;
 	}
 	catch (const cl::Error &e){
@@ -48,6 +60,7 @@ cl::Buffer tcl::Context::buffer(int mem, size_t size, const void *data, size_t o
 		throw e;
 	}
 }
+#ifndef TCL_NO_GL
 cl::BufferGL tcl::Context::bufferGL(int mem, GLuint buf){
 	try {
 		return cl::BufferGL(mContext, mem, buf);
@@ -79,6 +92,7 @@ cl::Image2DGL tcl::Context::imageGL(int mem, GLuint tex){
 	}
 }
 
+#endif
 #endif
 void tcl::Context::writeData(cl::Buffer &buf, size_t size, const void *data, size_t offset, bool blocking,
 	const std::vector<cl::Event> *depends, cl::Event *notify)
@@ -106,6 +120,10 @@ void tcl::Context::runNDKernel(cl::Kernel &kernel, cl::NDRange global, cl::NDRan
 	cl::NDRange offset, bool blocking, const std::vector<cl::Event> *depends,
 	cl::Event *notify)
 {
+	if (notify == nullptr && mKernelEvents != nullptr){
+		mKernelEvents->push_back(cl::Event());
+		notify = &mKernelEvents->back();
+	}
 	try {
 		mQueue.enqueueNDRangeKernel(kernel, offset, global, local, depends, notify);
 	}
@@ -114,6 +132,146 @@ void tcl::Context::runNDKernel(cl::Kernel &kernel, cl::NDRange global, cl::NDRan
 		throw e;
 	}
 }
+void tcl::Context::recordKernelEvents(std::vector<cl::Event> *events){
+	mKernelEvents = events;
+}
+bool tcl::Context::profilingEnabled() const {
+	return (mQueue.getInfo<CL_QUEUE_PROPERTIES>() & CL_QUEUE_PROFILING_ENABLE) != 0;
+}
+int tcl::Context::powerOfTwoGroupSize(const std::vector<cl::Kernel> &kernels, int limit) const {
+	const cl::Device &device = mDevices.at(0);
+	size_t maxGroup = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+	for (const cl::Kernel &k : kernels){
+		maxGroup = std::min(maxGroup, k.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+	}
+	int size = 1;
+	while (size * 2 <= static_cast<int>(maxGroup) && size < limit){
+		size *= 2;
+	}
+	return size;
+}
+tcl::Context::ReduceKernels& tcl::Context::reduceKernels(const std::string &type, REDUCE op){
+	const char *opNames[] = { "SUM", "MAX", "MIN", "DOT" };
+	std::string key = type + " " + opNames[op];
+	std::map<std::string, ReduceKernels>::iterator found = mReduceKernels.find(key);
+	if (found != mReduceKernels.end()){
+		return found->second;
+	}
+	const cl::Device &device = mDevices.at(0);
+	bool fp64 = device.getInfo<CL_DEVICE_EXTENSIONS>().find("cl_khr_fp64") != std::string::npos;
+	if (type == "double" && !fp64){
+		throw std::runtime_error("tcl::Context: the device doesn't support double reductions");
+	}
+	bool floating = type == "float" || type == "double";
+	bool sum = op == REDUCE::SUM || op == REDUCE::DOT;
+	//Sums of floats accumulate in double if we can, otherwise in float with compensated sums
+	std::string acc = type == "float" && sum && fp64 ? "double" : type;
+	std::string identity = "0";
+	if (op == REDUCE::MAX){
+		identity = floating ? "-INFINITY" : type == "int" ? "INT_MIN" : "0";
+	}
+	else if (op == REDUCE::MIN){
+		identity = floating ? "INFINITY" : type == "int" ? "INT_MAX" : "UINT_MAX";
+	}
+	std::string options = "-DT=" + type + " -DACC=" + acc + " -DOP_" + opNames[op] + " -DIDENTITY=" + identity;
+	if (acc == "double"){
+		options += " -DUSE_DOUBLE";
+	}
+	else if (acc == "float" && sum){
+		options += " -DCOMPENSATE";
+	}
+
+	ReduceKernels kernels;
+	kernels.program = loadProgram("../res/reduce.cl", options);
+	kernels.reduce_partial = cl::Kernel(kernels.program, "reduce_partial");
+	kernels.reduce_final = cl::Kernel(kernels.program, "reduce_final");
+	kernels.scan_blocks = cl::Kernel(kernels.program, "scan_blocks");
+	kernels.add_block_offsets = cl::Kernel(kernels.program, "add_block_offsets");
+	kernels.accSize = acc == "double" ? sizeof(double) : sizeof(float);
+	kernels.groupSize = powerOfTwoGroupSize({ kernels.reduce_partial, kernels.reduce_final,
+		kernels.scan_blocks, kernels.add_block_offsets });
+	return mReduceKernels[key] = kernels;
+}
+void tcl::Context::reserveScratch(cl::Buffer &buf, size_t &bufSize, size_t size){
+	if (bufSize < size){
+		buf = buffer(READ_WRITE, size, nullptr);
+		bufSize = size;
+	}
+}
+void tcl::Context::reduceBuffer(const std::string &type, REDUCE op, const cl::Buffer &a,
+	const cl::Buffer *b, size_t n, cl::Buffer &out, size_t outIdx, cl::Event *notify)
+{
+	if (op == REDUCE::DOT && b == nullptr){
+		throw std::runtime_error("tcl::Context::reduce: a DOT needs a second vector");
+	}
+	ReduceKernels &kernels = reduceKernels(type, op);
+	int groupSize = kernels.groupSize;
+	//Limit the # of groups so the final pass has at most one partial per work item
+	int nGroups = std::max(std::min(groupSize, static_cast<int>((n + groupSize - 1) / groupSize)), 1);
+	//The queue is in order so the partials can be shared by every reduction
+	reserveScratch(mReducePartial, mReducePartialSize, nGroups * sizeof(double));
+
+	kernels.reduce_partial.setArg(0, a);
+	kernels.reduce_partial.setArg(1, b != nullptr ? *b : a);
+	kernels.reduce_partial.setArg(2, static_cast<int>(n));
+	kernels.reduce_partial.setArg(3, cl::__local(groupSize * kernels.accSize));
+	kernels.reduce_partial.setArg(4, mReducePartial);
+	runNDKernel(kernels.reduce_partial, cl::NDRange(nGroups * groupSize), cl::NDRange(groupSize), cl::NullRange);
+	kernels.reduce_final.setArg(0, mReducePartial);
+	kernels.reduce_final.setArg(1, nGroups);
+	kernels.reduce_final.setArg(2, cl::__local(groupSize * kernels.accSize));
+	kernels.reduce_final.setArg(3, out);
+	kernels.reduce_final.setArg(4, static_cast<int>(outIdx));
+	runNDKernel(kernels.reduce_final, cl::NDRange(groupSize), cl::NDRange(groupSize), cl::NullRange,
+		false, nullptr, notify);
+}
+void tcl::Context::scanBuffer(const std::string &type, size_t typeSize, REDUCE op, const cl::Buffer &in,
+	cl::Buffer &out, size_t n, cl::Event *notify)
+{
+	if (op == REDUCE::DOT){
+		throw std::runtime_error("tcl::Context::exclusiveScan: DOT isn't a scan operation");
+	}
+	if (n == 0){
+		return;
+	}
+	ReduceKernels &kernels = reduceKernels(type, op);
+	//Each level only shrinks the block totals to scan by the group size
+	if (kernels.groupSize < 2){
+		throw std::runtime_error("tcl::Context::exclusiveScan: the device can't run the scan's work groups");
+	}
+	scanLevel(kernels, typeSize, in, out, n, 0, notify);
+}
+void tcl::Context::scanLevel(ReduceKernels &kernels, size_t typeSize, const cl::Buffer &in, cl::Buffer &out,
+	size_t n, size_t level, cl::Event *notify)
+{
+	int groupSize = kernels.groupSize;
+	size_t nBlocks = (n + groupSize - 1) / groupSize;
+	if (mScanSums.size() <= level){
+		mScanSums.resize(level + 1);
+		mScanSumsSize.resize(level + 1, 0);
+	}
+	reserveScratch(mScanSums[level], mScanSumsSize[level], nBlocks * typeSize);
+	//Hold the level's buffer by value, the next level may grow mScanSums
+	cl::Buffer sums = mScanSums[level];
+	cl::NDRange global(nBlocks * groupSize), local(groupSize);
+
+	kernels.scan_blocks.setArg(0, in);
+	kernels.scan_blocks.setArg(1, out);
+	kernels.scan_blocks.setArg(2, static_cast<int>(n));
+	kernels.scan_blocks.setArg(3, cl::__local(groupSize * typeSize));
+	kernels.scan_blocks.setArg(4, sums);
+	if (nBlocks == 1){
+		runNDKernel(kernels.scan_blocks, global, local, cl::NullRange, false, nullptr, notify);
+		return;
+	}
+	runNDKernel(kernels.scan_blocks, global, local, cl::NullRange);
+	//Scan the block totals in place to get the offset of each block
+	scanLevel(kernels, typeSize, sums, sums, nBlocks, level + 1, nullptr);
+	kernels.add_block_offsets.setArg(0, out);
+	kernels.add_block_offsets.setArg(1, static_cast<int>(n));
+	kernels.add_block_offsets.setArg(2, sums);
+	runNDKernel(kernels.add_block_offsets, global, local, cl::NullRange, false, nullptr, notify);
+}
 void tcl::Context::selectDevice(DEVICE dev, bool profile){
 	try {
 		cl::Platform::get(&mPlatforms);
@@ -153,6 +311,7 @@ void tcl::Context::selectDevice(DEVICE dev, bool profile){
 		throw e;
 	}
 }
+#ifndef TCL_NO_GL
 void tcl::Context::selectInteropDevice(DEVICE dev, bool profile){
 	try {
 		//We assume only the first device and platform will be used
@@ -201,3 +360,4 @@ void tcl::Context::selectInteropDevice(DEVICE dev, bool profile){
 		throw e;
 	}
 }
+#endif
@@ -2,12 +2,14 @@
 #include <iostream>
 #include <ostream>
 #include <fstream>
+#ifndef TCL_NO_GL
 #include <GL/glew.h>
 #if defined(_MSC_VER)
 #include <SDL.h>
 #else
 #include <SDL2/SDL.h>
 #endif
+#endif
 #define __CL_ENABLE_EXCEPTIONS
 #include <CL/cl.hpp>
 
@@ -22,6 +24,7 @@ std::string util::readFile(const std::string &file){
 	}
 	return content;
 }
+#ifndef TCL_NO_GL
 GLint util::loadShader(const std::string &file, GLenum shaderType){
 	GLuint shader = glCreateShader(shaderType);
 	std::string src = readFile(file);
@@ -106,6 +109,7 @@ bool util::logGLError(std::ostream &os, const std::string &msg){
 		<< " - " << gluErrorString(err) << "\n";
 	return true;
 }
+#endif
 void util::logCLError(std::ostream &os, const cl::Error &e, const std::string &msg){
 	os << "OpenCL Error! " << msg << " at: " << e.what() 
 		<< " error: # " << e.err() << " - " << clErrorString(e.err())